@@ -551,10 +551,7 @@ void rb3_sw(void *km, const rb3_swopt_t *opt, const rb3_fmi_t *f, int len, const
 			rb3_swhit_t *hit = &rst->a[k];
 			int32_t n = rest > 0? rest : 1;
 			hit->pos = RB3_CALLOC(rb3_pos_t, n);
-			if (f->srindex)
-				hit->n_pos = rb3_srindex_multi(km, f, f->srindex, hit->lo, hit->hi, n, hit->pos);
-			else
-				hit->n_pos = rb3_ssa_multi(km, f, f->ssa, hit->lo, hit->hi, n, hit->pos);
+			hit->n_pos = rb3_fmi_locate(km, f, hit->lo, hit->hi, n, hit->pos);
 			rest -= hit->n_pos;
 		}
 	}
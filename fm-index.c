@@ -1,5 +1,9 @@
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "rb3priv.h"
 #include "fm-index.h"
 #include "move.h"
@@ -414,6 +418,223 @@ void rb3_fmi_rank2a_cached(const rb3_fmi_t *fmi, void *rc_, int64_t k, int64_t l
 	}
 }
 
+/*****************
+ * Locate cache *
+ *****************/
+
+/*
+ * A sharded LRU cache from (lo,hi,max_pos) to located positions. Highly
+ * repetitive intervals are located again and again by different queries;
+ * each shard has its own lock such that threads rarely wait on each other.
+ */
+
+#define RB3_PC_SHARD_BITS 6
+
+typedef struct {
+	int64_t lo, hi, max_pos;
+} pc_key_t;
+
+#define pc_key_hash(a) (kh_hash_uint64((a).lo) ^ kh_hash_uint64((a).hi + (a).max_pos))
+#define pc_key_eq(a, b) ((a).lo == (b).lo && (a).hi == (b).hi && (a).max_pos == (b).max_pos)
+KHASHL_MAP_INIT(KH_LOCAL, pc_hash_t, pc_hash, pc_key_t, int32_t, pc_key_hash, pc_key_eq)
+
+typedef struct {
+	pc_key_t key;
+	int32_t prev, next; // doubly linked list in the LRU order; -1 for none
+	int64_t n;
+	rb3_pos_t *pos;
+} pc_entry_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pc_hash_t *h;
+	int32_t n_ent, m_ent, head, tail, free_ent; // head is the most recently used; free_ent heads a list of unused entries
+	pc_entry_t *ent;
+	int64_t n_pos, n_hit, n_miss;
+} pc_shard_t;
+
+struct rb3_pcache_s {
+	int64_t max_pos; // max number of positions held by each shard
+	pc_shard_t shard[1<<RB3_PC_SHARD_BITS];
+};
+
+rb3_pcache_t *rb3_pcache_init(int64_t max_pos)
+{
+	rb3_pcache_t *pc;
+	int32_t i;
+	pc = RB3_CALLOC(rb3_pcache_t, 1);
+	pc->max_pos = (max_pos + (1<<RB3_PC_SHARD_BITS) - 1) >> RB3_PC_SHARD_BITS;
+	for (i = 0; i < 1<<RB3_PC_SHARD_BITS; ++i) {
+		pc_shard_t *s = &pc->shard[i];
+		pthread_mutex_init(&s->lock, 0);
+		s->h = pc_hash_init();
+		s->head = s->tail = s->free_ent = -1;
+	}
+	return pc;
+}
+
+void rb3_pcache_destroy(rb3_pcache_t *pc)
+{
+	int32_t i, j;
+	if (pc == 0) return;
+	for (i = 0; i < 1<<RB3_PC_SHARD_BITS; ++i) {
+		pc_shard_t *s = &pc->shard[i];
+		for (j = 0; j < s->n_ent; ++j)
+			free(s->ent[j].pos);
+		free(s->ent);
+		pc_hash_destroy(s->h);
+		pthread_mutex_destroy(&s->lock);
+	}
+	free(pc);
+}
+
+void rb3_pcache_stat(const rb3_pcache_t *pc, int64_t *n_hit, int64_t *n_miss)
+{
+	int32_t i;
+	*n_hit = *n_miss = 0;
+	if (pc == 0) return;
+	for (i = 0; i < 1<<RB3_PC_SHARD_BITS; ++i)
+		*n_hit += pc->shard[i].n_hit, *n_miss += pc->shard[i].n_miss;
+}
+
+static inline pc_shard_t *pc_get_shard(rb3_pcache_t *pc, const pc_key_t *key)
+{
+	return &pc->shard[pc_key_hash(*key) & ((1<<RB3_PC_SHARD_BITS) - 1)];
+}
+
+static void pc_unlink(pc_shard_t *s, int32_t i)
+{
+	pc_entry_t *e = &s->ent[i];
+	if (e->prev >= 0) s->ent[e->prev].next = e->next;
+	else s->head = e->next;
+	if (e->next >= 0) s->ent[e->next].prev = e->prev;
+	else s->tail = e->prev;
+	e->prev = e->next = -1;
+}
+
+static void pc_push_front(pc_shard_t *s, int32_t i)
+{
+	pc_entry_t *e = &s->ent[i];
+	e->prev = -1, e->next = s->head;
+	if (s->head >= 0) s->ent[s->head].prev = i;
+	s->head = i;
+	if (s->tail < 0) s->tail = i;
+}
+
+static int64_t pc_get(rb3_pcache_t *pc, int64_t lo, int64_t hi, int64_t max_pos, rb3_pos_t *pos)
+{
+	pc_key_t key;
+	pc_shard_t *s;
+	khint_t k;
+	int64_t n = -1;
+	key.lo = lo, key.hi = hi, key.max_pos = max_pos;
+	s = pc_get_shard(pc, &key);
+	pthread_mutex_lock(&s->lock);
+	k = pc_hash_get(s->h, key);
+	if (k != kh_end(s->h)) {
+		int32_t i = kh_val(s->h, k);
+		n = s->ent[i].n;
+		memcpy(pos, s->ent[i].pos, n * sizeof(rb3_pos_t));
+		pc_unlink(s, i);
+		pc_push_front(s, i);
+		++s->n_hit;
+	} else ++s->n_miss;
+	pthread_mutex_unlock(&s->lock);
+	return n;
+}
+
+static void pc_put(rb3_pcache_t *pc, int64_t lo, int64_t hi, int64_t max_pos, int64_t n, const rb3_pos_t *pos)
+{
+	pc_key_t key;
+	pc_shard_t *s;
+	khint_t k;
+	int32_t i;
+	int absent;
+	if (n <= 0 || n > pc->max_pos) return;
+	key.lo = lo, key.hi = hi, key.max_pos = max_pos;
+	s = pc_get_shard(pc, &key);
+	pthread_mutex_lock(&s->lock);
+	k = pc_hash_put(s->h, key, &absent);
+	if (!absent) { // added by another thread in the meantime
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	while (s->n_pos + n > pc->max_pos && s->tail >= 0) { // evict the least recently used
+		pc_entry_t *e;
+		i = s->tail;
+		e = &s->ent[i];
+		pc_unlink(s, i);
+		pc_hash_del(s->h, pc_hash_get(s->h, e->key));
+		s->n_pos -= e->n;
+		free(e->pos);
+		e->pos = 0, e->n = 0;
+		e->next = s->free_ent, s->free_ent = i;
+	}
+	k = pc_hash_get(s->h, key); // deletion may have moved the bucket
+	if (s->free_ent >= 0) {
+		i = s->free_ent;
+		s->free_ent = s->ent[i].next;
+	} else {
+		RB3_GROW(pc_entry_t, s->ent, s->n_ent, s->m_ent);
+		i = s->n_ent++;
+	}
+	s->ent[i].key = key, s->ent[i].n = n;
+	s->ent[i].pos = RB3_MALLOC(rb3_pos_t, n);
+	memcpy(s->ent[i].pos, pos, n * sizeof(rb3_pos_t));
+	kh_val(s->h, k) = i;
+	pc_push_front(s, i);
+	s->n_pos += n;
+	pthread_mutex_unlock(&s->lock);
+}
+
+int64_t rb3_fmi_locate(void *km, const rb3_fmi_t *f, int64_t lo, int64_t hi, int64_t max_pos, rb3_pos_t *pos)
+{
+	int64_t n;
+	if (max_pos <= 0 || lo >= hi) return 0;
+	if (f->pc && (n = pc_get(f->pc, lo, hi, max_pos, pos)) >= 0)
+		return n;
+	if (f->srindex)
+		n = rb3_srindex_multi(km, f, f->srindex, lo, hi, max_pos, pos);
+	else if (f->ssa)
+		n = rb3_ssa_multi(km, f, f->ssa, lo, hi, max_pos, pos);
+	else return 0;
+	if (f->pc) pc_put(f->pc, lo, hi, max_pos, n, pos);
+	return n;
+}
+
+void rb3_fmi_locate_batch(void *km, const rb3_fmi_t *f, int32_t n, const int64_t *lo, const int64_t *hi, int64_t max_pos, int64_t *n_pos, rb3_pos_t **pos)
+{
+	int32_t i, n_miss = 0, *miss;
+	int64_t *mlo, *mhi, *mn;
+	rb3_pos_t **mpos;
+	if (n <= 0) return;
+	miss = Kmalloc(km, int32_t, n);
+	for (i = 0; i < n; ++i) {
+		n_pos[i] = 0;
+		if (max_pos <= 0 || lo[i] >= hi[i]) continue;
+		if (f->pc && (n_pos[i] = pc_get(f->pc, lo[i], hi[i], max_pos, pos[i])) >= 0) continue;
+		n_pos[i] = 0, miss[n_miss++] = i;
+	}
+	if (n_miss == 0 || (f->srindex == 0 && f->ssa == 0)) {
+		kfree(km, miss);
+		return;
+	}
+	mlo = Kmalloc(km, int64_t, n_miss * 3);
+	mhi = mlo + n_miss, mn = mhi + n_miss;
+	mpos = Kmalloc(km, rb3_pos_t*, n_miss);
+	for (i = 0; i < n_miss; ++i)
+		mlo[i] = lo[miss[i]], mhi[i] = hi[miss[i]], mpos[i] = pos[miss[i]];
+	if (f->srindex) {
+		for (i = 0; i < n_miss; ++i)
+			mn[i] = rb3_srindex_multi(km, f, f->srindex, mlo[i], mhi[i], max_pos, mpos[i]);
+	} else rb3_ssa_multi_batch(km, f, f->ssa, n_miss, mlo, mhi, max_pos, mn, mpos);
+	for (i = 0; i < n_miss; ++i) {
+		n_pos[miss[i]] = mn[i];
+		if (f->pc) pc_put(f->pc, mlo[i], mhi[i], max_pos, mn[i], mpos[i]);
+	}
+	kfree(km, mpos); kfree(km, mlo); kfree(km, miss);
+}
+
 /***************
  * Exact match *
  ***************/
@@ -517,6 +738,15 @@ int64_t rb3_fmd_smem(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t *q
 	return mem->n;
 }
 
+static inline int64_t rb3_fmd_start_back(const rb3_fmi_t *f, const uint8_t *q, int64_t end, int64_t lim, int64_t min_occ, rb3_sai_t *ik)
+{ // set ik to the interval of q[i+1..end) and return i, the next position to extend, where i+1>=lim
+	const rb3_kmi_t *ki = f->kmi;
+	if (ki && end - lim >= ki->k && rb3_kmi_get(ki, &q[end - ki->k], ik) >= (min_occ > 1? min_occ : 1))
+		return end - ki->k - 1; // as the interval size is monotonic, backward search would not stop before the k-mer
+	rb3_fmd_set_intv(f, q[end - 1], ik);
+	return end - 2;
+}
+
 int64_t rb3_fmd_smem1_TG(void *km, const rb3_fmi_t *f, int64_t min_occ, int64_t min_len, int64_t len, const uint8_t *q, int64_t x, rb3_sai_v *mem, int32_t check_long)
 {
 	int64_t i, j;
@@ -524,8 +754,7 @@ int64_t rb3_fmd_smem1_TG(void *km, const rb3_fmi_t *f, int64_t min_occ, int64_t
 
 	assert(len <= INT32_MAX); // this can be relaxed if we define a new struct for mem
 	if (len - x < min_len) return len;
-	rb3_fmd_set_intv(f, q[x + min_len - 1], &ik);
-	for (i = x + min_len - 2; i >= x; --i) { // backward extension
+	for (i = rb3_fmd_start_back(f, q, x + min_len, x, min_occ, &ik); i >= x; --i) { // backward extension
 		int c = q[i];
 		rb3_fmd_extend(f, &ik, ok, 1);
 		if (ok[c].size < min_occ) break;
@@ -544,8 +773,7 @@ int64_t rb3_fmd_smem1_TG(void *km, const rb3_fmi_t *f, int64_t min_occ, int64_t
 	*p = ik;
 	p->info = (uint64_t)x<<32 | j;
 	if (j == len) return len;
-	rb3_fmd_set_intv(f, q[j], &ik);
-	for (i = j - 1; i > x; --i) { // backward extension again
+	for (i = rb3_fmd_start_back(f, q, j + 1, x + 1, min_occ, &ik); i > x; --i) { // backward extension again
 		int c = q[i];
 		rb3_fmd_extend(f, &ik, ok, 1);
 		if (ok[c].size < min_occ) break;
@@ -564,6 +792,22 @@ int64_t rb3_fmd_smem_TG(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t
 	return mem->n;
 }
 
+int64_t rb3_fmd_smem_TG_range(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t *q, int64_t st, int64_t en, rb3_sai_v *mem, int64_t min_occ, int64_t min_len)
+{ // MEMs starting in [st,en); concatenating the output of consecutive ranges gives the output of rb3_fmd_smem_TG()
+	int64_t x = st;
+	mem->n = 0;
+	if (x >= en) return 0;
+	x = rb3_fmd_smem1_TG(km, f, min_occ, min_len, len, q, x, mem, 0);
+	if (st > 0 && mem->n == 1) { // TG assumes q[st-1] can't be added; drop the first MEM if it is not left-maximal
+		rb3_sai_t ok[RB3_ASIZE];
+		rb3_fmd_extend(f, &mem->a[0], ok, 1);
+		if (ok[q[st-1]].size >= min_occ) mem->n = 0;
+	}
+	while (x < en)
+		x = rb3_fmd_smem1_TG(km, f, min_occ, min_len, len, q, x, mem, 0);
+	return mem->n;
+}
+
 int32_t rb3_fmd_smem_present(const rb3_fmi_t *f, int64_t len, const uint8_t *q, int64_t min_len)
 {
 	int64_t x = 0;
@@ -628,27 +872,168 @@ int64_t rb3_fmi_get_r(const rb3_fmi_t *f)
 	return r;
 }
 
+static int load_probe(const rb3_pack_t *pk, const char *fn, const char *tag, const char *suffix, char *buf, const rb3_pack_sec_t **sec)
+{ // return 1 if a component is present, either as a file or as a section of container pk; buf keeps the file name for messages
+	FILE *fp;
+	*sec = 0;
+	if (pk) {
+		strcpy(buf, fn);
+		*sec = rb3_pack_get(pk, tag);
+		return *sec != 0;
+	}
+	strcat(strcpy(buf, fn), suffix);
+	if ((fp = fopen(buf, "r")) == 0) return 0;
+	fclose(fp);
+	return 1;
+}
+
+static void *load_map(const char *fn, const rb3_pack_sec_t *sec) // map a section of a container
+{
+	void *p;
+	int fd;
+	if ((fd = open(fn, O_RDONLY)) < 0) return 0;
+	p = mmap(0, sec->size > 0? sec->size : 1, PROT_READ, MAP_SHARED, fd, sec->off);
+	close(fd);
+	return p == MAP_FAILED? 0 : p;
+}
+
+enum { LOAD_BWT, LOAD_SRI, LOAD_SSA, LOAD_SID, LOAD_MVI, LOAD_KMI };
+
+typedef struct {
+	int32_t type;
+	const rb3_pack_sec_t *sec; // non-NULL if loaded from a container section
+	char *fn; // file name of the component
+	void *p; // the loaded component
+	struct rb3_bmove_s *bm; // built from the move index
+} load_comp_t;
+
+typedef struct {
+	const char *fn;
+	int32_t load_flag, n_comp;
+	load_comp_t comp[6];
+	rb3_fmi_t bwt;
+} load_aux_t;
+
+static void load_worker(void *data, long i, int tid) // load one component
+{
+	load_aux_t *a = (load_aux_t*)data;
+	load_comp_t *c = &a->comp[i];
+	const rb3_pack_sec_t *sec = c->sec;
+	if (c->type == LOAD_BWT) {
+		rb3_fmi_restore(&a->bwt, a->fn, a->load_flag & RB3_LOAD_MMAP);
+	} else if (c->type == LOAD_SRI) {
+		c->p = sec? rb3_srindex_restore_mmap_at(a->fn, sec->off, sec->size) : a->load_flag & RB3_LOAD_MMAP? rb3_srindex_restore_mmap(c->fn) : rb3_srindex_restore(c->fn);
+	} else if (c->type == LOAD_SSA) {
+		c->p = sec? rb3_ssa_restore_mmap_at(a->fn, sec->off, sec->size) : a->load_flag & RB3_LOAD_MMAP? rb3_ssa_restore_mmap(c->fn) : rb3_ssa_restore(c->fn);
+	} else if (c->type == LOAD_SID) {
+		c->p = sec? rb3_sid_read_at(a->fn, sec->off, sec->size) : rb3_sid_read(c->fn);
+	} else if (c->type == LOAD_MVI) {
+		rb3_move_t *mv;
+		if (sec) {
+			uint8_t *p = (uint8_t*)load_map(a->fn, sec);
+			mv = p? rb3_move_load_mem(p, sec->size) : 0;
+			if (p) munmap(p, sec->size > 0? sec->size : 1);
+		} else mv = rb3_move_load(c->fn);
+		c->p = mv;
+		if (mv) c->bm = rb3_bmove_init(mv); // destroyed later if the move index doesn't match the BWT
+	} else if (c->type == LOAD_KMI) {
+		c->p = sec? rb3_kmi_load_at(a->fn, sec->off, sec->size) : rb3_kmi_load(c->fn);
+	}
+}
+
+static void load_add(load_aux_t *a, const rb3_pack_t *pk, int32_t type, const char *tag, const char *suffix)
+{
+	load_comp_t *c = &a->comp[a->n_comp];
+	c->fn = RB3_CALLOC(char, strlen(a->fn) + 8);
+	if (type == LOAD_BWT) strcpy(c->fn, a->fn);
+	else if (!load_probe(pk, a->fn, tag, suffix, c->fn, &c->sec)) {
+		free(c->fn);
+		return;
+	}
+	c->type = type;
+	++a->n_comp;
+}
+
+static load_comp_t *load_get(load_aux_t *a, int32_t type)
+{
+	int32_t i;
+	for (i = 0; i < a->n_comp; ++i)
+		if (a->comp[i].type == type)
+			return &a->comp[i];
+	return 0;
+}
+
 int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag)
 {
-	FILE *fp;
-	char *buf;
-	rb3_fmi_restore(f, fn, load_flag&RB3_LOAD_MMAP);
+	char *shm = 0;
+	int32_t i;
+	rb3_pack_t *pk;
+	load_aux_t a;
+	load_comp_t *c;
+	if (rb3_shm_enabled() && (shm = rb3_shm_find(fn)) != 0) { // attach to the shared-memory image created by "ropebwt3 shm-load"
+		if (rb3_verbose >= 3)
+			fprintf(stderr, "[M::%s] attaching to the shared-memory image %s\n", __func__, shm);
+		fn = shm, load_flag |= RB3_LOAD_MMAP;
+	}
+
+	// decide what to load: only one of SR-index and SSA is used for locate, and the SR-index takes precedence
+	memset(&a, 0, sizeof(a));
+	a.fn = fn, a.load_flag = load_flag;
+	pk = rb3_pack_read(fn); // NULL unless fn is a container
+	load_add(&a, pk, LOAD_BWT, 0, 0);
+	if (load_flag & RB3_LOAD_SSA) {
+		load_add(&a, pk, LOAD_SRI, "SRI ", ".sri");
+		if (load_get(&a, LOAD_SRI) == 0)
+			load_add(&a, pk, LOAD_SSA, "SSA ", ".ssa");
+	}
+	if ((load_flag & RB3_LOAD_SSA) && (load_flag & RB3_LOAD_SID)) {
+		load_add(&a, pk, LOAD_SID, "SID ", ".sid");
+		if (load_get(&a, LOAD_SID) == 0)
+			load_add(&a, pk, LOAD_SID, "SID ", ".len.gz");
+	}
+	load_add(&a, pk, LOAD_MVI, "MVI ", ".mvi");
+	load_add(&a, pk, LOAD_KMI, "KMI ", ".kmi");
+
+	// load the components in parallel; they are independent of each other
+	kt_for(a.n_comp, load_worker, &a, a.n_comp);
+	if ((c = load_get(&a, LOAD_SRI)) != 0 && (c->p == 0 || ((rb3_srindex_t*)c->p)->m != a.bwt.acc[1]) && (load_flag & RB3_LOAD_SSA)) { // fall back to SSA if SR-index is broken or stale
+		if (c->p == 0 && rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to load SR-index from file \"%s\"\n", c->fn);
+		load_add(&a, pk, LOAD_SSA, "SSA ", ".ssa");
+		if ((c = load_get(&a, LOAD_SSA)) != 0)
+			load_worker(&a, c - a.comp, 0);
+	}
+
+	// check consistency in a fixed order
+	*f = a.bwt;
 	if (f->e == 0 && f->r == 0) {
 		if (rb3_verbose >= 1)
 			fprintf(stderr, "ERROR: failed to load BWT from file \"%s\"\n", fn);
-		return -1;
-	}
-	if (rb3_verbose >= 3)
+	} else if (rb3_verbose >= 3)
 		fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the BWT\n", __func__, rb3_realtime(), rb3_percent_cpu());
-	buf = RB3_CALLOC(char, strlen(fn) + 8);
-	if (load_flag & RB3_LOAD_SSA) {
-		strcat(strcpy(buf, fn), ".ssa");
-		if ((fp = fopen(buf, "r")) != 0) {
-			fclose(fp);
-			f->ssa = rb3_ssa_restore(buf);
+	for (i = 0; i < a.n_comp; ++i) {
+		c = &a.comp[i];
+		if (f->e == 0 && f->r == 0) { // free everything
+			if (c->type == LOAD_SRI) rb3_srindex_destroy((rb3_srindex_t*)c->p);
+			else if (c->type == LOAD_SSA) rb3_ssa_destroy((rb3_ssa_t*)c->p);
+			else if (c->type == LOAD_SID) rb3_sid_destroy((rb3_sid_t*)c->p);
+			else if (c->type == LOAD_MVI) rb3_bmove_destroy(c->bm), rb3_move_destroy((rb3_move_t*)c->p);
+			else if (c->type == LOAD_KMI) rb3_kmi_destroy((rb3_kmi_t*)c->p);
+		} else if (c->type == LOAD_SRI && c->p) {
+			f->srindex = (rb3_srindex_t*)c->p;
+			if (f->srindex->m != f->acc[1]) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "ERROR: number of sequences do not match between BWT and SR-index\n");
+				rb3_srindex_destroy(f->srindex);
+				f->srindex = 0;
+			}
+			if (f->srindex && rb3_verbose >= 3)
+				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the SR-index\n", __func__, rb3_realtime(), rb3_percent_cpu());
+		} else if (c->type == LOAD_SSA) {
+			f->ssa = (rb3_ssa_t*)c->p;
 			if (f->ssa == 0) {
 				if (rb3_verbose >= 1)
-					fprintf(stderr, "ERROR: failed to load sampled suffix array from file \"%s\"\n", buf);
+					fprintf(stderr, "ERROR: failed to load sampled suffix array from file \"%s\"\n", c->fn);
 			} else if (f->ssa->m != f->acc[1]) {
 				if (rb3_verbose >= 1)
 					fprintf(stderr, "ERROR: number of sequences do not match between BWT and sampled suffix array\n");
@@ -657,34 +1042,11 @@ int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag)
 			}
 			if (rb3_verbose >= 3)
 				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the sampled suffix array\n", __func__, rb3_realtime(), rb3_percent_cpu());
-		}
-	}
-	if (load_flag & RB3_LOAD_SSA) {
-		strcat(strcpy(buf, fn), ".sri");
-		if ((fp = fopen(buf, "r")) != 0) {
-			fclose(fp);
-			f->srindex = rb3_srindex_restore(buf);
-			if (f->srindex == 0) {
-				if (rb3_verbose >= 1)
-					fprintf(stderr, "ERROR: failed to load SR-index from file \"%s\"\n", buf);
-			} else if (f->srindex->m != f->acc[1]) {
-				if (rb3_verbose >= 1)
-					fprintf(stderr, "ERROR: number of sequences do not match between BWT and SR-index\n");
-				rb3_srindex_destroy(f->srindex);
-				f->srindex = 0;
-			}
-			if (f->srindex && rb3_verbose >= 3)
-				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the SR-index\n", __func__, rb3_realtime(), rb3_percent_cpu());
-		}
-	}
-	if ((load_flag & RB3_LOAD_SSA) && (load_flag & RB3_LOAD_SID)) {
-		strcat(strcpy(buf, fn), ".len.gz");
-		if ((fp = fopen(buf, "r")) != 0) {
-			fclose(fp);
-			f->sid = rb3_sid_read(buf);
+		} else if (c->type == LOAD_SID) {
+			f->sid = (rb3_sid_t*)c->p;
 			if (f->sid == 0) {
 				if (rb3_verbose >= 1)
-					fprintf(stderr, "ERROR: failed to load sequence names and lengths from file \"%s\"\n", buf);
+					fprintf(stderr, "ERROR: failed to load sequence names and lengths from file \"%s\"\n", c->fn);
 			} else if (f->sid->n_seq * 2 != f->acc[1]) {
 				if (rb3_verbose >= 1)
 					fprintf(stderr, "ERROR: number of sequences do not match between BWT and the sequence list\n");
@@ -693,31 +1055,39 @@ int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag)
 			}
 			if (rb3_verbose >= 3)
 				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the sequence names and lengths\n", __func__, rb3_realtime(), rb3_percent_cpu());
+		} else if (c->type == LOAD_MVI) {
+			f->mv = (rb3_move_t*)c->p, f->bm = c->bm;
+			if (f->mv == 0) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "WARNING: failed to load move index from file \"%s\"\n", c->fn);
+			} else if (f->mv->bwt_len != f->acc[RB3_ASIZE]) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "WARNING: BWT length mismatch between index and move file \"%s\"\n", c->fn);
+				rb3_bmove_destroy(f->bm);
+				rb3_move_destroy(f->mv);
+				f->mv = 0, f->bm = 0;
+			}
+			if (f->mv && rb3_verbose >= 3)
+				fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the move index (%ld runs)\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)f->mv->n_runs);
+			if (f->bm && rb3_verbose >= 3)
+				fprintf(stderr, "[M::%s::%.3f*%.2f] built b-move for rank dispatch\n", __func__, rb3_realtime(), rb3_percent_cpu());
+		} else if (c->type == LOAD_KMI) { // k-mer intervals; mmapped
+			f->kmi = (rb3_kmi_t*)c->p;
+			if (f->kmi == 0) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "WARNING: failed to load k-mer intervals from file \"%s\"\n", c->fn);
+			} else if (f->kmi->bwt_len != f->acc[RB3_ASIZE] || !rb3_fmi_is_symmetric(f)) {
+				if (rb3_verbose >= 1)
+					fprintf(stderr, "WARNING: BWT mismatch between index and k-mer file \"%s\"\n", c->fn);
+				rb3_kmi_destroy(f->kmi);
+				f->kmi = 0;
+			}
+			if (f->kmi && rb3_verbose >= 3)
+				fprintf(stderr, "[M::%s::%.3f*%.2f] mapped the intervals of %d-mers\n", __func__, rb3_realtime(), rb3_percent_cpu(), f->kmi->k);
 		}
 	}
-	/* Auto-detect and load move index (.mvi) if present */
-	strcat(strcpy(buf, fn), ".mvi");
-	if ((fp = fopen(buf, "r")) != 0) {
-		fclose(fp);
-		f->mv = rb3_move_load(buf);
-		if (f->mv == 0) {
-			if (rb3_verbose >= 1)
-				fprintf(stderr, "WARNING: failed to load move index from file \"%s\"\n", buf);
-		} else if (f->mv->bwt_len != f->acc[RB3_ASIZE]) {
-			if (rb3_verbose >= 1)
-				fprintf(stderr, "WARNING: BWT length mismatch between index and move file \"%s\"\n", buf);
-			rb3_move_destroy(f->mv);
-			f->mv = 0;
-		}
-		if (f->mv && rb3_verbose >= 3)
-			fprintf(stderr, "[M::%s::%.3f*%.2f] loaded the move index (%ld runs)\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)f->mv->n_runs);
-	}
-	/* Build b-move for rank dispatch if move index is available */
-	if (f->mv) {
-		f->bm = rb3_bmove_init(f->mv);
-		if (f->bm && rb3_verbose >= 3)
-			fprintf(stderr, "[M::%s::%.3f*%.2f] built b-move for rank dispatch\n", __func__, rb3_realtime(), rb3_percent_cpu());
-	}
-	free(buf);
-	return 0;
+	for (i = 0; i < a.n_comp; ++i) free(a.comp[i].fn);
+	rb3_pack_destroy(pk);
+	free(shm);
+	return f->e == 0 && f->r == 0? -1 : 0;
 }
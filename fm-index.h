@@ -37,15 +37,29 @@ typedef struct {
 typedef struct {
 	int32_t ms; // for each ssa[i], the lower ms bits keep the sequence ID in [0,m); the higher bits keep the offset of on sequence
 	int32_t ss; // sample one SA per 1<<ss entries on average
-	int64_t m, n_ssa; // m: number of sequences/sentinels; n_ssa: size of the ssa[] array below
-	uint64_t *r2i; // rank -> index, of size m; when you reach a sentinel via backward search, r2i[] tells you the sequence ID in [0,m)
-	uint64_t *ssa; // sampled suffix array; of size n_ssa
+	int64_t m, n_ssa; // m: number of sequences/sentinels; n_ssa: number of entries in ssa[] below
+	int32_t wr, ws; // bits per entry in r2i[] and in ssa[], in [1,64]
+	uint64_t *r2i; // rank -> index, m entries of wr bits; when you reach a sentinel via backward search, r2i[] tells you the sequence ID in [0,m)
+	uint64_t *ssa; // sampled suffix array, n_ssa entries of ws bits; use rb3_ssa_get() and rb3_ssa_r2i() to read
+	void *mm; // non-NULL if r2i[] and ssa[] point into an mmapped file
+	size_t mm_len;
 } rb3_ssa_t;
 
 typedef struct {
 	int64_t sid, pos;
 } rb3_pos_t;
 
+typedef struct {
+	int32_t k;
+	int64_t bwt_len, n_kmer; // n_kmer = 4^k
+	const int64_t *a; // a[i<<1] is the start of the backward interval of the i-th k-mer and a[i<<1|1] is its size
+	int64_t *buf; // non-NULL if the table is constructed in memory
+	void *mm; // non-NULL if the table is mmapped
+	size_t mm_len;
+} rb3_kmi_t;
+
+typedef struct rb3_pcache_s rb3_pcache_t; // locate cache shared by threads
+
 typedef struct {
 	int32_t is_fmd;
 	rld_t *e;
@@ -55,6 +69,8 @@ typedef struct {
 	rb3_sid_t *sid;
 	struct rb3_move_s *mv;
 	struct rb3_bmove_s *bm; /* b-move for O(log r) rank dispatch; NULL if not available */
+	rb3_kmi_t *kmi; // k-mer intervals for jump-starting backward search; NULL if not available
+	rb3_pcache_t *pc; // cache of located intervals; NULL if disabled
 	int64_t acc[RB3_ASIZE+1];
 } rb3_fmi_t;
 
@@ -86,17 +102,59 @@ void rb3_fmd_extend(const rb3_fmi_t *f, const rb3_sai_t *ik, rb3_sai_t ok[RB3_AS
 int64_t rb3_fmd_smem(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t *q, rb3_sai_v *mem, int64_t min_occ, int64_t min_len);
 int64_t rb3_fmd_smem_TG(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t *q, rb3_sai_v *mem, int64_t min_occ, int64_t min_len);
 int32_t rb3_fmd_smem_present(const rb3_fmi_t *f, int64_t len, const uint8_t *q, int64_t min_len);
+int64_t rb3_fmd_smem_TG_range(void *km, const rb3_fmi_t *f, int64_t len, const uint8_t *q, int64_t st, int64_t en, rb3_sai_v *mem, int64_t min_occ, int64_t min_len);
 
 int64_t rb3_ssa(const rb3_fmi_t *f, const rb3_ssa_t *sa, int64_t k, int64_t *si);
-int64_t rb3_ssa_multi(void *km, const rb3_fmi_t *f, const rb3_ssa_t *ssa, int64_t lo, int64_t hi, int64_t max_sa, rb3_pos_t *sa);
+int64_t rb3_ssa_multi(void *km, const rb3_fmi_t *f, const rb3_ssa_t *ssa, int64_t lo, int64_t hi, int64_t max_sa, rb3_pos_t *sa); // sorted by (sid,pos) unless truncated by max_sa
+void rb3_ssa_multi_batch(void *km, const rb3_fmi_t *f, const rb3_ssa_t *ssa, int32_t n, const int64_t *lo, const int64_t *hi, int64_t max_sa, int64_t *n_sa, rb3_pos_t **sa); // sa[i] holds the positions of [lo[i],hi[i]) and has room for min(max_sa,hi[i]-lo[i])
 void rb3_ssa_destroy(rb3_ssa_t *sa);
 int rb3_ssa_dump(const rb3_ssa_t *sa, const char *fn);
+int64_t rb3_ssa_write(const rb3_ssa_t *sa, FILE *fp); // returns the number of bytes written
 rb3_ssa_t *rb3_ssa_restore(const char *fn);
+rb3_ssa_t *rb3_ssa_restore_mmap(const char *fn); // zero-copy for the "SSA\3" format; falls back to rb3_ssa_restore() otherwise
+rb3_ssa_t *rb3_ssa_restore_mmap_at(const char *fn, int64_t off, int64_t size); // zero-copy for "SSA\3"; off must be a multiple of the page size
 rb3_ssa_t *rb3_ssa_gen(const rb3_fmi_t *f, int ssa_shift, int n_threads);
 
 int64_t rb3_srindex_multi(void *km, const rb3_fmi_t *f, const rb3_srindex_t *sr, int64_t lo, int64_t hi, int64_t max_pos, rb3_pos_t *pos);
 
-int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag);
+rb3_pcache_t *rb3_pcache_init(int64_t max_pos);
+void rb3_pcache_destroy(rb3_pcache_t *pc);
+void rb3_pcache_stat(const rb3_pcache_t *pc, int64_t *n_hit, int64_t *n_miss);
+int64_t rb3_fmi_locate(void *km, const rb3_fmi_t *f, int64_t lo, int64_t hi, int64_t max_pos, rb3_pos_t *pos);
+void rb3_fmi_locate_batch(void *km, const rb3_fmi_t *f, int32_t n, const int64_t *lo, const int64_t *hi, int64_t max_pos, int64_t *n_pos, rb3_pos_t **pos); // pos[i] has room for min(max_pos,hi[i]-lo[i]) positions
+
+int rb3_fmi_load_all(rb3_fmi_t *f, const char *fn, int32_t load_flag); // fn can also be an index container created by "ropebwt3 pack"
+
+typedef struct {
+	char tag[4];
+	uint32_t flags;
+	int64_t off, size; // off is aligned to page boundaries
+	uint64_t crc;
+} rb3_pack_sec_t;
+
+typedef struct { // header of an index container
+	int32_t n_sec;
+	int64_t acc[RB3_ASIZE+1], n_runs, n_seq;
+	rb3_pack_sec_t *sec;
+} rb3_pack_t;
+
+rb3_pack_t *rb3_pack_read(const char *fn); // NULL if fn is not an index container
+rld_t *rb3_pack_restore_bwt(const char *fn); // map the FMD section of an index container
+const rb3_pack_sec_t *rb3_pack_get(const rb3_pack_t *pk, const char *tag);
+int rb3_pack_write(const char *fn_idx, const char *fn_out); // pack FMD fn_idx and its companion files
+int rb3_pack_check(const char *fn); // number of sections with wrong checksums; -1 if fn is not an index container
+void rb3_pack_destroy(rb3_pack_t *pk);
+
+int rb3_shm_enabled(void); // whether $RB3_SHM asks rb3_fmi_load_all() to attach to shared-memory images
+const char *rb3_shm_dir(void); // $RB3_SHM_DIR or /dev/shm
+char *rb3_shm_path(const char *fn); // path of the shared-memory image of index fn; NULL if fn does not exist
+char *rb3_shm_find(const char *fn); // like rb3_shm_path() but NULL if the image is absent, older than fn, or not owned by the user
+
+rb3_kmi_t *rb3_kmi_build(const rb3_fmi_t *f, int32_t k, int n_threads);
+int rb3_kmi_dump(const rb3_kmi_t *ki, const char *fn);
+rb3_kmi_t *rb3_kmi_load(const char *fn);
+rb3_kmi_t *rb3_kmi_load_at(const char *fn, int64_t off, int64_t size); // off must be a multiple of the page size
+void rb3_kmi_destroy(rb3_kmi_t *ki);
 
 static inline int rb3_comp(int c)
 {
@@ -108,6 +166,30 @@ static inline void rb3_fmd_set_intv(const rb3_fmi_t *f, int c, rb3_sai_t *ik)
 	ik->x[0] = f->acc[c], ik->size = f->acc[c+1] - f->acc[c], ik->x[1] = f->acc[rb3_comp(c)], ik->info = 0;
 }
 
+static inline int64_t rb3_kmi_get(const rb3_kmi_t *ki, const uint8_t *q, rb3_sai_t *ik) // look up q[0..k); return -1 if q contains non-ACGT
+{
+	int32_t i, k = ki->k;
+	uint64_t x = 0, y = 0;
+	for (i = 0; i < k; ++i) {
+		int c = q[i] - 1;
+		if (c < 0 || c > 3) return -1;
+		x = x<<2 | c;
+		y |= (uint64_t)(3 - c) << (i<<1); // reverse complement
+	}
+	ik->x[0] = ki->a[x<<1], ik->size = ki->a[x<<1|1];
+	ik->x[1] = ki->a[y<<1], ik->info = 0;
+	return ik->size;
+}
+
+static inline uint64_t rb3_bits_get(const uint64_t *a, int32_t w, int64_t i) // the i-th w-bit entry; a[] has a padding word at the end
+{
+	uint64_t b = (uint64_t)i * w, s = b & 63, j = b >> 6;
+	return (a[j] >> s | a[j+1] << 1 << (63 - s)) & (~0ULL >> (64 - w));
+}
+
+static inline uint64_t rb3_ssa_get(const rb3_ssa_t *sa, int64_t i) { return rb3_bits_get(sa->ssa, sa->ws, i); }
+static inline int64_t rb3_ssa_r2i(const rb3_ssa_t *sa, int64_t i) { return rb3_bits_get(sa->r2i, sa->wr, i); }
+
 static inline void rb3_fmi_init(rb3_fmi_t *f, rld_t *e, mrope_t *r)
 {
 	if (e) f->is_fmd = 1, f->e = e, f->r = 0;
@@ -116,6 +198,8 @@ static inline void rb3_fmi_init(rb3_fmi_t *f, rld_t *e, mrope_t *r)
 	f->srindex = 0;
 	f->mv = 0;
 	f->bm = 0;
+	f->kmi = 0;
+	f->pc = 0;
 	rb3_fmi_get_acc(f, f->acc);
 }
 
@@ -132,6 +216,13 @@ static inline int rb3_fmi_rank1a(const rb3_fmi_t *fmi, int64_t k, int64_t *ok)
 	return fmi->is_fmd? rld_rank1a(fmi->e, k, (uint64_t*)ok) : mr_rank1a(fmi->r, k, ok);
 }
 
+static inline void rb3_fmi_prefetch(const rb3_fmi_t *fmi, int64_t k, int stage) // hint a future rank at k; stage 0 for the index frame and 1 for the data block
+{
+	if (fmi->bm || !fmi->is_fmd || k < 0 || k >= fmi->acc[RB3_ASIZE]) return; // only implemented for FMD
+	if (stage == 0) rld_prefetch_frame(fmi->e, k);
+	else rld_prefetch_blk(fmi->e, k);
+}
+
 static inline void rb3_fmi_free(rb3_fmi_t *fmi)
 {
 	if (fmi->is_fmd) rld_destroy(fmi->e);
@@ -141,13 +232,16 @@ static inline void rb3_fmi_free(rb3_fmi_t *fmi)
 	if (fmi->sid) rb3_sid_destroy(fmi->sid);
 	if (fmi->bm) rb3_bmove_destroy(fmi->bm);
 	if (fmi->mv) rb3_move_destroy(fmi->mv);
-	fmi->e = 0, fmi->r = 0, fmi->ssa = 0, fmi->srindex = 0, fmi->mv = 0, fmi->bm = 0;
+	if (fmi->kmi) rb3_kmi_destroy(fmi->kmi);
+	if (fmi->pc) rb3_pcache_destroy(fmi->pc);
+	fmi->e = 0, fmi->r = 0, fmi->ssa = 0, fmi->srindex = 0, fmi->mv = 0, fmi->bm = 0, fmi->kmi = 0, fmi->pc = 0;
 }
 
 static inline void rb3_fmi_restore(rb3_fmi_t *fmi, const char *fn, int use_mmap)
 {
-	fmi->r = 0, fmi->e = 0, fmi->ssa = 0, fmi->srindex = 0, fmi->sid = 0, fmi->mv = 0, fmi->bm = 0;
+	fmi->r = 0, fmi->e = 0, fmi->ssa = 0, fmi->srindex = 0, fmi->sid = 0, fmi->mv = 0, fmi->bm = 0, fmi->kmi = 0, fmi->pc = 0;
 	fmi->e = use_mmap? rld_restore_mmap(fn) : rld_restore(fn);
+	if (fmi->e == 0) fmi->e = rb3_pack_restore_bwt(fn); // an index container; always mapped
 	if (fmi->e == 0) {
 		fmi->r = mr_restore_file(fn);
 		fmi->is_fmd = 0;
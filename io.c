@@ -4,10 +4,111 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <zlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "rb3priv.h"
 #include "io.h"
+#include "kthread.h"
 #include "kseq.h"
-KSEQ_INIT(gzFile, gzread)
+
+/**************
+ * Read-ahead *
+ **************/
+
+#define RB3_RA_BUF 0x100000
+
+typedef struct { // inflate the input on a separate thread, so that parsing and compute never wait on gzip decoding
+	gzFile fp;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	int32_t stop, cur, off, err;
+	int32_t len[2]; // -1 if the buffer is free; 0 at the end of file
+	uint8_t *buf[2];
+} rb3_rdahead_t;
+
+static void *rdahead_worker(void *data)
+{
+	rb3_rdahead_t *ra = (rb3_rdahead_t*)data;
+	int32_t i = 0, n, err;
+	const char *msg;
+	for (;;) {
+		pthread_mutex_lock(&ra->lock);
+		while (ra->len[i] >= 0 && !ra->stop)
+			pthread_cond_wait(&ra->cv, &ra->lock);
+		pthread_mutex_unlock(&ra->lock);
+		if (ra->stop) break;
+		n = gzread(ra->fp, ra->buf[i], RB3_RA_BUF);
+		msg = gzerror(ra->fp, &err); // a truncated stream may come with data read
+		if (err != Z_OK && rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to read the input: %s\n", msg);
+		pthread_mutex_lock(&ra->lock);
+		ra->len[i] = n > 0? n : 0;
+		ra->err = (n < 0 || err != Z_OK);
+		pthread_cond_broadcast(&ra->cv);
+		pthread_mutex_unlock(&ra->lock);
+		if (n <= 0 || err != Z_OK) break;
+		i ^= 1;
+	}
+	return 0;
+}
+
+static rb3_rdahead_t *rdahead_open(gzFile f)
+{
+	rb3_rdahead_t *ra;
+	if (f == 0) return 0;
+	ra = RB3_CALLOC(rb3_rdahead_t, 1);
+	ra->fp = f;
+	ra->len[0] = ra->len[1] = -1;
+	ra->buf[0] = RB3_MALLOC(uint8_t, RB3_RA_BUF);
+	ra->buf[1] = RB3_MALLOC(uint8_t, RB3_RA_BUF);
+	pthread_mutex_init(&ra->lock, 0);
+	pthread_cond_init(&ra->cv, 0);
+	pthread_create(&ra->tid, 0, rdahead_worker, ra);
+	return ra;
+}
+
+static int rdahead_read(rb3_rdahead_t *ra, void *dst, int size)
+{
+	int32_t l, err;
+	pthread_mutex_lock(&ra->lock);
+	while (ra->len[ra->cur] < 0 && !ra->err)
+		pthread_cond_wait(&ra->cv, &ra->lock);
+	err = ra->err;
+	pthread_mutex_unlock(&ra->lock);
+	if (err) return -1; // keep failing after a read error; data not consumed yet is dropped
+	l = ra->len[ra->cur] - ra->off;
+	if (l == 0) return 0; // end of file; the buffer is never released
+	l = l < size? l : size;
+	memcpy(dst, &ra->buf[ra->cur][ra->off], l);
+	ra->off += l;
+	if (ra->off == ra->len[ra->cur]) { // hand the buffer back to the worker
+		pthread_mutex_lock(&ra->lock);
+		ra->len[ra->cur] = -1;
+		pthread_cond_broadcast(&ra->cv);
+		pthread_mutex_unlock(&ra->lock);
+		ra->cur ^= 1, ra->off = 0;
+	}
+	return l;
+}
+
+static void rdahead_close(rb3_rdahead_t *ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = 1;
+	pthread_cond_broadcast(&ra->cv);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->tid, 0);
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cv);
+	gzclose(ra->fp);
+	free(ra->buf[0]); free(ra->buf[1]); free(ra);
+}
+
+KSEQ_INIT(rb3_rdahead_t*, rdahead_read)
 
 const uint8_t rb3_nt6_table[128] = {
     0, 1, 2, 3,  4, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,
@@ -53,15 +154,15 @@ struct rb3_seqio_s {
 	int32_t is_line;
 	kseq_t *fx;
 	kstream_t *fl;
-	gzFile fp;
+	rb3_rdahead_t *fp;
 	kstring_t line_buf;
 };
 
-rb3_seqio_t *rb3_seq_open(const char *fn, int is_line)
+static rb3_seqio_t *seq_open_gz(gzFile gz, int is_line)
 {
 	rb3_seqio_t *fp;
-	gzFile f;
-	f = fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(0, "r");
+	rb3_rdahead_t *f;
+	f = rdahead_open(gz);
 	if (f == 0) return 0;
 	fp = RB3_CALLOC(rb3_seqio_t, 1);
 	fp->fp = f;
@@ -71,13 +172,23 @@ rb3_seqio_t *rb3_seq_open(const char *fn, int is_line)
 	return fp;
 }
 
+rb3_seqio_t *rb3_seq_open(const char *fn, int is_line)
+{
+	return seq_open_gz(fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(0, "r"), is_line);
+}
+
+rb3_seqio_t *rb3_seq_open_fd(int fd, int is_line) // fd is closed by rb3_seq_close()
+{
+	return seq_open_gz(gzdopen(fd, "r"), is_line);
+}
+
 void rb3_seq_close(rb3_seqio_t *fp)
 {
 	if (fp == 0) return;
 	free(fp->line_buf.s);
 	if (fp->is_line) ks_destroy(fp->fl);
 	else kseq_destroy(fp->fx);
-	gzclose(fp->fp);
+	rdahead_close(fp->fp);
 	free(fp);
 }
 
@@ -118,7 +229,7 @@ int64_t rb3_seq_read(rb3_seqio_t *fp, kstring_t *seq, int64_t max_len, int is_fo
 			n_seq += rb3_seq_add(seq, is_for, is_rev, fp->fx->seq.l, fp->fx->seq.s);
 			if (max_len > 0 && seq->l > max_len) break;
 		}
-		if (ret < -1 && rb3_verbose >= 1)
+		if (ret == -2 && rb3_verbose >= 1) // -3 (read error) has been reported by the read-ahead thread
 			fprintf(stderr, "ERROR: FASTX parsing error (code %d)\n", ret);
 	}
 	return n_seq;
@@ -140,7 +251,7 @@ char *rb3_seq_read1(rb3_seqio_t *fp, int64_t *len, const char **name)
 		s = fp->fx->seq.s;
 		if (name) *name = fp->fx->name.s;
 	}
-	return ret < 0? 0 : s;
+	return ret < 0? 0 : s; // a read error (-3) has been reported by the read-ahead thread
 }
 
 void rb3_reverse_all(int64_t len, uint8_t *seq)
@@ -158,58 +269,172 @@ void rb3_reverse_all(int64_t len, uint8_t *seq)
  * seqlist *
  ***********/
 
+/*
+ * Binary sequence list (.sid), usable directly from mmap:
+ *
+ *   char     magic[4]   "SID\1"
+ *   int32_t  reserved
+ *   int64_t  n_seq
+ *   int64_t  l_pool
+ *   int64_t  off[n_seq] name of sequence i starts at pool[off[i]]
+ *   int32_t  len[n_seq]
+ *   char     pool[l_pool] NUL-terminated names
+ */
+#define RB3_SID_MAGIC    "SID\1"
+#define RB3_SID_HDR_SIZE 24
+
+typedef struct {
+	int64_t m_seq;
+	size_t m_pool;
+} sid_buf_t;
+
+static void sid_add(rb3_sid_t *sl, sid_buf_t *b, char *line) // parse "name<TAB>len"; line is modified
+{
+	int32_t i;
+	char *p, *q, *name = 0;
+	int64_t len = -1;
+	size_t l_name;
+	for (p = q = line, i = 0;; ++p) {
+		if (*p == ' ' || *p == '\t' || *p == 0) {
+			int32_t c = *p;
+			*p = 0;
+			if (i == 0) {
+				name = q;
+			} else if (i == 1) {
+				len = atol(q);
+			}
+			++i, q = p + 1;
+			if (c == 0 || i == 2) break;
+		}
+	}
+	if (i == 2 && len > 0) {
+		assert(len <= INT32_MAX);
+		if (sl->n_seq == b->m_seq) {
+			b->m_seq = b->m_seq? b->m_seq + (b->m_seq>>1) : 16;
+			sl->off = RB3_REALLOC(int64_t, sl->off, b->m_seq);
+			sl->len = RB3_REALLOC(int32_t, sl->len, b->m_seq);
+		}
+		l_name = strlen(name) + 1;
+		if (sl->l_pool + l_name > b->m_pool) {
+			b->m_pool = sl->l_pool + l_name;
+			b->m_pool += b->m_pool >> 1;
+			sl->pool = RB3_REALLOC(char, sl->pool, b->m_pool);
+		}
+		memcpy(&sl->pool[sl->l_pool], name, l_name);
+		sl->off[sl->n_seq] = sl->l_pool;
+		sl->len[sl->n_seq++] = len;
+		sl->l_pool += l_name;
+	}
+}
+
+static rb3_sid_t *sid_load_mmap(const char *fn, int64_t off, int64_t size)
+{
+	rb3_sid_t *sl;
+	uint8_t *base;
+	int64_t i;
+	int fd;
+	if (size < RB3_SID_HDR_SIZE || (fd = open(fn, O_RDONLY)) < 0) return 0;
+	base = (uint8_t*)mmap(0, size, PROT_READ, MAP_SHARED, fd, off);
+	close(fd);
+	if (base == MAP_FAILED) return 0;
+	sl = RB3_CALLOC(rb3_sid_t, 1);
+	memcpy(&sl->n_seq, base + 8, 8);
+	memcpy(&sl->l_pool, base + 16, 8);
+	if (memcmp(base, RB3_SID_MAGIC, 4) != 0 || sl->n_seq < 0 || sl->l_pool < 0
+		|| (uint64_t)size != RB3_SID_HDR_SIZE + (uint64_t)sl->n_seq * 12 + sl->l_pool) {
+		munmap(base, size);
+		free(sl);
+		return 0;
+	}
+	sl->mm = base, sl->mm_len = size;
+	sl->off = (int64_t*)(base + RB3_SID_HDR_SIZE);
+	sl->len = (int32_t*)(sl->off + sl->n_seq);
+	sl->pool = (char*)(sl->len + sl->n_seq);
+	if (sl->n_seq > 0 && (sl->l_pool == 0 || sl->pool[sl->l_pool - 1] != 0)) { // names are NUL-terminated
+		rb3_sid_destroy(sl);
+		return 0;
+	}
+	for (i = 0; i < sl->n_seq; ++i)
+		if (sl->off[i] < 0 || sl->off[i] >= sl->l_pool || sl->len[i] < 0)
+			break;
+	if (i < sl->n_seq) {
+		rb3_sid_destroy(sl);
+		return 0;
+	}
+	return sl;
+}
+
+rb3_sid_t *rb3_sid_read_at(const char *fn, int64_t off, int64_t size)
+{
+	FILE *fp;
+	char magic[4];
+	if ((fp = fopen(fn, "rb")) == 0) return 0;
+	if (fseeko(fp, off, SEEK_SET) != 0 || fread(magic, 1, 4, fp) != 4) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	if (memcmp(magic, RB3_SID_MAGIC, 4) == 0) // binary; mapped
+		return sid_load_mmap(fn, off, size);
+	if (off == 0) return rb3_sid_read(fn); // possibly gzip'd text
+	return 0;
+}
+
 rb3_sid_t *rb3_sid_read(const char *fn)
 {
 	rb3_sid_t *sl;
-	gzFile fp;
+	rb3_rdahead_t *fp;
 	kstream_t *ks;
-	int32_t l, dret;
-	int64_t m_seq = 0;
+	int32_t dret, ret;
+	sid_buf_t b = {0,0};
 	kstring_t str = {0,0,0};
 
-	fp = fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(0, "r");
+	if (fn && strcmp(fn, "-")) { // check the binary format first
+		struct stat st;
+		FILE *fb;
+		char magic[4];
+		if ((fb = fopen(fn, "rb")) == 0) return 0;
+		if (fread(magic, 1, 4, fb) == 4 && memcmp(magic, RB3_SID_MAGIC, 4) == 0 && fstat(fileno(fb), &st) == 0) {
+			fclose(fb);
+			return sid_load_mmap(fn, 0, st.st_size);
+		}
+		fclose(fb);
+	}
+	fp = rdahead_open(fn && strcmp(fn, "-")? gzopen(fn, "r") : gzdopen(0, "r"));
 	if (fp == 0) return 0;
 	ks = ks_init(fp);
 	sl = RB3_CALLOC(rb3_sid_t, 1);
-	while ((l = ks_getuntil(ks, KS_SEP_LINE, &str, &dret)) >= 0) {
-		int32_t i;
-		char *p, *q, *name = 0;
-		int64_t len = -1;
-		for (p = q = str.s, i = 0;; ++p) {
-			if (*p == ' ' || *p == '\t' || *p == 0) {
-				int32_t c = *p;
-				*p = 0;
-				if (i == 0) {
-					name = q;
-				} else if (i == 1) {
-					len = atol(q);
-				}
-				++i, q = p + 1;
-				if (c == 0 || i == 2) break;
-			}
-		}
-		//fprintf(stderr, "i=%d,name=%s,len=%ld\n", i, name, (long)len);
-		if (i == 2 && len > 0) {
-			assert(len <= INT32_MAX);
-			RB3_GROW(char*, sl->name, sl->n_seq, m_seq);
-			sl->len = RB3_REALLOC(int32_t, sl->len, m_seq);
-			sl->name[sl->n_seq] = rb3_strdup(name);
-			sl->len[sl->n_seq++] = len;
-		}
-	}
+	while ((ret = ks_getuntil(ks, KS_SEP_LINE, &str, &dret)) >= 0)
+		sid_add(sl, &b, str.s);
 	free(str.s);
 	ks_destroy(ks);
-	gzclose(fp);
+	rdahead_close(fp);
+	if (ret == -3) { // a truncated or corrupted input; don't return a partial list
+		rb3_sid_destroy(sl);
+		return 0;
+	}
 	return sl;
 }
 
+int64_t rb3_sid_write(const rb3_sid_t *sl, FILE *fp)
+{
+	int32_t y = 0;
+	fwrite(RB3_SID_MAGIC, 1, 4, fp);
+	fwrite(&y, 4, 1, fp);
+	fwrite(&sl->n_seq, 8, 1, fp);
+	fwrite(&sl->l_pool, 8, 1, fp);
+	fwrite(sl->off, 8, sl->n_seq, fp);
+	fwrite(sl->len, 4, sl->n_seq, fp);
+	fwrite(sl->pool, 1, sl->l_pool, fp);
+	return RB3_SID_HDR_SIZE + sl->n_seq * 12 + sl->l_pool;
+}
+
 void rb3_sid_destroy(rb3_sid_t *sl)
 {
-	int64_t i;
 	if (sl == 0) return;
-	for (i = 0; i < sl->n_seq; ++i)
-		free(sl->name[i]);
-	free(sl->name); free(sl->len); free(sl);
+	if (sl->mm) munmap(sl->mm, sl->mm_len);
+	else free(sl->off), free(sl->len), free(sl->pool);
+	free(sl);
 }
 
 /**********************
@@ -309,3 +534,105 @@ int64_t rb3_sprintf_lite(kstring_t *s, const char *fmt, ...)
 	if (s) s->s[s->l] = 0;
 	return len;
 }
+
+/*************************
+ * Multi-threaded BGZF   *
+ *************************/
+
+#define RB3_BGZF_BLOCK   0xff00  // max uncompressed bytes per block, as in htslib
+#define RB3_BGZF_MAX_OUT 0x10000 // max compressed block size
+
+struct rb3_bgzf_s {
+	FILE *fp;
+	kt_forpool_t *pool;
+	int32_t n_threads, level, n_blk;
+	int64_t l, m; // pending uncompressed bytes and the capacity of buf
+	uint8_t *buf, *out; // out: n_blk blocks of RB3_BGZF_MAX_OUT bytes
+	int32_t *l_out;
+};
+
+rb3_bgzf_t *rb3_bgzf_open(FILE *fp, kt_forpool_t *pool, int32_t n_threads, int32_t level)
+{
+	rb3_bgzf_t *z;
+	z = RB3_CALLOC(rb3_bgzf_t, 1);
+	z->fp = fp, z->pool = pool, z->level = level;
+	z->n_threads = n_threads > 1? n_threads : 1;
+	z->n_blk = z->n_threads * 4;
+	z->m = (int64_t)z->n_blk * RB3_BGZF_BLOCK;
+	z->buf = RB3_MALLOC(uint8_t, z->m);
+	z->out = RB3_MALLOC(uint8_t, (int64_t)z->n_blk * RB3_BGZF_MAX_OUT);
+	z->l_out = RB3_CALLOC(int32_t, z->n_blk);
+	return z;
+}
+
+static inline void bgzf_put32(uint8_t *p, uint32_t x)
+{
+	p[0] = x & 0xff, p[1] = x>>8 & 0xff, p[2] = x>>16 & 0xff, p[3] = x>>24;
+}
+
+static int32_t bgzf_deflate1(uint8_t *dst, const uint8_t *src, int32_t len, int32_t level) // compress one block; return the block size
+{
+	static const uint8_t hdr[18] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0 };
+	z_stream zs;
+	int32_t ret, bsize;
+	memset(&zs, 0, sizeof(z_stream));
+	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+	zs.next_in = (Bytef*)src, zs.avail_in = len;
+	zs.next_out = dst + 18, zs.avail_out = RB3_BGZF_MAX_OUT - 18 - 8;
+	ret = deflate(&zs, Z_FINISH);
+	bsize = 18 + zs.total_out + 8;
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END) // incompressible; store without compression, which always fits
+		return level != 0? bgzf_deflate1(dst, src, len, 0) : -1;
+	memcpy(dst, hdr, 18);
+	dst[16] = (bsize - 1) & 0xff, dst[17] = (bsize - 1) >> 8;
+	bgzf_put32(dst + bsize - 8, crc32(crc32(0L, Z_NULL, 0), src, len));
+	bgzf_put32(dst + bsize - 4, len);
+	return bsize;
+}
+
+static void bgzf_worker(void *data, long i, int tid)
+{
+	rb3_bgzf_t *z = (rb3_bgzf_t*)data;
+	int64_t st = i * RB3_BGZF_BLOCK, en = st + RB3_BGZF_BLOCK < z->l? st + RB3_BGZF_BLOCK : z->l;
+	z->l_out[i] = bgzf_deflate1(&z->out[i * RB3_BGZF_MAX_OUT], &z->buf[st], en - st, z->level);
+}
+
+static int bgzf_flush(rb3_bgzf_t *z) // compress pending blocks in parallel and write them in order
+{
+	int32_t i, n = (z->l + RB3_BGZF_BLOCK - 1) / RB3_BGZF_BLOCK;
+	int ret = 0;
+	if (n == 0) return 0;
+	kt_forpool(z->pool, z->n_threads < n? z->n_threads : n, bgzf_worker, z, n);
+	for (i = 0; i < n; ++i) {
+		if (z->l_out[i] < 0 || fwrite(&z->out[i * RB3_BGZF_MAX_OUT], 1, z->l_out[i], z->fp) != z->l_out[i])
+			ret = -1;
+	}
+	z->l = 0;
+	return ret;
+}
+
+int rb3_bgzf_write(rb3_bgzf_t *z, const void *data, int64_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	int ret = 0;
+	while (len > 0) {
+		int64_t l = z->m - z->l < len? z->m - z->l : len;
+		memcpy(&z->buf[z->l], p, l);
+		z->l += l, p += l, len -= l;
+		if (z->l == z->m && bgzf_flush(z) < 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+int rb3_bgzf_close(rb3_bgzf_t *z)
+{
+	static const uint8_t eof[28] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	int ret;
+	ret = bgzf_flush(z);
+	if (fwrite(eof, 1, 28, z->fp) != 28) ret = -1;
+	if (fflush(z->fp) != 0) ret = -1;
+	free(z->buf); free(z->out); free(z->l_out); free(z);
+	return ret;
+}
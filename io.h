@@ -2,6 +2,7 @@
 #define RB3_IO_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include "rb3priv.h" // for kstring_t
 
 #ifdef __cplusplus
@@ -10,17 +11,25 @@ extern "C" {
 
 typedef struct {
 	int64_t tot_len;
-	int64_t n_seq;
-	char **name;
+	int64_t n_seq, l_pool;
+	int64_t *off; // name of sequence i is pool+off[i]; use rb3_sid_name()
 	int32_t *len;
+	char *pool;
+	void *mm; // non-NULL if the arrays above point into an mmapped .sid file
+	size_t mm_len;
 } rb3_sid_t;
 
 struct rb3_seqio_s;
 typedef struct rb3_seqio_s rb3_seqio_t;
 
+struct rb3_bgzf_s;
+typedef struct rb3_bgzf_s rb3_bgzf_t;
+struct kt_forpool_t; // see kthread.h
+
 extern const uint8_t rb3_nt6_table[128];
 
 rb3_seqio_t *rb3_seq_open(const char *fn, int is_line);
+rb3_seqio_t *rb3_seq_open_fd(int fd, int is_line);
 void rb3_seq_close(rb3_seqio_t *fp);
 int64_t rb3_seq_read(rb3_seqio_t *fp, kstring_t *seq, int64_t max_len, int is_for, int is_rev);
 char *rb3_seq_read1(rb3_seqio_t *fp, int64_t *len, const char **name);
@@ -31,9 +40,17 @@ void rb3_reverse_all(int64_t len, uint8_t *seq);
 
 int64_t rb3_sprintf_lite(kstring_t *s, const char *fmt, ...);
 
-rb3_sid_t *rb3_sid_read(const char *fn);
+rb3_sid_t *rb3_sid_read(const char *fn); // binary .sid (mapped) or "name<TAB>len" lines, optionally gzip'd
+rb3_sid_t *rb3_sid_read_at(const char *fn, int64_t off, int64_t size); // binary .sid at offset off, a multiple of the page size
+int64_t rb3_sid_write(const rb3_sid_t *sl, FILE *fp); // in the binary format; returns the number of bytes written
 void rb3_sid_destroy(rb3_sid_t *sl);
 
+static inline const char *rb3_sid_name(const rb3_sid_t *sl, int64_t i) { return sl->pool + sl->off[i]; }
+
+rb3_bgzf_t *rb3_bgzf_open(FILE *fp, struct kt_forpool_t *pool, int32_t n_threads, int32_t level); // pool: shared threads, or NULL
+int rb3_bgzf_write(rb3_bgzf_t *z, const void *data, int64_t len);
+int rb3_bgzf_close(rb3_bgzf_t *z);
+
 #ifdef __cplusplus
 }
 #endif
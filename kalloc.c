@@ -17,16 +17,25 @@
  *      *@-------#++++++#++++++++++++@--------        *@----------#++++++++++++#+++++++@------------
  *       |                           |                 |                               |
  *       p=p->ptr->ptr->ptr->ptr     p->ptr            p->ptr->ptr                     p->ptr->ptr->ptr
+ *
+ * Freed blocks smaller than KM_N_BIN units are not merged into the circular
+ * list. They are kept in per-size "bins", singly-linked lists that make small
+ * allocations and frees O(1). Bins are returned to the circular list, where
+ * adjacent blocks are merged, before kalloc asks for a new core.
  */
 typedef struct header_t {
 	size_t size;
 	struct header_t *ptr;
 } header_t;
 
+#define KM_N_BIN 64
+
 typedef struct {
 	void *par;
 	size_t min_core_size;
+	size_t in_use, peak; /* units held by allocated blocks and its high-water mark */
 	header_t base, *loop_head, *core_head; /* base is a zero-sized block always kept in the loop */
+	header_t *bin[KM_N_BIN]; /* bin[i]: free blocks of exactly i units */
 } kmem_t;
 
 static void panic(const char *s)
@@ -62,6 +71,8 @@ void km_destroy(void *_km)
 	kfree(km_par, km);
 }
 
+static void km_insert(kmem_t *km, void *ap);
+
 static header_t *morecore(kmem_t *km, size_t nu)
 {
 	header_t *q;
@@ -73,20 +84,44 @@ static header_t *morecore(kmem_t *km, size_t nu)
 	q->ptr = km->core_head, q->size = nu, km->core_head = q;
 	p = (size_t*)(q + 1);
 	*p = nu - 1; /* the size of the free block; -1 because the first unit is used for the core header */
-	kfree(km, p + 1); /* initialize the new "core"; NB: the core header is not looped. */
+	km_insert(km, p + 1); /* initialize the new "core"; NB: the core header is not looped. */
 	return km->loop_head;
 }
 
-void kfree(void *_km, void *ap) /* kfree() also adds a new core to the circular list */
+void kfree(void *_km, void *ap)
 {
-	header_t *p, *q;
 	kmem_t *km = (kmem_t*)_km;
-	
 	if (!ap) return;
 	if (km == NULL) {
 		free(ap);
 		return;
 	}
+	km->in_use -= *((size_t*)ap - 1);
+	if (*((size_t*)ap - 1) < KM_N_BIN) { /* a small block; put it to its bin */
+		header_t *p = (header_t*)((size_t*)ap - 1); /* p->size is the size of the block */
+		p->ptr = km->bin[p->size], km->bin[p->size] = p;
+		return;
+	}
+	km_insert(km, ap);
+}
+
+static size_t km_unbin(kmem_t *km) /* move all binned blocks back to the circular list */
+{
+	size_t i, n = 0;
+	for (i = 1; i < KM_N_BIN; ++i) {
+		header_t *p, *q;
+		for (p = km->bin[i]; p != NULL; p = q, ++n) {
+			q = p->ptr;
+			km_insert(km, (size_t*)p + 1);
+		}
+		km->bin[i] = NULL;
+	}
+	return n;
+}
+
+static void km_insert(kmem_t *km, void *ap) /* put a block back to the circular list; this also adds a new core */
+{
+	header_t *p, *q;
 	p = (header_t*)((size_t*)ap - 1);
 	p->size = *((size_t*)ap - 1);
 	/* Find the pointer that points to the block to be freed. The following loop can stop on two conditions:
@@ -134,6 +169,13 @@ void *kmalloc(void *_km, size_t n_bytes)
 	if (n_bytes == 0) return 0;
 	if (km == NULL) return malloc(n_bytes);
 	n_units = (n_bytes + sizeof(size_t) + sizeof(header_t) - 1) / sizeof(header_t); /* header+n_bytes requires at least this number of units */
+	if (n_units < KM_N_BIN && km->bin[n_units]) { /* reuse a freed block of the same size */
+		p = km->bin[n_units];
+		km->bin[n_units] = p->ptr;
+		km->in_use += n_units;
+		if (km->in_use > km->peak) km->peak = km->in_use;
+		return (size_t*)p + 1;
+	}
 
 	if (!(q = km->loop_head)) /* the first time when kmalloc() is called, intialize it */
 		q = km->loop_head = km->base.ptr = &km->base;
@@ -146,10 +188,13 @@ void *kmalloc(void *_km, size_t n_bytes)
 				*(size_t*)p = n_units; /* set the size */
 			}
 			km->loop_head = q; /* set the end of chain */
+			km->in_use += n_units;
+			if (km->in_use > km->peak) km->peak = km->in_use;
 			return (size_t*)p + 1;
 		}
-		if (p == km->loop_head) { /* then ask for more "cores" */
-			if ((p = morecore(km, n_units)) == 0) return 0;
+		if (p == km->loop_head) { /* then merge the bins back, or ask for more "cores" if there are none */
+			if (km_unbin(km) > 0) p = km->loop_head;
+			else if ((p = morecore(km, n_units)) == 0) return 0;
 		}
 	}
 }
@@ -194,12 +239,30 @@ void *krelocate(void *km, void *ap, size_t n_bytes)
 	return p;
 }
 
+void km_reset(void *_km) /* free all blocks at once but keep the cores; O(#cores) instead of O(#blocks) */
+{
+	kmem_t *km = (kmem_t*)_km;
+	header_t *p;
+	if (km == NULL || km->loop_head == NULL) return;
+	km->base.size = 0;
+	km->loop_head = km->base.ptr = &km->base;
+	memset(km->bin, 0, sizeof(km->bin));
+	for (p = km->core_head; p != NULL; p = p->ptr) {
+		size_t *q = (size_t*)(p + 1);
+		*q = p->size - 1;
+		km_insert(km, q + 1);
+	}
+	km->in_use = 0;
+}
+
 void km_stat(const void *_km, km_stat_t *s)
 {
 	kmem_t *km = (kmem_t*)_km;
 	header_t *p;
+	size_t i;
 	memset(s, 0, sizeof(km_stat_t));
 	if (km == NULL || km->loop_head == NULL) return;
+	s->peak = km->peak * sizeof(header_t);
 	for (p = km->loop_head;; p = p->ptr) {
 		s->available += p->size * sizeof(header_t);
 		if (p->size != 0) ++s->n_blocks; /* &kmem_t::base is always one of the cores. It is zero-sized. */
@@ -207,6 +270,12 @@ void km_stat(const void *_km, km_stat_t *s)
 			panic("[km_stat] The end of a free block enters another free block.");
 		if (p->ptr == km->loop_head) break;
 	}
+	for (i = 1; i < KM_N_BIN; ++i) {
+		for (p = km->bin[i]; p != NULL; p = p->ptr) {
+			s->available += i * sizeof(header_t);
+			++s->n_blocks;
+		}
+	}
 	for (p = km->core_head; p != NULL; p = p->ptr) {
 		size_t size = p->size * sizeof(header_t);
 		++s->n_cores;
@@ -219,6 +288,6 @@ void km_stat_print(const void *km)
 {
 	km_stat_t st;
 	km_stat(km, &st);
-	fprintf(stderr, "[km_stat] cap=%ld, avail=%ld, largest=%ld, n_core=%ld, n_block=%ld\n",
-			st.capacity, st.available, st.largest, st.n_blocks, st.n_cores);
+	fprintf(stderr, "[km_stat] cap=%ld, avail=%ld, peak=%ld, largest=%ld, n_core=%ld, n_block=%ld\n",
+			st.capacity, st.available, st.peak, st.largest, st.n_blocks, st.n_cores);
 }
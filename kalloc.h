@@ -9,6 +9,7 @@ extern "C" {
 
 typedef struct {
 	size_t capacity, available, n_blocks, n_cores, largest;
+	size_t peak; /* high-water mark of allocated bytes */
 } km_stat_t;
 
 void *kmalloc(void *km, size_t size);
@@ -20,6 +21,7 @@ void kfree(void *km, void *ptr);
 void *km_init(void);
 void *km_init2(void *km_par, size_t min_core_size);
 void km_destroy(void *km);
+void km_reset(void *km);
 void km_stat(const void *_km, km_stat_t *s);
 void km_stat_print(const void *km);
 
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "kthread.h"
+#include "ketopt.h"
+
+/*
+ * .kmi file format: the SA intervals of all k-mers over ACGT
+ *
+ *   char     magic[4]   "KMI\1"
+ *   int32_t  k
+ *   int64_t  bwt_len    for checking against the BWT
+ *   int64_t  n_kmer     4^k
+ *   int64_t  reserved
+ *   int64_t  a[n_kmer * 2]
+ *
+ * a[i*2] and a[i*2+1] are the start and the size of the backward interval of
+ * the k-mer encoded by i, with A=0, C=1, G=2, T=3 and the first base at the
+ * most significant bits. The forward interval of a k-mer is the backward
+ * interval of its reverse complement. For k-mers absent from the BWT, both
+ * values are zero. The 32-byte header keeps the array aligned such that it
+ * can be used directly from mmap.
+ */
+#define RB3_KMI_MAGIC    "KMI\1"
+#define RB3_KMI_HDR_SIZE 32
+#define RB3_KMI_MAX_K    16
+
+typedef struct {
+	const rb3_fmi_t *f;
+	int32_t k, d;
+	int64_t *a;
+} kmi_build_t;
+
+static void kmi_fill(kmi_build_t *b, const rb3_sai_t *ik, int32_t l, uint64_t x) // ik is the interval of the l-mer encoded by x
+{
+	rb3_sai_t ok[RB3_ASIZE];
+	int c;
+	if (l == b->k) {
+		b->a[x<<1] = ik->x[0], b->a[x<<1|1] = ik->size;
+		return;
+	}
+	if (ik->size == 0) { // the entire subtree is absent; the array is zero-initialized
+		return;
+	}
+	rb3_fmd_extend(b->f, ik, ok, 1);
+	for (c = 1; c <= 4; ++c)
+		kmi_fill(b, &ok[c], l + 1, (uint64_t)(c - 1) << (l<<1) | x);
+}
+
+static void worker_kmi(void *data, long i, int tid) // process all k-mers ending with the d-mer i
+{
+	kmi_build_t *b = (kmi_build_t*)data;
+	rb3_sai_t ik, ok[RB3_ASIZE];
+	int32_t j;
+	rb3_fmd_set_intv(b->f, (i & 3) + 1, &ik);
+	for (j = 1; j < b->d && ik.size > 0; ++j) {
+		int c = (i >> (j<<1) & 3) + 1;
+		rb3_fmd_extend(b->f, &ik, ok, 1);
+		ik = ok[c];
+	}
+	if (ik.size > 0) kmi_fill(b, &ik, b->d, i);
+}
+
+rb3_kmi_t *rb3_kmi_build(const rb3_fmi_t *f, int32_t k, int n_threads)
+{
+	kmi_build_t b;
+	rb3_kmi_t *ki;
+	if (k < 1 || k > RB3_KMI_MAX_K) return 0;
+	ki = RB3_CALLOC(rb3_kmi_t, 1);
+	ki->k = k, ki->bwt_len = f->acc[RB3_ASIZE];
+	ki->n_kmer = 1LL << (k<<1);
+	ki->buf = RB3_CALLOC(int64_t, ki->n_kmer * 2);
+	ki->a = ki->buf;
+	b.f = f, b.k = k, b.a = ki->buf;
+	b.d = k < 4? k : 4;
+	kt_for(n_threads, worker_kmi, &b, 1L << (b.d<<1));
+	return ki;
+}
+
+int rb3_kmi_dump(const rb3_kmi_t *ki, const char *fn)
+{
+	FILE *fp;
+	int64_t x = 0;
+	fp = fn && strcmp(fn, "-") != 0? fopen(fn, "wb") : fdopen(1, "wb");
+	if (fp == 0) return -1;
+	fwrite(RB3_KMI_MAGIC, 1, 4, fp);
+	fwrite(&ki->k, 4, 1, fp);
+	fwrite(&ki->bwt_len, 8, 1, fp);
+	fwrite(&ki->n_kmer, 8, 1, fp);
+	fwrite(&x, 8, 1, fp);
+	fwrite(ki->a, 8, ki->n_kmer * 2, fp);
+	fclose(fp);
+	return 0;
+}
+
+rb3_kmi_t *rb3_kmi_load_at(const char *fn, int64_t off, int64_t size)
+{
+	rb3_kmi_t *ki;
+	uint8_t *base;
+	int fd;
+	if (size < RB3_KMI_HDR_SIZE || (fd = open(fn, O_RDONLY)) < 0) return 0;
+	base = (uint8_t*)mmap(0, size, PROT_READ, MAP_SHARED, fd, off);
+	close(fd);
+	if (base == MAP_FAILED) return 0;
+	ki = RB3_CALLOC(rb3_kmi_t, 1);
+	memcpy(&ki->k, base + 4, 4);
+	memcpy(&ki->bwt_len, base + 8, 8);
+	memcpy(&ki->n_kmer, base + 16, 8);
+	if (memcmp(base, RB3_KMI_MAGIC, 4) != 0 || ki->k < 1 || ki->k > RB3_KMI_MAX_K || ki->n_kmer != 1LL << (ki->k<<1)
+		|| (uint64_t)size != RB3_KMI_HDR_SIZE + (uint64_t)ki->n_kmer * 16) {
+		munmap(base, size);
+		free(ki);
+		return 0;
+	}
+	ki->mm = base, ki->mm_len = size;
+	ki->a = (const int64_t*)(base + RB3_KMI_HDR_SIZE);
+	return ki;
+}
+
+rb3_kmi_t *rb3_kmi_load(const char *fn)
+{
+	struct stat st;
+	if (stat(fn, &st) != 0) return 0;
+	return rb3_kmi_load_at(fn, 0, st.st_size);
+}
+
+void rb3_kmi_destroy(rb3_kmi_t *ki)
+{
+	if (ki == 0) return;
+	if (ki->mm) munmap(ki->mm, ki->mm_len);
+	free(ki->buf);
+	free(ki);
+}
+
+int main_kmi(int argc, char *argv[])
+{
+	int c, n_threads = 4, k = 12, ret;
+	rb3_kmi_t *ki;
+	rb3_fmi_t f;
+	char *fn = 0;
+	ketopt_t o = KETOPT_INIT;
+
+	while ((c = ketopt(&o, argc, argv, 1, "t:k:o:", 0)) >= 0) {
+		if (c == 't') n_threads = atoi(o.arg);
+		else if (c == 'k') k = atoi(o.arg);
+		else if (c == 'o') fn = o.arg;
+	}
+	if (argc == o.ind) {
+		fprintf(stderr, "Usage: ropebwt3 kmi [options] <in.fmd>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -k INT     k-mer length; the table takes 16*4^k bytes [%d]\n", k);
+		fprintf(stderr, "  -t INT     number of threads [%d]\n", n_threads);
+		fprintf(stderr, "  -o FILE    output to file [<in.fmd>.kmi]\n");
+		return 1;
+	}
+	if (k < 1 || k > RB3_KMI_MAX_K) {
+		fprintf(stderr, "[E::%s] k must be between 1 and %d\n", __func__, RB3_KMI_MAX_K);
+		return 1;
+	}
+	rb3_fmi_restore(&f, argv[o.ind], 0);
+	if (f.e == 0 && f.r == 0) {
+		fprintf(stderr, "[E::%s] failed to load the FM-index\n", __func__);
+		return 1;
+	}
+	if (!rb3_fmi_is_symmetric(&f)) {
+		fprintf(stderr, "[E::%s] the k-mer table requires a BWT built from both strands\n", __func__);
+		rb3_fmi_free(&f);
+		return 1;
+	}
+	ki = rb3_kmi_build(&f, k, n_threads);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] computed the intervals of %ld %d-mers\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)ki->n_kmer, k);
+	if (fn == 0) {
+		char *buf = RB3_CALLOC(char, strlen(argv[o.ind]) + 5);
+		strcat(strcpy(buf, argv[o.ind]), ".kmi");
+		ret = rb3_kmi_dump(ki, buf);
+		free(buf);
+	} else ret = rb3_kmi_dump(ki, fn);
+	if (ret < 0) fprintf(stderr, "[E::%s] failed to write the k-mer table\n", __func__);
+	rb3_kmi_destroy(ki);
+	rb3_fmi_free(&f);
+	return ret < 0? 1 : 0;
+}
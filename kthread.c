@@ -37,9 +37,8 @@ static inline long steal_work(kt_for_t *t)
 	return k >= t->n? -1 : k;
 }
 
-static void *ktf_worker(void *data)
+static void ktf_run(ktf_worker_t *w)
 {
-	ktf_worker_t *w = (ktf_worker_t*)data;
 	long i;
 	for (;;) {
 		i = __sync_fetch_and_add(&w->i, w->t->n_threads);
@@ -48,6 +47,11 @@ static void *ktf_worker(void *data)
 	}
 	while ((i = steal_work(w->t)) >= 0)
 		w->t->func(w->t->data, i, w - w->t->w);
+}
+
+static void *ktf_worker(void *data)
+{
+	ktf_run((ktf_worker_t*)data);
 	pthread_exit(0);
 }
 
@@ -71,6 +75,127 @@ void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n)
 	}
 }
 
+/****************
+ * kt_forpool() *
+ ****************/
+
+/* A kt_forpool() call runs like kt_for() with n_threads slots. The caller
+ * takes slot 0; idle pool threads take the others. Slots nobody takes are
+ * finished by work stealing, so a call never waits for a busy pool. */
+
+typedef struct ktfp_job_t {
+	kt_for_t t;
+	int n_joined, n_active; // slots taken; threads still in ktf_run()
+	struct ktfp_job_t *next;
+} ktfp_job_t;
+
+struct kt_forpool_t {
+	int n_threads, stop;
+	pthread_t *tid;
+	ktfp_job_t *jobs; // calls with free slots
+	pthread_mutex_t mutex;
+	pthread_cond_t cv_job, cv_done;
+};
+
+static void ktfp_unlink(kt_forpool_t *fp, ktfp_job_t *j)
+{
+	ktfp_job_t **p;
+	for (p = &fp->jobs; *p; p = &(*p)->next)
+		if (*p == j) {
+			*p = j->next;
+			break;
+		}
+}
+
+static void *ktfp_worker(void *data)
+{
+	kt_forpool_t *fp = (kt_forpool_t*)data;
+	for (;;) {
+		ktfp_job_t *j;
+		int slot;
+		pthread_mutex_lock(&fp->mutex);
+		while (!fp->stop && fp->jobs == 0)
+			pthread_cond_wait(&fp->cv_job, &fp->mutex);
+		if (fp->stop) {
+			pthread_mutex_unlock(&fp->mutex);
+			break;
+		}
+		j = fp->jobs;
+		slot = j->n_joined++;
+		++j->n_active;
+		if (j->n_joined == j->t.n_threads) ktfp_unlink(fp, j);
+		pthread_mutex_unlock(&fp->mutex);
+
+		ktf_run(&j->t.w[slot]);
+
+		pthread_mutex_lock(&fp->mutex);
+		if (--j->n_active == 0) pthread_cond_broadcast(&fp->cv_done);
+		pthread_mutex_unlock(&fp->mutex);
+	}
+	pthread_exit(0);
+}
+
+kt_forpool_t *kt_forpool_init(int n_threads)
+{
+	kt_forpool_t *fp;
+	int i;
+	fp = (kt_forpool_t*)calloc(1, sizeof(kt_forpool_t));
+	fp->n_threads = n_threads > 0? n_threads : 1;
+	pthread_mutex_init(&fp->mutex, 0);
+	pthread_cond_init(&fp->cv_job, 0);
+	pthread_cond_init(&fp->cv_done, 0);
+	fp->tid = (pthread_t*)calloc(fp->n_threads, sizeof(pthread_t));
+	for (i = 0; i < fp->n_threads; ++i) pthread_create(&fp->tid[i], 0, ktfp_worker, fp);
+	return fp;
+}
+
+void kt_forpool_destroy(kt_forpool_t *fp)
+{
+	int i;
+	if (fp == 0) return;
+	pthread_mutex_lock(&fp->mutex);
+	fp->stop = 1;
+	pthread_cond_broadcast(&fp->cv_job);
+	pthread_mutex_unlock(&fp->mutex);
+	for (i = 0; i < fp->n_threads; ++i) pthread_join(fp->tid[i], 0);
+	pthread_mutex_destroy(&fp->mutex);
+	pthread_cond_destroy(&fp->cv_job);
+	pthread_cond_destroy(&fp->cv_done);
+	free(fp->tid); free(fp);
+}
+
+void kt_forpool(kt_forpool_t *fp, int n_threads, void (*func)(void*,long,int), void *data, long n)
+{
+	if (fp == 0) {
+		kt_for(n_threads, func, data, n);
+	} else if (n_threads > 1) {
+		int i;
+		ktfp_job_t j;
+		j.t.func = func, j.t.data = data, j.t.n_threads = n_threads, j.t.n = n;
+		j.t.w = (ktf_worker_t*)calloc(n_threads, sizeof(ktf_worker_t));
+		for (i = 0; i < n_threads; ++i)
+			j.t.w[i].t = &j.t, j.t.w[i].i = i;
+		j.n_joined = j.n_active = 1;
+		pthread_mutex_lock(&fp->mutex);
+		j.next = fp->jobs, fp->jobs = &j;
+		pthread_cond_broadcast(&fp->cv_job);
+		pthread_mutex_unlock(&fp->mutex);
+
+		ktf_run(&j.t.w[0]);
+
+		pthread_mutex_lock(&fp->mutex);
+		if (j.n_joined < n_threads) ktfp_unlink(fp, &j); // no thread may join after this
+		--j.n_active;
+		while (j.n_active > 0)
+			pthread_cond_wait(&fp->cv_done, &fp->mutex);
+		pthread_mutex_unlock(&fp->mutex);
+		free(j.t.w);
+	} else {
+		long k;
+		for (k = 0; k < n; ++k) func(data, k, 0);
+	}
+}
+
 /*****************
  * kt_pipeline() *
  *****************/
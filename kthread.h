@@ -6,6 +6,13 @@ extern "C" {
 #endif
 
 void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+
+/* A pool of threads shared by kt_forpool() calls, which may run concurrently;
+ * kt_forpool() with a NULL pool is kt_for() */
+typedef struct kt_forpool_t kt_forpool_t;
+kt_forpool_t *kt_forpool_init(int n_threads);
+void kt_forpool_destroy(kt_forpool_t *fp);
+void kt_forpool(kt_forpool_t *fp, int n_threads, void (*func)(void*,long,int), void *data, long n);
 void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps);
 
 #ifdef __cplusplus
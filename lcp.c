@@ -4,6 +4,8 @@
 #include "rb3priv.h"
 #include "fm-index.h"
 #include "lcp.h"
+#include "io.h"
+#include "move.h"
 #include "ketopt.h"
 
 /**********************
@@ -534,6 +536,38 @@ void rb3_pml_compute(const rb3_fmi_t *f, const rb3_lcp_t *lcp, const uint8_t *pa
  * main() function *
  *******************/
 
+void rb3_ms_stream(FILE *out, const rb3_fmi_t *fmi, const rb3_move_t *m, const rb3_lcp_t *lcp, rb3_seqio_t *fp,
+				   int use_pml, int classify, int64_t min_match, double min_fraction) // matching statistics of every sequence in fp
+{
+	const char *name;
+	char *seq;
+	int64_t len;
+	while ((seq = rb3_seq_read1(fp, &len, &name)) != 0) {
+		int64_t *ms, i;
+		rb3_char2nt6(len, (uint8_t *)seq);
+		ms = RB3_MALLOC(int64_t, len);
+		if (use_pml)
+			rb3_pml_compute(fmi, lcp, (const uint8_t *)seq, len, ms);
+		else if (m)
+			rb3_move_ms_compute(m, lcp, len, (const uint8_t *)seq, ms);
+		else
+			rb3_ms_compute(fmi, lcp, (const uint8_t *)seq, len, ms);
+		if (classify) {
+			int64_t count = 0;
+			for (i = 0; i < len; ++i)
+				if (ms[i] >= min_match) ++count;
+			fprintf(out, "%s\t%ld\t%s\n",
+			        name ? name : "seq", (long)len,
+			        (double)count / len >= min_fraction ? "Y" : "N");
+		} else {
+			fprintf(out, ">%s\n", name ? name : "seq");
+			for (i = 0; i < len; ++i)
+				fprintf(out, "%ld%c", (long)ms[i], i + 1 < len ? ' ' : '\n');
+		}
+		free(ms);
+	}
+}
+
 int main_lcp(int argc, char *argv[])
 {
 	int c, verify = 0, do_thresholds = 0;
@@ -2,6 +2,7 @@
 #define RB3_LCP_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include "fm-index.h"
 
 #ifdef __cplusplus
@@ -35,6 +36,11 @@ void rb3_ms_compute(const rb3_fmi_t *f, const rb3_lcp_t *lcp, const uint8_t *pat
 /* Pseudo-matching lengths: faster but less precise variant of matching statistics */
 void rb3_pml_compute(const rb3_fmi_t *f, const rb3_lcp_t *lcp, const uint8_t *pattern, int64_t len, int64_t *pml);
 
+/* Write matching statistics (or PML, or a classification) of every sequence in fp; m may be NULL */
+struct rb3_move_s;
+void rb3_ms_stream(FILE *out, const rb3_fmi_t *fmi, const struct rb3_move_s *m, const rb3_lcp_t *lcp, rb3_seqio_t *fp,
+				   int use_pml, int classify, int64_t min_match, double min_fraction);
+
 int main_lcp(int argc, char *argv[]);
 
 #ifdef __cplusplus
@@ -22,7 +22,13 @@ int main_plain2fmd(int argc, char *argv[]);
 int main_lcp(int argc, char *argv[]);
 int main_move(int argc, char *argv[]);
 int main_srindex(int argc, char *argv[]);
+int main_kmi(int argc, char *argv[]);
 int main_stat(int argc, char *argv[]);
+int main_serve(int argc, char *argv[]);
+int main_query(int argc, char *argv[]);
+int main_shm_load(int argc, char *argv[]);
+int main_pack(int argc, char *argv[]);
+int main_sid(int argc, char *argv[]);
 static int main_ms(int argc, char *argv[]);
 
 static int usage(FILE *fp)
@@ -35,15 +41,21 @@ static int usage(FILE *fp)
 	fprintf(fp, "    hapdiv     haplotype diversity with sliding k-mers\n");
 	fprintf(fp, "    ms         compute matching statistics\n");
 	fprintf(fp, "    suffix     find the longest matching suffix\n");
+	fprintf(fp, "    serve      load the index once and serve queries over a Unix socket\n");
+	fprintf(fp, "    query      send queries to a running server\n");
 	fprintf(fp, "  Construction:\n");
 	fprintf(fp, "    build      construct a BWT\n");
 	fprintf(fp, "    merge      merge BWTs\n");
 	fprintf(fp, "    plain2fmd  convert BWT in plain text to FMD\n");
 	fprintf(fp, "    ssa        generate sampled suffix array\n");
 	fprintf(fp, "    srindex    generate SR-index (subsampled r-index)\n");
+	fprintf(fp, "    kmi        precompute SA intervals of k-mers\n");
+	fprintf(fp, "    sid        convert sequence names and lengths to the binary format\n");
+	fprintf(fp, "    pack       pack an index and its companion files into one file\n");
 	fprintf(fp, "  Miscellaneous:\n");
 	fprintf(fp, "    get        retrieve the i-th sequence from BWT\n");
 	fprintf(fp, "    move       build or load move index\n");
+	fprintf(fp, "    shm-load   copy an index to shared memory for zero-copy loading\n");
 	fprintf(fp, "    stat       basic statistics of BWT\n");
 	fprintf(fp, "    kount      count (high-occurrence) k-mers\n");
 	fprintf(fp, "    fa2line    convert FASTX to lines\n");
@@ -66,10 +78,16 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "ssa") == 0) ret = main_ssa(argc-1, argv+1);
 	else if (strcmp(argv[1], "lcp") == 0) ret = main_lcp(argc-1, argv+1);
 	else if (strcmp(argv[1], "srindex") == 0) ret = main_srindex(argc-1, argv+1);
+	else if (strcmp(argv[1], "kmi") == 0) ret = main_kmi(argc-1, argv+1);
 	else if (strcmp(argv[1], "move") == 0) ret = main_move(argc-1, argv+1);
 	else if (strcmp(argv[1], "ms") == 0) ret = main_ms(argc-1, argv+1);
 	else if (strcmp(argv[1], "stat") == 0) ret = main_stat(argc-1, argv+1);
 	else if (strcmp(argv[1], "suffix") == 0) ret = main_suffix(argc-1, argv+1);
+	else if (strcmp(argv[1], "serve") == 0) ret = main_serve(argc-1, argv+1);
+	else if (strcmp(argv[1], "query") == 0) ret = main_query(argc-1, argv+1);
+	else if (strcmp(argv[1], "sid") == 0) ret = main_sid(argc-1, argv+1);
+	else if (strcmp(argv[1], "pack") == 0) ret = main_pack(argc-1, argv+1);
+	else if (strcmp(argv[1], "shm-load") == 0) ret = main_shm_load(argc-1, argv+1);
 	else if (strcmp(argv[1], "get") == 0) ret = main_get(argc-1, argv+1);
 	else if (strcmp(argv[1], "kount") == 0) ret = main_kount(argc-1, argv+1);
 	else if (strcmp(argv[1], "fa2line") == 0) ret = main_fa2line(argc-1, argv+1);
@@ -497,17 +515,65 @@ int main_move(int argc, char *argv[])
 	return 0;
 }
 
+int main_sid(int argc, char *argv[])
+{
+	int32_t c;
+	ketopt_t o = KETOPT_INIT;
+	rb3_sid_t *sid;
+	char *fn = 0;
+	FILE *fp;
+
+	while ((c = ketopt(&o, argc, argv, 1, "o:", 0)) >= 0) {
+		if (c == 'o') fn = o.arg;
+	}
+	if (argc - o.ind == 0) {
+		fprintf(stderr, "Usage: ropebwt3 sid [-o idx.fmd.sid] <idx.fmd.len.gz>\n");
+		return 1;
+	}
+	sid = rb3_sid_read(argv[o.ind]);
+	if (sid == 0) {
+		fprintf(stderr, "ERROR: failed to read sequence names and lengths from file '%s'\n", argv[o.ind]);
+		return 1;
+	}
+	fp = fn && strcmp(fn, "-")? fopen(fn, "wb") : fdopen(1, "wb");
+	if (fp == 0) {
+		fprintf(stderr, "ERROR: failed to create file '%s'\n", fn);
+		rb3_sid_destroy(sid);
+		return 1;
+	}
+	rb3_sid_write(sid, fp);
+	fclose(fp);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s] wrote %ld sequences\n", __func__, (long)sid->n_seq);
+	rb3_sid_destroy(sid);
+	return 0;
+}
+
 int main_stat(int argc, char *argv[])
 {
 	int32_t c, use_mmap = 0;
 	ketopt_t o = KETOPT_INIT;
 	rb3_fmi_t fmi;
+	rb3_pack_t *pk;
 
 	while ((c = ketopt(&o, argc, argv, 1, "M", 0)) >= 0) { }
 	if (argc - o.ind == 0) {
 		fprintf(stdout, "Usage: ropebwt3 stat [-M] <idx.fmd>\n");
 		return 0;
 	}
+	if ((pk = rb3_pack_read(argv[o.ind])) != 0) { // precomputed in the header of a container
+		int64_t *acc = pk->acc;
+		printf("%ld sequences\n", (long)acc[1]);
+		printf("%ld symbols\n", (long)acc[6]);
+		printf("%ld runs\n", (long)pk->n_runs);
+		printf("%ld A\n", (long)(acc[2] - acc[1]));
+		printf("%ld C\n", (long)(acc[3] - acc[2]));
+		printf("%ld G\n", (long)(acc[4] - acc[3]));
+		printf("%ld T\n", (long)(acc[5] - acc[4]));
+		printf("%ld N\n", (long)(acc[6] - acc[5]));
+		rb3_pack_destroy(pk);
+		return 0;
+	}
 	rb3_fmi_restore(&fmi, argv[o.ind], use_mmap);
 	if (fmi.e == 0 && fmi.r == 0) {
 		if (rb3_verbose >= 1)
@@ -590,38 +656,12 @@ int main_ms(int argc, char *argv[])
 	/* Process query sequences */
 	for (j = o.ind + 1; j < argc; ++j) {
 		rb3_seqio_t *fp;
-		const char *name;
-		char *seq;
-		int64_t len;
 		fp = rb3_seq_open(argv[j], is_line);
 		if (fp == 0) {
 			fprintf(stderr, "[E::%s] failed to open '%s'\n", __func__, argv[j]);
 			continue;
 		}
-		while ((seq = rb3_seq_read1(fp, &len, &name)) != 0) {
-			int64_t *ms, i;
-			rb3_char2nt6(len, (uint8_t *)seq);
-			ms = RB3_MALLOC(int64_t, len);
-			if (use_pml)
-				rb3_pml_compute(&fmi, lcp, (const uint8_t *)seq, len, ms);
-			else if (m)
-				rb3_move_ms_compute(m, lcp, len, (const uint8_t *)seq, ms);
-			else
-				rb3_ms_compute(&fmi, lcp, (const uint8_t *)seq, len, ms);
-			if (classify) {
-				int64_t count = 0;
-				for (i = 0; i < len; ++i)
-					if (ms[i] >= min_match) ++count;
-				printf("%s\t%ld\t%s\n",
-				       name ? name : "seq", (long)len,
-				       (double)count / len >= min_fraction ? "Y" : "N");
-			} else {
-				printf(">%s\n", name ? name : "seq");
-				for (i = 0; i < len; ++i)
-					printf("%ld%c", (long)ms[i], i + 1 < len ? ' ' : '\n');
-			}
-			free(ms);
-		}
+		rb3_ms_stream(stdout, &fmi, m, lcp, fp, use_pml, classify, min_match, min_fraction);
 		rb3_seq_close(fp);
 	}
 
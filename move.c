@@ -530,22 +530,14 @@ int rb3_move_save(const rb3_move_t *m, const char *fn)
 	return 0;
 }
 
-rb3_move_t *rb3_move_load(const char *fn)
+rb3_move_t *rb3_move_load_mem(const uint8_t *base, size_t size)
 {
 	rb3_move_t *m;
-	int fd;
-	struct stat st;
-	uint8_t *base;
 	uint32_t flags, row_size;
 	uint64_t checksum;
 	int is_v2;
 
-	fd = open(fn, O_RDONLY);
-	if (fd < 0) return 0;
-	if (fstat(fd, &st) != 0 || st.st_size < RB3_MVI_HDR_SIZE) { close(fd); return 0; }
-
-	base = (uint8_t *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (base == MAP_FAILED) { close(fd); return 0; }
+	if (size < RB3_MVI_HDR_SIZE) return 0;
 
 	/* Check magic */
 	is_v2 = (memcmp(base, RB3_MVI_MAGIC_V2, 4) == 0);
@@ -571,7 +563,7 @@ rb3_move_t *rb3_move_load(const char *fn)
 			+ (size_t)m->n_runs * sizeof(uint16_t)    /* len */
 			+ (size_t)m->n_runs * sizeof(int8_t)      /* c */
 			+ (size_t)m->n_runs * RB3_ASIZE * sizeof(int16_t); /* dist */
-		if ((size_t)st.st_size != expected) goto fail2;
+		if (size != expected) goto fail2;
 
 		move_alloc_arrays(m, m->n_runs);
 
@@ -604,10 +596,6 @@ rb3_move_t *rb3_move_load(const char *fn)
 		move_derive_p(m);
 		move_derive_pi(m);
 
-		/* Unmap — we copied the data */
-		munmap(base, st.st_size);
-		close(fd);
-
 	} else {
 		/* V1: legacy 48-byte rows */
 		int64_t i;
@@ -616,7 +604,7 @@ rb3_move_t *rb3_move_load(const char *fn)
 
 		if (row_size != RB3_MVI_ROW_SIZE_V1) goto fail2;
 		expected = RB3_MVI_HDR_SIZE + (size_t)m->n_runs * row_size;
-		if ((size_t)st.st_size != expected) goto fail2;
+		if (size != expected) goto fail2;
 
 		rows = (const rb3_move_row_t *)(base + RB3_MVI_HDR_SIZE);
 
@@ -640,10 +628,6 @@ rb3_move_t *rb3_move_load(const char *fn)
 			m->c[i]   = rows[i].c;
 			memcpy(&m->dist[i * RB3_ASIZE], rows[i].dist, RB3_ASIZE * sizeof(int16_t));
 		}
-
-		/* Unmap — we copied the data */
-		munmap(base, st.st_size);
-		close(fd);
 	}
 
 	return m;
@@ -653,11 +637,28 @@ fail3:
 fail2:
 	free(m);
 fail:
-	munmap(base, st.st_size);
-	close(fd);
 	return 0;
 }
 
+rb3_move_t *rb3_move_load(const char *fn)
+{
+	rb3_move_t *m;
+	int fd;
+	struct stat st;
+	uint8_t *base;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) != 0 || st.st_size < RB3_MVI_HDR_SIZE) { close(fd); return 0; }
+
+	base = (uint8_t *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return 0;
+	m = rb3_move_load_mem(base, st.st_size);
+	munmap(base, st.st_size); /* the arrays are copied */
+	return m;
+}
+
 /***********************************************
  * Move + LCP matching statistics (MONI-style) *
  ***********************************************/
@@ -1073,6 +1074,22 @@ static int64_t rb3_bmove_smem1_TG(void *km, const rb3_bmove_t *bm, int64_t min_o
 	return i + 1;
 }
 
+int64_t rb3_bmove_smem_TG_range(void *km, const rb3_bmove_t *bm, int64_t len, const uint8_t *q, int64_t st, int64_t en, rb3_sai_v *mem, int64_t min_occ, int64_t min_len)
+{
+	int64_t x = st;
+	mem->n = 0;
+	if (x >= en) return 0;
+	x = rb3_bmove_smem1_TG(km, bm, min_occ, min_len, len, q, x, mem, 0);
+	if (st > 0 && mem->n == 1) { // drop the first MEM if it is not left-maximal
+		rb3_sai_t ok[6];
+		rb3_bmove_extend(bm, &mem->a[0], ok, 1);
+		if (ok[q[st-1]].size >= min_occ) mem->n = 0;
+	}
+	while (x < en)
+		x = rb3_bmove_smem1_TG(km, bm, min_occ, min_len, len, q, x, mem, 0);
+	return mem->n;
+}
+
 int64_t rb3_bmove_smem_TG(void *km, const rb3_bmove_t *bm, int64_t len, const uint8_t *q, rb3_sai_v *mem, int64_t min_occ, int64_t min_len)
 {
 	int64_t x = 0;
@@ -100,6 +100,9 @@ int rb3_move_save(const rb3_move_t *m, const char *fn);
 // Returns NULL on error.
 rb3_move_t *rb3_move_load(const char *fn);
 
+// Same as rb3_move_load() but from the content of a .mvi file in memory; the arrays are copied.
+rb3_move_t *rb3_move_load_mem(const uint8_t *base, size_t size);
+
 /*
  * b-move: bidirectional move structure for FMD-style bidirectional search.
  *
@@ -135,6 +138,9 @@ int64_t rb3_bmove_smem(void *km, const rb3_bmove_t *bm, int64_t len, const uint8
 // SMEM finding using b-move (Travis Gagie algorithm, same as rb3_fmd_smem_TG).
 int64_t rb3_bmove_smem_TG(void *km, const rb3_bmove_t *bm, int64_t len, const uint8_t *q, rb3_sai_v *mem, int64_t min_occ, int64_t min_len);
 
+// As rb3_bmove_smem_TG() but only for MEMs starting in [st,en).
+int64_t rb3_bmove_smem_TG_range(void *km, const rb3_bmove_t *bm, int64_t len, const uint8_t *q, int64_t st, int64_t en, rb3_sai_v *mem, int64_t min_occ, int64_t min_len);
+
 #ifdef __cplusplus
 }
 #endif
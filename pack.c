@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "ketopt.h"
+
+/*
+ * Single-file index container (.rb3)
+ *
+ *   char     magic[4]    "RB3\1"
+ *   int32_t  n_sec       number of sections
+ *   int64_t  acc[7]      cumulative symbol counts; acc[6] is the length of the BWT
+ *   int64_t  n_runs      number of runs in the BWT
+ *   int64_t  n_seq       number of sequences
+ *   int64_t  reserved[6]
+ *   struct {             table of contents, 32 bytes per section
+ *     char     tag[4]    "FMD ", "SSA ", "SRI ", "MVI ", "KMI " or "SID "
+ *     uint32_t flags     reserved
+ *     int64_t  off       offset from the start of the file; a multiple of RB3_PACK_ALIGN
+ *     int64_t  size      size of the section in bytes
+ *     uint64_t crc       CRC32 of the section
+ *   } toc[n_sec]
+ *
+ * Each section is the content of the corresponding component file in its
+ * current format, except that the sampled suffix array is always in the packed
+ * "SSA\3" format, the SR-index in the "SRI\5" format and SID in the binary
+ * .sid format even if the index comes with .len.gz. As sections start at page
+ * boundaries, the FMD, the SSA, the SR-index, the k-mer intervals and the
+ * sequence list are mapped in place. Checksums are only verified on request
+ * with "ropebwt3 pack -c" because reading a large index defeats mmap.
+ */
+
+#define RB3_PACK_MAGIC  "RB3\1"
+#define RB3_PACK_ALIGN  65536 // a multiple of all common page sizes
+#define RB3_PACK_HDR    128
+
+static const char *pack_comp[][2] = { // section tag and file suffix; the FMD comes first
+	{ "FMD ", "" }, { "SSA ", ".ssa" }, { "SRI ", ".sri" }, { "MVI ", ".mvi" }, { "KMI ", ".kmi" }, { "SID ", ".sid" }, { 0, 0 }
+};
+
+rb3_pack_t *rb3_pack_read(const char *fn)
+{
+	FILE *fp;
+	rb3_pack_t *pk;
+	char magic[4];
+	int32_t i;
+	int64_t reserved[6];
+	struct stat st;
+
+	if ((fp = fopen(fn, "rb")) == 0) return 0;
+	if (fread(magic, 1, 4, fp) != 4 || strncmp(magic, RB3_PACK_MAGIC, 4) != 0 || fstat(fileno(fp), &st) != 0) {
+		fclose(fp);
+		return 0;
+	}
+	pk = RB3_CALLOC(rb3_pack_t, 1);
+	fread(&pk->n_sec, 4, 1, fp);
+	fread(pk->acc, 8, RB3_ASIZE + 1, fp);
+	fread(&pk->n_runs, 8, 1, fp);
+	fread(&pk->n_seq, 8, 1, fp);
+	fread(reserved, 8, 6, fp);
+	if (pk->n_sec < 0 || pk->n_sec > 255) goto fail_pack;
+	pk->sec = RB3_CALLOC(rb3_pack_sec_t, pk->n_sec);
+	for (i = 0; i < pk->n_sec; ++i) {
+		rb3_pack_sec_t *s = &pk->sec[i];
+		fread(s->tag, 1, 4, fp);
+		fread(&s->flags, 4, 1, fp);
+		fread(&s->off, 8, 1, fp);
+		fread(&s->size, 8, 1, fp);
+		if (fread(&s->crc, 8, 1, fp) != 1) goto fail_pack;
+		if (s->off % RB3_PACK_ALIGN != 0 || s->size < 0 || s->off + s->size > st.st_size) goto fail_pack;
+	}
+	fclose(fp);
+	return pk;
+
+fail_pack:
+	if (rb3_verbose >= 1)
+		fprintf(stderr, "ERROR: corrupted index container \"%s\"\n", fn);
+	fclose(fp);
+	rb3_pack_destroy(pk);
+	return 0;
+}
+
+void rb3_pack_destroy(rb3_pack_t *pk)
+{
+	if (pk == 0) return;
+	free(pk->sec); free(pk);
+}
+
+const rb3_pack_sec_t *rb3_pack_get(const rb3_pack_t *pk, const char *tag)
+{
+	int32_t i;
+	for (i = 0; i < pk->n_sec; ++i)
+		if (strncmp(pk->sec[i].tag, tag, 4) == 0)
+			return &pk->sec[i];
+	return 0;
+}
+
+rld_t *rb3_pack_restore_bwt(const char *fn)
+{
+	rb3_pack_t *pk;
+	const rb3_pack_sec_t *sec;
+	rld_t *e = 0;
+	if ((pk = rb3_pack_read(fn)) == 0) return 0;
+	if ((sec = rb3_pack_get(pk, "FMD ")) != 0 && (e = rld_restore_mmap_at(fn, sec->off)) != 0) {
+		if (e->mcnt[0] != pk->acc[RB3_ASIZE]) { // inconsistent with the header
+			rld_destroy(e);
+			e = 0;
+		}
+	}
+	rb3_pack_destroy(pk);
+	return e;
+}
+
+static uint64_t pack_crc(FILE *fp, int64_t off, int64_t size) // CRC32 of a section
+{
+	uint8_t *buf;
+	uLong crc = crc32(0L, Z_NULL, 0);
+	if (fseeko(fp, off, SEEK_SET) != 0) return 0;
+	buf = RB3_MALLOC(uint8_t, 1<<20);
+	while (size > 0) {
+		size_t l = size < 1<<20? size : 1<<20;
+		if (fread(buf, 1, l, fp) != l) break;
+		crc = crc32(crc, buf, l);
+		size -= l;
+	}
+	free(buf);
+	return crc;
+}
+
+int rb3_pack_check(const char *fn)
+{
+	rb3_pack_t *pk;
+	FILE *fp;
+	int32_t i, n_err = 0;
+	if ((pk = rb3_pack_read(fn)) == 0) return -1;
+	if ((fp = fopen(fn, "rb")) == 0) {
+		rb3_pack_destroy(pk);
+		return -1;
+	}
+	for (i = 0; i < pk->n_sec; ++i) {
+		const rb3_pack_sec_t *s = &pk->sec[i];
+		if (pack_crc(fp, s->off, s->size) != s->crc) {
+			if (rb3_verbose >= 1)
+				fprintf(stderr, "ERROR: checksum mismatch in section '%.4s' of \"%s\"\n", s->tag, fn);
+			++n_err;
+		}
+	}
+	fclose(fp);
+	rb3_pack_destroy(pk);
+	return n_err;
+}
+
+static int64_t pack_copy(FILE *out, const char *fn) // append a file, decompressed if gzip'd; returns the number of bytes written
+{
+	gzFile fp;
+	uint8_t *buf;
+	int64_t tot = 0;
+	int l;
+	if ((fp = gzopen(fn, "rb")) == 0) return -1; // gzread() passes through uncompressed files
+	buf = RB3_MALLOC(uint8_t, 1<<20);
+	while ((l = gzread(fp, buf, 1<<20)) > 0) {
+		if (fwrite(buf, 1, l, out) != (size_t)l) {
+			l = -1;
+			break;
+		}
+		tot += l;
+	}
+	free(buf);
+	gzclose(fp);
+	return l < 0? -1 : tot;
+}
+
+int rb3_pack_write(const char *fn_idx, const char *fn_out)
+{
+	rb3_fmi_t f;
+	rb3_sid_t *sid = 0;
+	rb3_pack_sec_t sec[8];
+	int32_t i, n_sec = 0, n_ret;
+	int64_t reserved[6], off, n_runs, n_seq;
+	char *fn;
+	FILE *out;
+
+	rb3_fmi_restore(&f, fn_idx, 1);
+	if (f.e == 0) {
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: \"%s\" is not in the FMD format\n", fn_idx);
+		if (f.r) rb3_fmi_free(&f);
+		return -1;
+	}
+	n_runs = rb3_fmi_get_r(&f);
+	fn = RB3_MALLOC(char, strlen(fn_idx) + 8);
+	strcat(strcpy(fn, fn_idx), ".sid");
+	if (access(fn, R_OK) != 0) strcat(strcpy(fn, fn_idx), ".len.gz");
+	if (access(fn, R_OK) == 0) sid = rb3_sid_read(fn);
+	n_seq = sid? sid->n_seq : rb3_fmi_is_symmetric(&f)? f.acc[1] / 2 : f.acc[1];
+	rb3_sid_destroy(sid);
+
+	if ((out = fopen(fn_out, "w+b")) == 0) {
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to create \"%s\": %s\n", fn_out, strerror(errno));
+		rb3_fmi_free(&f);
+		free(fn);
+		return -1;
+	}
+	off = RB3_PACK_HDR + 32 * 8;
+	for (i = 0; pack_comp[i][0]; ++i) {
+		rb3_pack_sec_t *s = &sec[n_sec];
+		strcat(strcpy(fn, fn_idx), pack_comp[i][1]);
+		if (strcmp(pack_comp[i][0], "SID ") == 0 && access(fn, R_OK) != 0)
+			strcat(strcpy(fn, fn_idx), ".len.gz");
+		if (access(fn, R_OK) != 0) continue;
+		off = (off + RB3_PACK_ALIGN - 1) / RB3_PACK_ALIGN * RB3_PACK_ALIGN;
+		fseeko(out, off, SEEK_SET);
+		memcpy(s->tag, pack_comp[i][0], 4);
+		s->flags = 0, s->off = off;
+		if (strcmp(pack_comp[i][0], "SSA ") == 0) { // convert to the packed format
+			rb3_ssa_t *sa = rb3_ssa_restore(fn);
+			s->size = sa? rb3_ssa_write(sa, out) : -1;
+			rb3_ssa_destroy(sa);
+		} else if (strcmp(pack_comp[i][0], "SRI ") == 0) { // convert to the mappable format
+			rb3_srindex_t *sr = rb3_srindex_restore(fn);
+			s->size = sr? rb3_srindex_write(sr, out) : -1;
+			rb3_srindex_destroy(sr);
+		} else if (strcmp(pack_comp[i][0], "SID ") == 0) { // convert to the binary format
+			rb3_sid_t *sid = rb3_sid_read(fn);
+			s->size = sid? rb3_sid_write(sid, out) : -1;
+			rb3_sid_destroy(sid);
+		} else s->size = pack_copy(out, fn);
+		if (s->size < 0) {
+			if (rb3_verbose >= 1)
+				fprintf(stderr, "ERROR: failed to read \"%s\"\n", fn);
+			break;
+		}
+		off += s->size, ++n_sec;
+		if (rb3_verbose >= 3)
+			fprintf(stderr, "[M::%s::%.3f*%.2f] added section '%.4s' of %ld bytes\n", __func__, rb3_realtime(), rb3_percent_cpu(), s->tag, (long)s->size);
+	}
+	n_ret = pack_comp[i][0] == 0? 0 : -1;
+	fflush(out);
+	for (i = 0; i < n_sec && n_ret == 0; ++i)
+		sec[i].crc = pack_crc(out, sec[i].off, sec[i].size);
+	memset(reserved, 0, sizeof(reserved));
+	fseeko(out, 0, SEEK_SET);
+	fwrite(RB3_PACK_MAGIC, 1, 4, out);
+	fwrite(&n_sec, 4, 1, out);
+	fwrite(f.acc, 8, RB3_ASIZE + 1, out);
+	fwrite(&n_runs, 8, 1, out);
+	fwrite(&n_seq, 8, 1, out);
+	fwrite(reserved, 8, 6, out);
+	for (i = 0; i < n_sec; ++i) {
+		fwrite(sec[i].tag, 1, 4, out);
+		fwrite(&sec[i].flags, 4, 1, out);
+		fwrite(&sec[i].off, 8, 1, out);
+		fwrite(&sec[i].size, 8, 1, out);
+		fwrite(&sec[i].crc, 8, 1, out);
+	}
+	if (fclose(out) != 0) n_ret = -1;
+	if (n_ret != 0) unlink(fn_out);
+	rb3_fmi_free(&f);
+	free(fn);
+	return n_ret;
+}
+
+int main_pack(int argc, char *argv[])
+{
+	int c, check = 0;
+	char *fn_out = 0;
+	ketopt_t o = KETOPT_INIT;
+
+	while ((c = ketopt(&o, argc, argv, 1, "co:", 0)) >= 0) {
+		if (c == 'c') check = 1;
+		else if (c == 'o') fn_out = o.arg;
+	}
+	if (argc == o.ind || (!check && fn_out == 0)) {
+		fprintf(stderr, "Usage: ropebwt3 pack [options] <idx.fmd>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -o FILE    write the FMD and its .ssa, .sri, .mvi, .kmi and .sid/.len.gz to container FILE\n");
+		fprintf(stderr, "  -c         verify the checksums of container <idx.fmd> instead\n");
+		return 1;
+	}
+	if (check) {
+		int n_err = rb3_pack_check(argv[o.ind]);
+		if (n_err < 0) fprintf(stderr, "ERROR: \"%s\" is not an index container\n", argv[o.ind]);
+		else if (n_err == 0 && rb3_verbose >= 3) fprintf(stderr, "[M::%s] all checksums are correct\n", __func__);
+		return n_err != 0;
+	}
+	if (rb3_pack_write(argv[o.ind], fn_out) != 0) {
+		fprintf(stderr, "ERROR: failed to create the index container\n");
+		return 1;
+	}
+	return 0;
+}
@@ -264,7 +264,7 @@ static rld_t *rld_restore_from_bre(FILE *fp)
 #endif
 }
 
-static rld_t *rld_restore_header(const char *fn, FILE **_fp, int *from_bre)
+static rld_t *rld_restore_header(const char *fn, int64_t off, FILE **_fp, int *from_bre)
 {
 	FILE *fp;
 	rld_t *e;
@@ -275,12 +275,16 @@ static rld_t *rld_restore_header(const char *fn, FILE **_fp, int *from_bre)
 	*from_bre = 0;
 	if (strcmp(fn, "-") == 0) *_fp = fp = stdin;
 	else if ((*_fp = fp = fopen(fn, "rb")) == 0) return 0;
-	fread(magic, 1, 4, fp);
+	if ((off > 0 && fseeko(fp, off, SEEK_SET) != 0) || fread(magic, 1, 4, fp) != 4) magic[0] = 0;
 	if (strncmp(magic, "BRE\1", 4) == 0) {
 		*from_bre = 1;
 		return rld_restore_from_bre(fp);
 	}
-	if (strncmp(magic, "RLD\3", 4)) return 0;
+	if (strncmp(magic, "RLD\3", 4)) {
+		if (fp != stdin) fclose(fp);
+		*_fp = 0;
+		return 0;
+	}
 	fread(&x, 4, 1, fp);
 	e = rld_init(x>>16, x&0xffff);
 	fread(a, 8, 3, fp);
@@ -299,7 +303,7 @@ rld_t *rld_restore(const char *fn)
 	uint64_t k, n_blks;
 	int32_t i, from_bre;
 
-	e = rld_restore_header(fn, &fp, &from_bre);
+	e = rld_restore_header(fn, 0, &fp, &from_bre);
 	if (from_bre && e) return e;
 	if (e == 0) return 0;
 	if (e->n_bytes / 8 > RLD_LSIZE) { // allocate enough memory
@@ -319,20 +323,24 @@ rld_t *rld_restore(const char *fn)
 	return e;
 }
 
-rld_t *rld_restore_mmap(const char *fn)
+rld_t *rld_restore_mmap_at(const char *fn, int64_t off)
 {
 	FILE *fp;
 	rld_t *e;
 	int i, from_bre;
 	int64_t n_blks;
 
-	e = rld_restore_header(fn, &fp, &from_bre);
+	e = rld_restore_header(fn, off, &fp, &from_bre);
+	if (e == 0 || from_bre) { // BRE can't be mapped
+		if (fp) fclose(fp);
+		return e;
+	}
 	fclose(fp);
 	free(e->z[0]); free(e->z);
 	e->n = (e->n_bytes / 8 + RLD_LSIZE - 1) / RLD_LSIZE;
 	e->z = RLD_CALLOC(uint64_t*, e->n);
 	e->fd = open(fn, O_RDONLY);
-	e->mem = (uint64_t*)mmap(0, rld_file_size(e), PROT_READ, MAP_PRIVATE, e->fd, 0);
+	e->mem = (uint64_t*)mmap(0, rld_file_size(e), PROT_READ, MAP_PRIVATE, e->fd, off);
 	for (i = 0; i < e->n; ++i) e->z[i] = e->mem + (4 + e->asize) + (size_t)i * RLD_LSIZE;
 	e->frame = e->mem + (4 + e->asize) + e->n_bytes/8;
 	n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
@@ -340,6 +348,11 @@ rld_t *rld_restore_mmap(const char *fn)
 	return e;
 }
 
+rld_t *rld_restore_mmap(const char *fn)
+{
+	return rld_restore_mmap_at(fn, 0);
+}
+
 /******************
  * Computing rank *
  ******************/
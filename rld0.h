@@ -60,6 +60,7 @@ extern "C" {
 	int rld_dump(const rld_t *e, const char *fn);
 	rld_t *rld_restore(const char *fn);
 	rld_t *rld_restore_mmap(const char *fn);
+	rld_t *rld_restore_mmap_at(const char *fn, int64_t off); // off must be a multiple of the page size
 
 	void rld_itr_init(const rld_t *e, rlditr_t *itr, uint64_t k);
 	int rld_enc(rld_t *e, rlditr_t *itr, int64_t l, uint8_t c);
@@ -82,6 +83,31 @@ extern "C" {
 
 #define rld_block_type(x) ((uint64_t)(x)>>62)
 
+#ifdef __GNUC__
+#define rld_prefetch(p) __builtin_prefetch(p)
+#else
+#define rld_prefetch(p)
+#endif
+
+static inline void rld_prefetch_frame(const rld_t *e, uint64_t k) // prefetch the frame bracketing k and the start of the next frame
+{
+	const uint64_t *z = e->frame + (k>>e->ibits) * e->asize1;
+	rld_prefetch(z);
+	rld_prefetch(z + e->asize1);
+}
+
+static inline void rld_prefetch_blk(const rld_t *e, uint64_t k) // prefetch the block likely holding k; call after rld_prefetch_frame()
+{
+	uint64_t f = k>>e->ibits, x, y;
+	const uint64_t *q;
+	x = e->frame[f * e->asize1];
+	y = f + 1 < e->n_frames? e->frame[(f + 1) * e->asize1] : rld_last_blk(e);
+	x += (((y - x) >> e->sbits) * (k & ((1ULL<<e->ibits) - 1)) >> e->ibits) << e->sbits; // interpolate between the two frames
+	q = rld_seek_blk(e, x);
+	rld_prefetch(q);
+	rld_prefetch(q + e->ssize); // the estimate is rarely more than one block short
+}
+
 static inline int64_t rld_dec0(const rld_t *e, rlditr_t *itr, int *c)
 {
 	int w;
@@ -1,3 +1,4 @@
+#include <unistd.h>
 #include "fm-index.h"
 #include "align.h"
 #include "rb3priv.h"
@@ -14,14 +15,16 @@ typedef enum { RB3_SA_MEM_TG, RB3_SA_MEM_ORI, RB3_SA_SW, RB3_SA_HAPDIV } rb3_sea
 #define RB3_MF_WRITE_COV   0x4
 #define RB3_MF_WRITE_ALL   0x8
 #define RB3_MF_BOTH_DIR    0x10
+#define RB3_MF_BGZF        0x20
 
 typedef struct {
 	uint32_t flag;
 	int32_t n_threads, min_gap_len, hapdiv_k, hapdiv_w;
-	int32_t max_pos;
+	int32_t max_pos, n_pipe;
 	rb3_search_algo_t algo;
 	int64_t min_occ, min_len, max_all_out;
-	int64_t batch_size;
+	int64_t batch_size, pos_cache, split_len;
+	double batch_time; // target wall-clock seconds per compute step; 0 for fixed batches of batch_size
 	rb3_swopt_t swo;
 } rb3_mopt_t;
 
@@ -34,6 +37,10 @@ void rb3_mopt_init(rb3_mopt_t *opt)
 	opt->hapdiv_k = 101;
 	opt->hapdiv_w = 50;
 	opt->batch_size = 100000000;
+	opt->batch_time = 2.0;
+	opt->n_pipe = 3;
+	opt->pos_cache = 1000000;
+	opt->split_len = 1000000;
 	opt->algo = RB3_SA_MEM_TG;
 	rb3_swopt_init(&opt->swo);
 }
@@ -54,17 +61,23 @@ typedef struct {
 typedef struct {
 	char *name;
 	uint8_t *seq;
-	int64_t id, n_pos;
+	int64_t id, n_pos, l_out;
 	int32_t len, n_mem, n_gap;
 	uint64_t *gap;
 	m_sai_pos_t *mem;
+	char *out; // formatted output
 } m_seq_t;
 
 typedef struct {
 	const rb3_mopt_t *opt;
 	int64_t id;
+	int64_t cur_batch; // size of the next batch; adapted by the compute step and read by the reader step
 	rb3_fmi_t fmi;
 	rb3_seqio_t *fp;
+	FILE *out;
+	rb3_bgzf_t *bz; // BGZF-compressed output; NULL for plain text
+	m_tbuf_t *buf; // per-thread arenas, only used in the compute step and reset between batches
+	kt_forpool_t *pool; // threads shared with other pipelines; NULL to start -t threads per batch
 } pipeline_t;
 
 typedef struct {
@@ -72,21 +85,82 @@ typedef struct {
 	rb3_hapdiv_t r;
 } m_hapdiv_t;
 
+typedef struct { // a whole query, or a window of MEM start positions on a long query
+	int32_t id, n_mem; // id: query index in the batch
+	int32_t st, en; // st<0 for a whole query
+	m_sai_pos_t *mem;
+} m_job_t;
+
 typedef struct {
 	const pipeline_t *p;
-	int32_t n_seq, n_hapdiv;
+	int32_t n_seq, n_hapdiv, n_job;
+	int64_t tot_len;
+	double t_read, t_comp; // wall-clock time of the reader and the compute steps
 	m_seq_t *seq;
+	m_job_t *job;
 	rb3_swrst_t *rst, *rst_rev;
 	m_hapdiv_t *hapdiv;
-	m_tbuf_t *buf;
 } step_t;
 
+static void mem_find_gaps(const pipeline_t *p, m_tbuf_t *b, m_seq_t *s) // find gaps not covered by MEMs
+{
+	int32_t i, last = 0;
+	b->n_gap = 0;
+	Kgrow(b->km, uint64_t, b->gap, s->n_mem + 1, b->m_gap);
+	for (i = 0; i < s->n_mem; ++i) {
+		int32_t st = s->mem[i].mem.info>>32, en = (int32_t)s->mem[i].mem.info;
+		if (st > last) {
+			if (st - last >= p->opt->min_gap_len)
+				b->gap[b->n_gap++] = (uint64_t)last<<32 | st;
+			last = en;
+		} else last = last > en? last : en;
+	}
+	if (s->len - last >= p->opt->min_gap_len)
+		b->gap[b->n_gap++] = (uint64_t)last<<32 | s->len;
+	s->n_gap = b->n_gap;
+	s->gap = RB3_MALLOC(uint64_t, s->n_gap);
+	memcpy(s->gap, b->gap, s->n_gap * 8);
+}
+
+static void mem_locate(const pipeline_t *p, m_tbuf_t *b, int32_t n_mem, m_sai_pos_t *a) // locate all MEMs of the query together, directly into their outputs
+{
+	int32_t i;
+	int64_t *lo, *hi, *n_pos, max_pos = p->opt->max_pos;
+	rb3_pos_t **pos;
+	if (n_mem == 0) return;
+	lo = Kmalloc(b->km, int64_t, n_mem * 3);
+	hi = lo + n_mem, n_pos = hi + n_mem;
+	pos = Kmalloc(b->km, rb3_pos_t*, n_mem);
+	for (i = 0; i < n_mem; ++i) {
+		m_sai_pos_t *q = &a[i];
+		lo[i] = q->mem.x[0], hi[i] = lo[i] + q->mem.size;
+		q->pos = pos[i] = RB3_MALLOC(rb3_pos_t, q->mem.size < max_pos? q->mem.size : max_pos);
+	}
+	rb3_fmi_locate_batch(b->km, &p->fmi, n_mem, lo, hi, max_pos, n_pos, pos);
+	for (i = 0; i < n_mem; ++i)
+		a[i].n_pos = n_pos[i];
+	kfree(b->km, pos); kfree(b->km, lo);
+}
+
+static void seq_post_mem(const pipeline_t *p, m_tbuf_t *b, m_seq_t *s, const rb3_sai_v *mem)
+{
+	int32_t i;
+	s->n_mem = mem->n;
+	s->mem = RB3_CALLOC(m_sai_pos_t, s->n_mem);
+	for (i = 0; i < s->n_mem; ++i)
+		s->mem[i].mem = mem->a[i];
+	if (p->opt->min_gap_len > 0)
+		mem_find_gaps(p, b, s);
+	else if (p->opt->max_pos > 0)
+		mem_locate(p, b, s->n_mem, s->mem);
+}
+
 static void worker_for_seq(void *data, long i, int tid)
 {
 	step_t *t = (step_t*)data;
 	const pipeline_t *p = t->p;
 	m_seq_t *s = &t->seq[i];
-	m_tbuf_t *b = &t->buf[tid];
+	m_tbuf_t *b = &p->buf[tid];
 	if (rb3_dbg_flag & RB3_DBG_QNAME)
 		fprintf(stderr, "Q\t%s\t%d\n", s->name, tid);
 	rb3_char2nt6(s->len, s->seq);
@@ -98,7 +172,6 @@ static void worker_for_seq(void *data, long i, int tid)
 			rb3_revcomp6(s->len, s->seq);
 		}
 	} else { // MEM algorithms
-		int32_t i;
 		b->mem.n = 0;
 		if (p->opt->algo == RB3_SA_MEM_TG) {
 			if (p->fmi.bm)
@@ -111,42 +184,94 @@ static void worker_for_seq(void *data, long i, int tid)
 			else
 				rb3_fmd_smem(b->km, &p->fmi, s->len, s->seq, &b->mem, p->opt->min_occ, p->opt->min_len);
 		}
-		s->n_mem = b->mem.n;
-		s->mem = RB3_CALLOC(m_sai_pos_t, s->n_mem);
-		for (i = 0; i < s->n_mem; ++i)
-			s->mem[i].mem = b->mem.a[i];
-		if (p->opt->min_gap_len > 0) { // find gaps not covered by MEMs
-			int32_t last = 0;
-			b->n_gap = 0;
-			Kgrow(b->km, uint64_t, b->gap, b->mem.n + 1, b->m_gap);
-			for (i = 0; i < b->mem.n; ++i) {
-				int32_t st = b->mem.a[i].info>>32, en = (int32_t)b->mem.a[i].info;
-				if (st > last) {
-					if (st - last >= p->opt->min_gap_len)
-						b->gap[b->n_gap++] = (uint64_t)last<<32 | st;
-					last = en;
-				} else last = last > en? last : en;
-			}
-			if (s->len - last >= p->opt->min_gap_len)
-				b->gap[b->n_gap++] = (uint64_t)last<<32 | s->len;
-			s->n_gap = b->n_gap;
-			s->gap = RB3_MALLOC(uint64_t, s->n_gap);
-			memcpy(s->gap, b->gap, s->n_gap * 8);
-		} else if (p->opt->max_pos > 0) {
-			rb3_pos_t *pos;
-			pos = Kmalloc(b->km, rb3_pos_t, p->opt->max_pos);
-			for (i = 0; i < s->n_mem; ++i) {
-				m_sai_pos_t *q = &s->mem[i];
-				if (p->fmi.srindex)
-					q->n_pos = rb3_srindex_multi(b->km, &p->fmi, p->fmi.srindex, q->mem.x[0], q->mem.x[0] + q->mem.size, p->opt->max_pos, pos);
-				else
-					q->n_pos = rb3_ssa_multi(b->km, &p->fmi, p->fmi.ssa, q->mem.x[0], q->mem.x[0] + q->mem.size, p->opt->max_pos, pos);
-				q->pos = RB3_MALLOC(rb3_pos_t, q->n_pos);
-				memcpy(q->pos, pos, sizeof(rb3_pos_t) * q->n_pos);
+		seq_post_mem(p, b, s, &b->mem);
+	}
+}
+
+/*
+ * Long queries are split into windows of MEM start positions that are
+ * processed in parallel. The TG algorithm finds the same MEMs from any
+ * starting position except that the first MEM may not be left-maximal, which
+ * rb3_fmd_smem_TG_range() takes care of. Concatenating the MEMs of all
+ * windows thus gives the same output as processing the whole query.
+ */
+static int32_t split_jobs(step_t *t)
+{
+	const rb3_mopt_t *opt = t->p->opt;
+	int32_t i, n_split = 0, m_job = 0;
+	for (i = 0; i < t->n_seq; ++i)
+		if (t->seq[i].len > opt->split_len) ++n_split;
+	if (n_split == 0) return 0;
+	for (i = 0, t->n_job = 0; i < t->n_seq; ++i) {
+		m_seq_t *s = &t->seq[i];
+		m_job_t *j;
+		if (s->len > opt->split_len) {
+			int32_t st;
+			rb3_char2nt6(s->len, s->seq); // windows read beyond their ends, so convert upfront
+			for (st = 0; st < s->len; st += opt->split_len) {
+				RB3_GROW0(m_job_t, t->job, t->n_job, m_job);
+				j = &t->job[t->n_job++];
+				j->id = i, j->st = st;
+				j->en = s->len - st > opt->split_len? st + opt->split_len : s->len;
 			}
-			kfree(b->km, pos);
+		} else {
+			RB3_GROW0(m_job_t, t->job, t->n_job, m_job);
+			j = &t->job[t->n_job++];
+			j->id = i, j->st = j->en = -1;
+		}
+	}
+	return n_split;
+}
+
+static void worker_for_job(void *data, long k, int tid)
+{
+	step_t *t = (step_t*)data;
+	const pipeline_t *p = t->p;
+	m_job_t *j = &t->job[k];
+	m_seq_t *s = &t->seq[j->id];
+	m_tbuf_t *b = &p->buf[tid];
+	int32_t i;
+	if (j->st < 0) {
+		worker_for_seq(data, j->id, tid);
+		return;
+	}
+	if ((rb3_dbg_flag & RB3_DBG_QNAME) && j->st == 0)
+		fprintf(stderr, "Q\t%s\t%d\n", s->name, tid);
+	b->mem.n = 0;
+	if (p->fmi.bm)
+		rb3_bmove_smem_TG_range(b->km, (const rb3_bmove_t *)p->fmi.bm, s->len, s->seq, j->st, j->en, &b->mem, p->opt->min_occ, p->opt->min_len);
+	else
+		rb3_fmd_smem_TG_range(b->km, &p->fmi, s->len, s->seq, j->st, j->en, &b->mem, p->opt->min_occ, p->opt->min_len);
+	j->n_mem = b->mem.n;
+	j->mem = RB3_CALLOC(m_sai_pos_t, j->n_mem);
+	for (i = 0; i < j->n_mem; ++i)
+		j->mem[i].mem = b->mem.a[i];
+	if (p->opt->min_gap_len == 0 && p->opt->max_pos > 0)
+		mem_locate(p, b, j->n_mem, j->mem);
+}
+
+static void merge_jobs(step_t *t) // concatenate the MEMs of the windows of each split query
+{
+	const pipeline_t *p = t->p;
+	int32_t i, k, l;
+	for (i = 0; i < t->n_job; i = k) {
+		m_seq_t *s = &t->seq[t->job[i].id];
+		int32_t n = 0;
+		for (k = i; k < t->n_job && t->job[k].id == t->job[i].id; ++k)
+			n += t->job[k].n_mem;
+		if (t->job[i].st < 0) continue;
+		s->n_mem = n;
+		s->mem = RB3_CALLOC(m_sai_pos_t, n);
+		for (l = i, n = 0; l < k; ++l) {
+			memcpy(&s->mem[n], t->job[l].mem, t->job[l].n_mem * sizeof(m_sai_pos_t));
+			n += t->job[l].n_mem;
+			free(t->job[l].mem);
 		}
+		if (p->opt->min_gap_len > 0)
+			mem_find_gaps(p, &p->buf[0], s);
 	}
+	free(t->job);
+	t->job = 0, t->n_job = 0;
 }
 
 static void worker_for_hapdiv(void *data, long i, int tid)
@@ -154,7 +279,7 @@ static void worker_for_hapdiv(void *data, long i, int tid)
 	step_t *t = (step_t*)data;
 	const pipeline_t *p = t->p;
 	m_hapdiv_t *a = &t->hapdiv[i];
-	rb3_hapdiv(t->buf[tid].km, &p->opt->swo, &p->fmi, p->opt->hapdiv_k, &t->seq[a->id].seq[a->offset], &a->r);
+	rb3_hapdiv(p->buf[tid].km, &p->opt->swo, &p->fmi, p->opt->hapdiv_k, &t->seq[a->id].seq[a->offset], &a->r);
 }
 
 static inline void write_name(kstring_t *out, const m_seq_t *s)
@@ -182,7 +307,7 @@ static void write_paf(kstring_t *out, const rb3_fmi_t *f, const rb3_swhit_t *h,
 		if (f->sid) { // print with sequence names and lengths
 			int64_t clen, st, en;
 			pos_stranded(f->sid, &h->pos[0], h->rlen, &clen, &st, &en);
-			rb3_sprintf_lite(out, "\t%c\t%s\t%ld\t%ld\t%ld", "+-"[sid&1], f->sid->name[sid>>1], (long)clen, st, en);
+			rb3_sprintf_lite(out, "\t%c\t%s\t%ld\t%ld\t%ld", "+-"[sid&1], rb3_sid_name(f->sid, sid>>1), (long)clen, st, en);
 		} else {
 			rb3_sprintf_lite(out, "\t+\t%ld\t*\t%ld\t%ld", sid, pos, pos + h->rlen); // always on the forward strand
 		}
@@ -206,7 +331,7 @@ static void write_paf(kstring_t *out, const rb3_fmi_t *f, const rb3_swhit_t *h,
 			if (f->sid) {
 				int64_t clen, st, en;
 				pos_stranded(f->sid, &h->pos[k], h->rlen, &clen, &st, &en);
-				rb3_sprintf_lite(out, "%s,%c,%ld;", f->sid->name[sid>>1], "+-"[sid&1], st);
+				rb3_sprintf_lite(out, "%s,%c,%ld;", rb3_sid_name(f->sid, sid>>1), "+-"[sid&1], st);
 			} else {
 				rb3_sprintf_lite(out, "%ld,%ld;", sid, pos);
 			}
@@ -237,89 +362,97 @@ static void write_all_hits(kstring_t *out, const m_seq_t *s, const rb3_swrst_t *
 	rb3_sprintf_lite(out, "//\n");
 }
 
-static void write_per_seq(step_t *t)
+static void format_per_seq(const step_t *t, int32_t j, kstring_t *out) // format the output of a sequence and free its results
 {
 	const pipeline_t *p = t->p;
-	int32_t i, j;
-	kstring_t out = {0,0,0};
-	for (j = 0; j < t->n_seq; ++j) {
-		m_seq_t *s = &t->seq[j];
-		free(s->seq);
-		out.l = 0;
-		if (p->opt->algo == RB3_SA_SW && (p->opt->flag & RB3_MF_WRITE_ALL)) { // write all hits in a compact format
-			write_all_hits(&out, s, &t->rst[j], '+', p->opt->max_all_out);
-			rb3_swrst_free(&t->rst[j]);
-			if (t->rst_rev) {
-				write_all_hits(&out, s, &t->rst_rev[j], '-', p->opt->max_all_out);
-				rb3_swrst_free(&t->rst_rev[j]);
-			}
-			fputs(out.s, stdout);
-		} else if (p->opt->algo == RB3_SA_SW) { // write PAF
-			rb3_swrst_t *r = &t->rst[j];
-			if (r->n > 0) { // mapped
-				for (i = 0; i < r->n; ++i) {
-					out.l = 0;
-					write_paf(&out, &p->fmi, &r->a[i], s);
-					fputs(out.s, stdout);
-				}
-			} else if (p->opt->flag & RB3_MF_WRITE_UNMAP) { // unmapped
-				write_name(&out, s);
-				rb3_sprintf_lite(&out, "\t%d\t*\t*\t*\t*\t*\t*\t*\t0\t0\t0\n", s->len);
-				fputs(out.s, stdout);
-			}
-			rb3_swrst_free(r);
-		} else if (p->opt->min_gap_len > 0) { // output regions not covered by long MEMs
-			for (i = 0; i < s->n_gap; ++i) {
-				int32_t st = s->gap[i]>>32, en = (int32_t)s->gap[i];
-				out.l = 0;
-				write_name(&out, s);
-				rb3_sprintf_lite(&out, "\t%d\t%d\t%d\n", st, en, s->len);
-				fputs(out.s, stdout);
-			}
-		} else if (p->opt->flag & RB3_MF_WRITE_COV) { // output breadth of coverage
-			int32_t st0 = 0, en0 = 0, cov = 0;
-			for (i = 0; i < s->n_mem; ++i) {
-				rb3_sai_t *q = &s->mem[i].mem;
-				int32_t st = q->info>>32, en = (int32_t)q->info;
-				if (st > en0) {
-					cov += en0 - st0;
-					st0 = st, en0 = en;
-				} else en0 = en0 > en? en0 : en;
-			}
-			cov += en0 - st0;
-			if (cov > 0) {
-				out.l = 0;
-				write_name(&out, s);
-				rb3_sprintf_lite(&out, "\t%d\t%d\n", s->len, cov);
-				fputs(out.s, stdout);
-			}
-		} else { // output long MEMs
-			const rb3_fmi_t *f = &p->fmi;
-			for (i = 0; i < s->n_mem; ++i) {
-				m_sai_pos_t *r = &s->mem[i];
-				rb3_sai_t *q = &r->mem;
-				int32_t st = q->info>>32, en = (int32_t)q->info;
-				out.l = 0;
-				write_name(&out, s);
-				rb3_sprintf_lite(&out, "\t%d\t%d\t%ld", st, en, (long)q->size);
-				if (r->n_pos > 0) {
-					int32_t j;
-					rb3_sprintf_lite(&out, "\t%ld", r->n_pos);
-					for (j = 0; j < r->n_pos; ++j) {
-						rb3_pos_t *t = &r->pos[j];
-						int64_t rlen = f->sid->len[t->sid>>1], pos;
-						pos = t->sid&1? rlen - (t->pos + (en - st)) : t->pos;
-						rb3_sprintf_lite(&out, "\t%s:%c:%ld", f->sid->name[t->sid>>1], "+-"[t->sid&1], pos);
-					}
-					free(r->pos);
+	m_seq_t *s = &t->seq[j];
+	int32_t i;
+	free(s->seq);
+	if (p->opt->algo == RB3_SA_SW && (p->opt->flag & RB3_MF_WRITE_ALL)) { // write all hits in a compact format
+		write_all_hits(out, s, &t->rst[j], '+', p->opt->max_all_out);
+		rb3_swrst_free(&t->rst[j]);
+		if (t->rst_rev) {
+			write_all_hits(out, s, &t->rst_rev[j], '-', p->opt->max_all_out);
+			rb3_swrst_free(&t->rst_rev[j]);
+		}
+	} else if (p->opt->algo == RB3_SA_SW) { // write PAF
+		rb3_swrst_t *r = &t->rst[j];
+		if (r->n > 0) { // mapped
+			for (i = 0; i < r->n; ++i)
+				write_paf(out, &p->fmi, &r->a[i], s);
+		} else if (p->opt->flag & RB3_MF_WRITE_UNMAP) { // unmapped
+			write_name(out, s);
+			rb3_sprintf_lite(out, "\t%d\t*\t*\t*\t*\t*\t*\t*\t0\t0\t0\n", s->len);
+		}
+		rb3_swrst_free(r);
+	} else if (p->opt->min_gap_len > 0) { // output regions not covered by long MEMs
+		for (i = 0; i < s->n_gap; ++i) {
+			int32_t st = s->gap[i]>>32, en = (int32_t)s->gap[i];
+			write_name(out, s);
+			rb3_sprintf_lite(out, "\t%d\t%d\t%d\n", st, en, s->len);
+		}
+	} else if (p->opt->flag & RB3_MF_WRITE_COV) { // output breadth of coverage
+		int32_t st0 = 0, en0 = 0, cov = 0;
+		for (i = 0; i < s->n_mem; ++i) {
+			rb3_sai_t *q = &s->mem[i].mem;
+			int32_t st = q->info>>32, en = (int32_t)q->info;
+			if (st > en0) {
+				cov += en0 - st0;
+				st0 = st, en0 = en;
+			} else en0 = en0 > en? en0 : en;
+		}
+		cov += en0 - st0;
+		if (cov > 0) {
+			write_name(out, s);
+			rb3_sprintf_lite(out, "\t%d\t%d\n", s->len, cov);
+		}
+	} else { // output long MEMs
+		const rb3_fmi_t *f = &p->fmi;
+		for (i = 0; i < s->n_mem; ++i) {
+			m_sai_pos_t *r = &s->mem[i];
+			rb3_sai_t *q = &r->mem;
+			int32_t st = q->info>>32, en = (int32_t)q->info;
+			write_name(out, s);
+			rb3_sprintf_lite(out, "\t%d\t%d\t%ld", st, en, (long)q->size);
+			if (r->n_pos > 0) {
+				int32_t j;
+				rb3_sprintf_lite(out, "\t%ld", r->n_pos);
+				for (j = 0; j < r->n_pos; ++j) {
+					rb3_pos_t *t = &r->pos[j];
+					int64_t rlen = f->sid->len[t->sid>>1], pos;
+					pos = t->sid&1? rlen - (t->pos + (en - st)) : t->pos;
+					rb3_sprintf_lite(out, "\t%s:%c:%ld", rb3_sid_name(f->sid, t->sid>>1), "+-"[t->sid&1], pos);
 				}
-				rb3_sprintf_lite(&out, "\n");
-				fputs(out.s, stdout);
+				free(r->pos);
 			}
+			rb3_sprintf_lite(out, "\n");
 		}
-		free(s->name); free(s->mem); free(s->gap);
 	}
-	free(out.s);
+	free(s->name); free(s->mem); free(s->gap);
+}
+
+static void worker_for_format(void *data, long i, int tid) // format each sequence into its own buffer, to be written in order
+{
+	step_t *t = (step_t*)data;
+	kstring_t out = {0,0,0};
+	format_per_seq(t, i, &out);
+	t->seq[i].out = out.s, t->seq[i].l_out = out.l;
+}
+
+static void write_out(const pipeline_t *p, const char *s, int64_t l)
+{
+	if (l == 0) return;
+	if (p->bz) rb3_bgzf_write(p->bz, s, l);
+	else fwrite(s, 1, l, p->out);
+}
+
+static void write_per_seq(step_t *t)
+{
+	int32_t j;
+	for (j = 0; j < t->n_seq; ++j) {
+		write_out(t->p, t->seq[j].out, t->seq[j].l_out);
+		free(t->seq[j].out);
+	}
 	free(t->rst);
 	free(t->rst_rev);
 }
@@ -337,21 +470,41 @@ static void write_hapdiv(step_t *t)
 		const m_hapdiv_t *q = t->hapdiv + j;
 		if (j == t->n_hapdiv || p->id != q->id || memcmp(&p->r, &q->r, sizeof(p->r)) != 0) {
 			m_seq_t *s = &t->seq[p->id];
-			out.l = 0;
 			write_name(&out, s);
 			rb3_sprintf_lite(&out, "\t%d\t%d\t%d\t%d", p->offset, t->hapdiv[j-1].offset + t->p->opt->hapdiv_k, p->r.n_al, p->r.max_ed);
 			for (ed = 0; ed <= RB2_SW_MAX_ED; ++ed)
 				rb3_sprintf_lite(&out, "\t%d", p->r.n_hap[ed]);
-			puts(out.s);
+			rb3_sprintf_lite(&out, "\n");
 			p = q;
 		}
 	}
+	write_out(t->p, out.s, out.l);
 	for (j = 0; j < t->n_seq; ++j)
 		free(t->seq[j].name);
 	free(out.s);
 	free(t->hapdiv);
 }
 
+static void tbuf_reset(m_tbuf_t *b) // release everything allocated in a batch, keeping the arena for the next batch
+{
+	if (b->km) {
+		km_reset(b->km);
+	} else {
+		free(b->mem.a); free(b->gap);
+	}
+	memset(&b->mem, 0, sizeof(rb3_sai_v));
+	b->gap = 0, b->n_gap = b->m_gap = 0;
+}
+
+static void adapt_batch(pipeline_t *p, const step_t *t) // size the next batch such that its compute step takes about opt->batch_time
+{
+	int64_t b, min_b = p->opt->batch_size / 64 > 0? p->opt->batch_size / 64 : 1;
+	if (p->opt->batch_time <= 0.0 || t->t_comp <= 0.0) return;
+	b = (int64_t)(t->tot_len * p->opt->batch_time / t->t_comp);
+	b = b < min_b? min_b : b < p->opt->batch_size? b : p->opt->batch_size;
+	__sync_lock_test_and_set(&p->cur_batch, b);
+}
+
 static void *worker_pipeline(void *shared, int step, void *in)
 {
 	pipeline_t *p = (pipeline_t*)shared;
@@ -360,8 +513,9 @@ static void *worker_pipeline(void *shared, int step, void *in)
 	if (step == 0) {
 		const char *name;
 		char *ss;
-		int64_t len, tot = 0;
+		int64_t len, tot = 0, batch_size = __sync_fetch_and_add(&p->cur_batch, 0);
 		int32_t n_seq = 0, m_seq = 0;
+		double t0 = rb3_realtime();
 		m_seq_t *seq = 0;
 		while ((ss = rb3_seq_read1(p->fp, &len, &name)) != 0) { // read sequences
 			m_seq_t *s;
@@ -373,12 +527,13 @@ static void *worker_pipeline(void *shared, int step, void *in)
 			s->id = p->id++;
 			s->mem = 0, s->n_mem = 0;
 			tot += len;
-			if (tot >= p->opt->batch_size)
+			if (tot >= batch_size)
 				break;
 		}
 		if (n_seq > 0) { // construct a step_t object
 			t = RB3_CALLOC(step_t, 1);
 			t->p = p;
+			t->tot_len = tot;
 			t->seq = seq;
 			t->n_seq = n_seq;
 			if (p->opt->algo == RB3_SA_HAPDIV) { // the hapdiv mode
@@ -396,30 +551,35 @@ static void *worker_pipeline(void *shared, int step, void *in)
 				if (p->opt->flag & RB3_MF_BOTH_DIR)
 					t->rst_rev = RB3_CALLOC(rb3_swrst_t, n_seq);
 			}
-			t->buf = RB3_CALLOC(m_tbuf_t, p->opt->n_threads);
-			for (i = 0; i < p->opt->n_threads; ++i)
-				t->buf[i].km = p->opt->flag & RB3_MF_NO_KALLOC? 0 : km_init();
+			t->t_read = rb3_realtime() - t0;
 			return t;
 		}
 	} else if (step == 1) {
-		if (p->opt->algo == RB3_SA_HAPDIV)
-			kt_for(p->opt->n_threads, worker_for_hapdiv, in, t->n_hapdiv);
-		else
-			kt_for(p->opt->n_threads, worker_for_seq, in, t->n_seq);
+		double t0 = rb3_realtime();
+		if (p->opt->algo == RB3_SA_HAPDIV) {
+			kt_forpool(p->pool, p->opt->n_threads, worker_for_hapdiv, in, t->n_hapdiv);
+		} else if (p->opt->algo == RB3_SA_MEM_TG && p->opt->split_len > 0 && split_jobs(t) > 0) {
+			kt_forpool(p->pool, p->opt->n_threads, worker_for_job, in, t->n_job);
+			merge_jobs(t);
+		} else {
+			kt_forpool(p->pool, p->opt->n_threads, worker_for_seq, in, t->n_seq);
+		}
+		if (p->opt->algo != RB3_SA_HAPDIV)
+			kt_forpool(p->pool, p->opt->n_threads, worker_for_format, in, t->n_seq);
+		for (i = 0; i < p->opt->n_threads; ++i)
+			tbuf_reset(&p->buf[i]);
+		t->t_comp = rb3_realtime() - t0;
+		adapt_batch(p, t);
 		return in;
 	} else if (step == 2) {
-		for (i = 0; i < p->opt->n_threads; ++i) {
-			kfree(t->buf[i].km, t->buf[i].mem.a);
-			km_destroy(t->buf[i].km);
-		}
-		free(t->buf);
 		if (p->opt->algo == RB3_SA_HAPDIV)
 			write_hapdiv(t);
 		else
 			write_per_seq(t);
 		free(t->seq);
 		if (rb3_verbose >= 3)
-			fprintf(stderr, "[M::%s::%.3f*%.2f] processed %d sequences\n", __func__, rb3_realtime(), rb3_percent_cpu(), t->n_seq);
+			fprintf(stderr, "[M::%s::%.3f*%.2f] processed %d sequences (%ld bases; read in %.3f sec; computed in %.3f sec)\n", __func__,
+					rb3_realtime(), rb3_percent_cpu(), t->n_seq, (long)t->tot_len, t->t_read, t->t_comp);
 		free(t);
 	}
 	return 0;
@@ -432,6 +592,11 @@ static ko_longopt_t long_options[] = {
 	{ "cov",             ko_no_argument,       304 },
 	{ "old-mem",         ko_no_argument,       305 },
 	{ "all-e2e",         ko_no_argument,       306 },
+	{ "pos-cache",       ko_required_argument, 308 },
+	{ "split",           ko_required_argument, 309 },
+	{ "bgzf",            ko_no_argument,       310 },
+	{ "pipeline",        ko_required_argument, 311 },
+	{ "batch-time",      ko_required_argument, 312 },
 	{ "no-kalloc",       ko_no_argument,       501 },
 	{ "dbg-dawg",        ko_no_argument,       502 },
 	{ "dbg-sw",          ko_no_argument,       503 },
@@ -440,20 +605,19 @@ static ko_longopt_t long_options[] = {
 	{ 0, 0, 0 }
 };
 
-int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
+static int mopt_parse(int argc, char *argv[], ketopt_t *o0, rb3_mopt_t *opt0, int32_t *is_line, int32_t *load_flag, int32_t *dbg) // return -1 on an unknown option
 {
-	int32_t c, j, is_line = 0, ret, load_flag = 0, no_ssa = 0;
+	int32_t c, no_ssa = 0;
 	rb3_mopt_t opt;
-	pipeline_t p;
 	ketopt_t o = KETOPT_INIT;
 
 	rb3_mopt_init(&opt);
-	p.opt = &opt, p.id = 0;
+	*is_line = 0, *load_flag = 0, *dbg = 0;
 	while ((c = ketopt(&o, argc, argv, 1, "Ll:c:t:K:MdN:A:B:O:E:C:m:k:uj:ey:a:w:p:bg:", long_options)) >= 0) {
-		if (c == 'L') is_line = 1;
+		if (c == 'L') *is_line = 1;
 		else if (c == 'a') opt.algo = RB3_SA_HAPDIV, opt.hapdiv_k = atoi(o.arg);
 		else if (c == 'w') opt.algo = RB3_SA_HAPDIV, opt.hapdiv_w = atoi(o.arg);
-		else if (c == 'd') opt.algo = RB3_SA_SW, load_flag |= RB3_LOAD_ALL;
+		else if (c == 'd') opt.algo = RB3_SA_SW, *load_flag |= RB3_LOAD_ALL;
 		else if (c == 'l') opt.min_len = atol(o.arg);
 		else if (c == 'c') opt.min_occ = atol(o.arg);
 		else if (c == 'g') opt.max_all_out = atol(o.arg), opt.flag |= RB3_MF_WRITE_ALL, opt.swo.flag |= RB3_SWF_E2E, opt.swo.end_len = 1, no_ssa = 1;
@@ -461,7 +625,7 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 		else if (c == 'K') opt.batch_size = rb3_parse_num(o.arg);
 		else if (c == 'p') opt.max_pos = opt.swo.max_pos = atoi(o.arg);
 		else if (c == 'N') opt.swo.n_best = atoi(o.arg);
-		else if (c == 'M') load_flag |= RB3_LOAD_MMAP;
+		else if (c == 'M') *load_flag |= RB3_LOAD_MMAP;
 		else if (c == 'A') opt.swo.match = atoi(o.arg);
 		else if (c == 'B') opt.swo.mis = atoi(o.arg);
 		else if (c == 'O') opt.swo.gap_open = atoi(o.arg);
@@ -480,30 +644,138 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 		else if (c == 304) opt.flag |= RB3_MF_WRITE_COV;
 		else if (c == 305) opt.algo = RB3_SA_MEM_ORI;
 		else if (c == 306) opt.flag |= RB3_MF_WRITE_ALL, opt.swo.flag |= RB3_SWF_E2E, opt.swo.end_len = 1, no_ssa = 1;
+		else if (c == 308) opt.pos_cache = rb3_parse_num(o.arg);
+		else if (c == 309) opt.split_len = rb3_parse_num(o.arg);
+		else if (c == 310) opt.flag |= RB3_MF_BGZF;
+		else if (c == 311) opt.n_pipe = atoi(o.arg);
+		else if (c == 312) opt.batch_time = atof(o.arg);
 		else if (c == 501) opt.flag |= RB3_MF_NO_KALLOC;
-		else if (c == 502) rb3_dbg_flag |= RB3_DBG_DAWG;
-		else if (c == 503) rb3_dbg_flag |= RB3_DBG_SW;
-		else if (c == 504) rb3_dbg_flag |= RB3_DBG_QNAME;
-		else if (c == 505) rb3_dbg_flag |= RB3_DBG_BT;
-		else {
-			fprintf(stderr, "ERROR: unknown option\n");
-			return 1;
-		}
+		else if (c == 502) *dbg |= RB3_DBG_DAWG;
+		else if (c == 503) *dbg |= RB3_DBG_SW;
+		else if (c == 504) *dbg |= RB3_DBG_QNAME;
+		else if (c == 505) *dbg |= RB3_DBG_BT;
+		else return -1;
 	}
 
 	if (opt.min_gap_len > 0) opt.max_pos = 0;
 	if (strcmp(argv[0], "sw") == 0) {
 		opt.algo = RB3_SA_SW;
-		if (!no_ssa) load_flag |= RB3_LOAD_ALL;
+		if (!no_ssa) *load_flag |= RB3_LOAD_ALL;
 	} else if (strcmp(argv[0], "hapdiv") == 0) {
 		opt.algo = RB3_SA_HAPDIV, opt.swo.end_len = 1;
 	} else if (strcmp(argv[0], "mem") == 0) {
 		if (opt.max_pos > 0)
-			load_flag |= RB3_LOAD_ALL;
+			*load_flag |= RB3_LOAD_ALL;
 	}
 	if (opt.algo == RB3_SA_HAPDIV)
 		opt.swo.flag |= RB3_SWF_E2E | RB3_SWF_HAPDIV;
+	*o0 = o, *opt0 = opt;
+	return 0;
+}
+
+static const char *search_check(const rb3_mopt_t *opt, const rb3_fmi_t *f) // return an error message if the index lacks a required component
+{
+	if (opt->max_pos > 0 && f->ssa == 0 && f->srindex == 0)
+		return "failed to load suffix array samples or SR-index";
+	if (opt->max_pos > 0 && f->sid == 0)
+		return "failed to load sequence names/lengths";
+	if (!rb3_fmi_is_symmetric(f))
+		return "BWT doesn't contain both strands";
+	return 0;
+}
+
+static void search_init(pipeline_t *p, const rb3_mopt_t *opt, kt_forpool_t *pool, FILE *out)
+{
+	int32_t i;
+	p->opt = opt, p->id = 0, p->fp = 0, p->out = out, p->bz = 0, p->pool = pool;
+	p->buf = RB3_CALLOC(m_tbuf_t, opt->n_threads);
+	for (i = 0; i < opt->n_threads; ++i)
+		p->buf[i].km = opt->flag & RB3_MF_NO_KALLOC? 0 : km_init();
+	p->cur_batch = opt->batch_time > 0.0 && opt->batch_size / 16 > 0? opt->batch_size / 16 : opt->batch_size; // start small to fill the pipeline early
+	if (opt->flag & RB3_MF_BGZF)
+		p->bz = rb3_bgzf_open(out, pool, opt->n_threads, -1);
+	if (opt->flag & RB3_MF_WRITE_ALL) {
+		const char *hdr = "CC\tQS  queryName  queryLen  numHap\n"
+			"CC\tQH  refCount   score     editDist   cs   strand   nOut   totAln\n"
+			"CC\n";
+		write_out(p, hdr, strlen(hdr));
+	}
+}
+
+static int search_end(pipeline_t *p) // flush the output and free per-run buffers; return -1 on write errors
+{
+	const rb3_mopt_t *opt = p->opt;
+	int32_t j, ret = 0;
+	if (p->bz && rb3_bgzf_close(p->bz) < 0) {
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to write the BGZF output\n");
+		ret = -1;
+	}
+	if (rb3_verbose >= 3 && !(opt->flag & RB3_MF_NO_KALLOC)) {
+		size_t peak = 0, cap = 0;
+		for (j = 0; j < opt->n_threads; ++j) {
+			km_stat_t st;
+			km_stat(p->buf[j].km, &st);
+			peak = peak > st.peak? peak : st.peak;
+			cap = cap > st.capacity? cap : st.capacity;
+		}
+		fprintf(stderr, "[M::%s] per-thread arenas: peak %.2f MB in use, %.2f MB reserved (max over %d threads)\n", __func__,
+				peak / 1048576.0, cap / 1048576.0, opt->n_threads);
+	}
+	for (j = 0; j < opt->n_threads; ++j)
+		km_destroy(p->buf[j].km);
+	free(p->buf);
+	return ret;
+}
+
+int rb3_search_fd(const rb3_fmi_t *f, kt_forpool_t *pool, int max_threads, int argc, char *argv[], int fd, FILE *out)
+{
+	int32_t is_line, load_flag, dbg, ret;
+	const char *err;
+	rb3_mopt_t opt;
+	pipeline_t p;
+	ketopt_t o;
+
+	if (mopt_parse(argc, argv, &o, &opt, &is_line, &load_flag, &dbg) < 0) {
+		fprintf(out, "ERROR: unknown option\n");
+		return -1;
+	}
+	if (dbg) { // rb3_dbg_flag is global and would affect all later requests
+		fprintf(out, "ERROR: --dbg-* options are not accepted by the server\n");
+		return -1;
+	}
+	p.fmi = *f; // a shallow copy; only keep the components the CLI would load
+	if (!(load_flag & RB3_LOAD_SSA)) p.fmi.ssa = 0, p.fmi.srindex = 0, p.fmi.sid = 0, p.fmi.pc = 0; // the cache would still give positions
+	if (!(load_flag & RB3_LOAD_SID)) p.fmi.sid = 0;
+	if (opt.max_pos == 0 || opt.pos_cache == 0) p.fmi.pc = 0;
+	if ((err = search_check(&opt, &p.fmi)) != 0) {
+		fprintf(out, "ERROR: %s\n", err);
+		return -1;
+	}
+	if (opt.n_threads > max_threads) opt.n_threads = max_threads;
+	search_init(&p, &opt, pool, out);
+	p.fp = rb3_seq_open_fd(dup(fd), is_line); // fd itself is left open for the caller
+	if (p.fp) {
+		kt_pipeline(opt.n_pipe, worker_pipeline, &p, 3);
+		rb3_seq_close(p.fp);
+	}
+	ret = search_end(&p);
+	return p.fp == 0? -1 : ret;
+}
 
+int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
+{
+	int32_t j, is_line, ret, load_flag, dbg;
+	const char *err;
+	rb3_mopt_t opt;
+	pipeline_t p;
+	ketopt_t o;
+
+	if (mopt_parse(argc, argv, &o, &opt, &is_line, &load_flag, &dbg) < 0) {
+		fprintf(stderr, "ERROR: unknown option\n");
+		return 1;
+	}
+	rb3_dbg_flag |= dbg;
 	if (argc - o.ind < 2) {
 		fprintf(stdout, "Usage: ropebwt3 %s [options] <idx.fmr> <seq.fa> [...]\n", argv[0]);
 		fprintf(stderr, "Options:\n");
@@ -513,6 +785,7 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 			fprintf(stderr, "  --old-mem   use the original MEM algorithm (for testing)\n");
 			fprintf(stderr, "  --gap=NUM   output regions >=NUM that are not covered by MEMs [%d]\n", opt.min_gap_len);
 			fprintf(stderr, "  --cov       output breadth of coverage\n");
+			fprintf(stderr, "  --split=NUM split queries longer than NUM into windows processed in parallel; 0 to disable [1m]\n");
 		}
 		if (strcmp(argv[0], "search") == 0) {
 			fprintf(stderr, "  -d          use BWA-SW for local alignment\n");
@@ -544,35 +817,27 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 		}
 		fprintf(stderr, "  -t INT      number of threads [%d]\n", opt.n_threads);
 		fprintf(stderr, "  -p INT      output up to INT positions [%d]\n", opt.max_pos);
+		fprintf(stderr, "  --pos-cache=NUM  cache up to NUM located positions across queries; 0 to disable [1m]\n");
 		fprintf(stderr, "  -L          one sequence per line in the input\n");
-		fprintf(stderr, "  -K NUM      query batch size [100m]\n");
+		fprintf(stderr, "  -K NUM      max query batch size [100m]\n");
+		fprintf(stderr, "  --batch-time=FLOAT  adapt the batch size to ~FLOAT sec of compute per batch; 0 for fixed -K batches [%.1f]\n", opt.batch_time);
+		fprintf(stderr, "  --pipeline=INT  number of batches in flight across the read, compute and write steps [%d]\n", opt.n_pipe);
 		fprintf(stderr, "  -M          use mmap to load FMD\n");
+		fprintf(stderr, "  --bgzf      write BGZF-compressed output, compressed with -t threads\n");
 		return 0;
 	}
 
 	ret = rb3_fmi_load_all(&p.fmi, argv[o.ind], load_flag);
 	if (ret < 0) return 1;
-	if (opt.max_pos > 0 && (p.fmi.ssa == 0 && p.fmi.srindex == 0)) {
-		if (rb3_verbose >= 1)
-			fprintf(stderr, "ERROR: failed to load suffix array samples or SR-index\n");
-		return 1;
-	}
-	if (opt.max_pos > 0 && p.fmi.sid == 0) {
-		if (rb3_verbose >= 1)
-			fprintf(stderr, "ERROR: failed to load sequence names/lengths\n");
-		return 1;
-	}
-	if (!rb3_fmi_is_symmetric(&p.fmi)) {
+	if ((err = search_check(&opt, &p.fmi)) != 0) {
 		if (rb3_verbose >= 1)
-			fprintf(stderr, "ERROR: BWT doesn't contain both strands\n");
+			fprintf(stderr, "ERROR: %s\n", err);
 		return 1;
 	}
 	/* b-move for SMEM is now auto-built in rb3_fmi_load_all via fmi.bm */
-	if (opt.flag & RB3_MF_WRITE_ALL) {
-		puts("CC\tQS  queryName  queryLen  numHap");
-		puts("CC\tQH  refCount   score     editDist   cs   strand   nOut   totAln");
-		puts("CC");
-	}
+	if (opt.max_pos > 0 && opt.pos_cache > 0)
+		p.fmi.pc = rb3_pcache_init(opt.pos_cache);
+	search_init(&p, &opt, 0, stdout);
 	for (j = o.ind + 1; j < argc; ++j) {
 		p.fp = rb3_seq_open(argv[j], is_line);
 		if (p.fp == 0) {
@@ -580,9 +845,16 @@ int main_search(int argc, char *argv[]) // "sw" and "mem" share the same CLI
 				fprintf(stderr, "ERROR: failed to load the sequence file '%s'\n", argv[j]);
 			break;
 		}
-		kt_pipeline(2, worker_pipeline, &p, 3);
+		kt_pipeline(opt.n_pipe, worker_pipeline, &p, 3);
 		rb3_seq_close(p.fp);
 	}
+	ret = search_end(&p) < 0? 1 : 0;
+	if (p.fmi.pc && rb3_verbose >= 3) {
+		int64_t n_hit, n_miss;
+		rb3_pcache_stat(p.fmi.pc, &n_hit, &n_miss);
+		fprintf(stderr, "[M::%s] locate cache: %ld hits, %ld misses (%.2f%% hit rate)\n", __func__, (long)n_hit, (long)n_miss,
+				n_hit + n_miss > 0? 100.0 * n_hit / (n_hit + n_miss) : 0.0);
+	}
 	rb3_fmi_free(&p.fmi);
-	return 0;
+	return ret;
 }
@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "io.h"
+#include "move.h"
+#include "lcp.h"
+#include "kthread.h"
+#include "ketopt.h"
+
+/* The serve protocol. A client connects to the Unix socket and sends one
+ * request: a header line with a command and its options, exactly as on the
+ * command line but without the index and the query files, e.g.
+ *
+ *   mem -l31 -p5\n
+ *
+ * followed by FASTA/FASTQ queries (optionally gzip'd). The client then shuts
+ * down its writing side. The server streams the output back and closes the
+ * connection. Errors are reported as a line starting with "ERROR:".
+ * Commands: mem, sw, hapdiv, ms, count and quit (stop the server).
+ */
+
+#define RB3_SRV_MAX_HDR  4096
+#define RB3_SRV_MAX_ARGS 128
+
+int rb3_search_fd(const rb3_fmi_t *f, kt_forpool_t *pool, int max_threads, int argc, char *argv[], int fd, FILE *out);
+
+typedef struct {
+	rb3_fmi_t fmi;
+	int listen_fd, stop, n_threads;
+	int64_t n_req;
+	kt_forpool_t *pool; // compute threads shared by all requests
+	pthread_mutex_t lock; // for stop and n_req
+	pthread_mutex_t build_lock; // for the lazily built structures below
+	rb3_lcp_t *lcp; // for ms
+	rb3_move_t *mv; // for ms
+} srv_t;
+
+static int srv_read_header(int fd, char *buf) // read the header line; return its length or -1
+{
+	int l = 0;
+	while (l < RB3_SRV_MAX_HDR - 1) { // byte by byte, such that the queries are left in the socket
+		ssize_t r = read(fd, &buf[l], 1);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		if (buf[l] == '\n') break;
+		++l;
+	}
+	if (l == RB3_SRV_MAX_HDR - 1) return -1;
+	if (l > 0 && buf[l-1] == '\r') --l;
+	buf[l] = 0;
+	return l;
+}
+
+static int srv_tokenize(char *s, char *argv[])
+{
+	int argc = 0;
+	char *p = s;
+	while (*p && argc < RB3_SRV_MAX_ARGS) {
+		while (*p == ' ' || *p == '\t') *p++ = 0;
+		if (*p == 0) break;
+		argv[argc++] = p;
+		while (*p && *p != ' ' && *p != '\t') ++p;
+	}
+	return argc;
+}
+
+static void srv_count(const srv_t *s, int argc, char *argv[], int fd, FILE *out) // exact occurrences of each query
+{
+	int32_t c, is_line = 0;
+	ketopt_t o = KETOPT_INIT;
+	rb3_seqio_t *fp;
+	const char *seq, *name;
+	int64_t len, rec_num = 0;
+	while ((c = ketopt(&o, argc, argv, 1, "L", 0)) >= 0) {
+		if (c == 'L') is_line = 1;
+		else {
+			fprintf(out, "ERROR: unknown option\n");
+			return;
+		}
+	}
+	if ((fp = rb3_seq_open_fd(dup(fd), is_line)) == 0) return;
+	while ((seq = rb3_seq_read1(fp, &len, &name)) != 0) {
+		int64_t i, k = 0, l = s->fmi.acc[RB3_ASIZE];
+		++rec_num;
+		for (i = len - 1; i >= 0 && l > k; --i) {
+			int c = (uint8_t)seq[i];
+			c = c < 128? rb3_nt6_table[c] : 5;
+			rb3_fmi_extend1(&s->fmi, &k, &l, c);
+		}
+		if (name) fprintf(out, "%s", name);
+		else fprintf(out, "seq%ld", (long)rec_num);
+		fprintf(out, "\t%ld\t%ld\n", (long)len, (long)(l - k));
+	}
+	rb3_seq_close(fp);
+}
+
+static void srv_ms(srv_t *s, int argc, char *argv[], int fd, FILE *out) // matching statistics; see main_ms()
+{
+	int32_t c, classify = 0, is_line = 0, use_pml = 0, fmi_only = 0;
+	int64_t min_match = 20;
+	double min_fraction = 0.5;
+	ketopt_t o = KETOPT_INIT;
+	rb3_seqio_t *fp;
+	rb3_lcp_t *lcp;
+	rb3_move_t *mv;
+	while ((c = ketopt(&o, argc, argv, 1, "pcFLl:f:", 0)) >= 0) {
+		if (c == 'p') use_pml = 1;
+		else if (c == 'c') classify = 1;
+		else if (c == 'F') fmi_only = 1;
+		else if (c == 'L') is_line = 1;
+		else if (c == 'l') min_match = atol(o.arg);
+		else if (c == 'f') min_fraction = atof(o.arg);
+		else {
+			fprintf(out, "ERROR: unknown option\n");
+			return;
+		}
+	}
+	// the LCP thresholds and the move table are built on the first request; s->lock is not held, so other requests and "quit" go on
+	pthread_mutex_lock(&s->build_lock);
+	if (s->lcp == 0 && (lcp = rb3_lcp_build(&s->fmi)) != 0) {
+		rb3_lcp_build_thresholds(lcp);
+		s->lcp = lcp;
+	}
+	if (s->lcp && s->mv == 0 && !fmi_only && !use_pml) {
+		mv = rb3_move_build(&s->fmi);
+		rb3_move_precompute_dist(mv);
+		s->mv = mv;
+	}
+	lcp = s->lcp, mv = s->mv;
+	pthread_mutex_unlock(&s->build_lock);
+	if (lcp == 0) {
+		fprintf(out, "ERROR: failed to build LCP\n");
+		return;
+	}
+	if ((fp = rb3_seq_open_fd(dup(fd), is_line)) == 0) return;
+	rb3_ms_stream(out, &s->fmi, fmi_only || use_pml? 0 : mv, lcp, fp, use_pml, classify, min_match, min_fraction);
+	rb3_seq_close(fp);
+}
+
+static void srv_request(srv_t *s, int fd)
+{
+	char hdr[RB3_SRV_MAX_HDR], *argv[RB3_SRV_MAX_ARGS + 1];
+	int argc, wfd;
+	int64_t id;
+	double t0 = rb3_realtime();
+	FILE *out;
+
+	if (srv_read_header(fd, hdr) < 0) return;
+	if ((wfd = dup(fd)) < 0) return;
+	if ((out = fdopen(wfd, "w")) == 0) {
+		close(wfd);
+		return;
+	}
+	argc = srv_tokenize(hdr, argv);
+	argv[argc] = 0;
+	pthread_mutex_lock(&s->lock);
+	id = s->n_req++;
+	pthread_mutex_unlock(&s->lock);
+	if (argc == 0) {
+		fprintf(out, "ERROR: empty request\n");
+	} else if (strcmp(argv[0], "mem") == 0 || strcmp(argv[0], "sw") == 0 || strcmp(argv[0], "hapdiv") == 0) {
+		rb3_search_fd(&s->fmi, s->pool, s->n_threads, argc, argv, fd, out);
+	} else if (strcmp(argv[0], "ms") == 0) {
+		srv_ms(s, argc, argv, fd, out);
+	} else if (strcmp(argv[0], "count") == 0) {
+		srv_count(s, argc, argv, fd, out);
+	} else if (strcmp(argv[0], "quit") == 0) {
+		pthread_mutex_lock(&s->lock);
+		s->stop = 1;
+		pthread_mutex_unlock(&s->lock);
+		shutdown(s->listen_fd, SHUT_RDWR); // wake up all threads blocked in accept()
+	} else {
+		fprintf(out, "ERROR: unknown command '%s'\n", argv[0]);
+	}
+	fclose(out);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] served request %ld (%s) in %.3f sec\n", __func__, rb3_realtime(), rb3_percent_cpu(),
+				(long)id, argc > 0? argv[0] : "", rb3_realtime() - t0);
+}
+
+static void *srv_worker(void *data)
+{
+	srv_t *s = (srv_t*)data;
+	for (;;) {
+		int fd, stop;
+		fd = accept(s->listen_fd, 0, 0);
+		pthread_mutex_lock(&s->lock);
+		stop = s->stop;
+		pthread_mutex_unlock(&s->lock);
+		if (stop) {
+			if (fd >= 0) close(fd);
+			break;
+		}
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;
+		}
+		srv_request(s, fd);
+		close(fd);
+	}
+	return 0;
+}
+
+static int srv_unlink(const char *path) // remove path if it is a socket, such as one left by a killed server; -1 if it is something else
+{
+	struct stat st;
+	if (lstat(path, &st) != 0) return 0;
+	if (!S_ISSOCK(st.st_mode)) {
+		errno = EEXIST;
+		return -1;
+	}
+	return unlink(path);
+}
+
+static int srv_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd, ret;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (srv_unlink(path) < 0) return -1; // never remove a mistyped index or query file
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+	mask = umask(0177); // the socket is created 0600: only the owner may send requests, including "quit"
+	ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(fd, 64) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main_serve(int argc, char *argv[])
+{
+	int32_t c, i, n_workers = 4, n_threads = 4, load_flag = RB3_LOAD_ALL;
+	int64_t pos_cache = 1000000;
+	ketopt_t o = KETOPT_INIT;
+	pthread_t *tid;
+	srv_t s;
+
+	while ((c = ketopt(&o, argc, argv, 1, "j:t:MC:", 0)) >= 0) {
+		if (c == 'j') n_workers = atoi(o.arg);
+		else if (c == 't') n_threads = atoi(o.arg);
+		else if (c == 'M') load_flag |= RB3_LOAD_MMAP;
+		else if (c == 'C') pos_cache = rb3_parse_num(o.arg);
+	}
+	if (argc - o.ind < 2) {
+		fprintf(stdout, "Usage: ropebwt3 serve [options] <idx.fmd> <socket>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -j INT      number of requests served at the same time [%d]\n", n_workers);
+		fprintf(stderr, "  -t INT      number of compute threads shared by all requests; caps -t of a request [%d]\n", n_threads);
+		fprintf(stderr, "  -C NUM      size of the locate cache shared by all requests [1m]\n");
+		fprintf(stderr, "  -M          use mmap to load FMD\n");
+		fprintf(stderr, "Protocol: send a header line like \"mem -p5\" (commands: mem, sw, hapdiv, ms, count, quit),\n");
+		fprintf(stderr, "  then the queries; shut down writing and read the output until the server closes.\n");
+		return 0;
+	}
+	memset(&s, 0, sizeof(srv_t));
+	if (rb3_fmi_load_all(&s.fmi, argv[o.ind], load_flag) < 0) return 1;
+	if (pos_cache > 0 && (s.fmi.ssa || s.fmi.srindex))
+		s.fmi.pc = rb3_pcache_init(pos_cache);
+	if ((s.listen_fd = srv_listen(argv[o.ind + 1])) < 0) {
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to listen on socket '%s': %s\n", argv[o.ind + 1], strerror(errno));
+		rb3_fmi_free(&s.fmi);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN); // a client may disconnect before reading all output
+	pthread_mutex_init(&s.lock, 0);
+	pthread_mutex_init(&s.build_lock, 0);
+	s.n_threads = n_threads > 0? n_threads : 1;
+	s.pool = kt_forpool_init(s.n_threads);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] listening on '%s'\n", __func__, rb3_realtime(), rb3_percent_cpu(), argv[o.ind + 1]);
+	n_workers = n_workers > 0? n_workers : 1;
+	tid = RB3_CALLOC(pthread_t, n_workers);
+	for (i = 0; i < n_workers; ++i) pthread_create(&tid[i], 0, srv_worker, &s);
+	for (i = 0; i < n_workers; ++i) pthread_join(tid[i], 0);
+	free(tid);
+	close(s.listen_fd);
+	srv_unlink(argv[o.ind + 1]);
+	kt_forpool_destroy(s.pool);
+	pthread_mutex_destroy(&s.lock);
+	pthread_mutex_destroy(&s.build_lock);
+	if (s.mv) rb3_move_destroy(s.mv);
+	if (s.lcp) rb3_lcp_destroy(s.lcp);
+	rb3_fmi_free(&s.fmi);
+	return 0;
+}
+
+typedef struct {
+	int fd, ret;
+	FILE *in;
+	kstring_t hdr;
+} qry_sender_t;
+
+static void *qry_send(void *data) // send the request on a separate thread, so that the output is read while queries are sent
+{
+	qry_sender_t *q = (qry_sender_t*)data;
+	char buf[0x10000];
+	size_t l;
+	if (write(q->fd, q->hdr.s, q->hdr.l) != (ssize_t)q->hdr.l) q->ret = 1;
+	while (q->ret == 0 && (l = fread(buf, 1, sizeof(buf), q->in)) > 0)
+		if (write(q->fd, buf, l) != (ssize_t)l) q->ret = 1;
+	shutdown(q->fd, SHUT_WR);
+	return 0;
+}
+
+int main_query(int argc, char *argv[]) // a minimal client: send a request to "ropebwt3 serve" and print the output
+{
+	struct sockaddr_un addr;
+	qry_sender_t q;
+	pthread_t tid;
+	char buf[0x10000];
+	ssize_t r;
+	int i;
+
+	if (argc < 4) {
+		fprintf(stdout, "Usage: ropebwt3 query <socket> <command> [options] <seq.fa>|-\n");
+		return 0;
+	}
+	if (strlen(argv[1]) >= sizeof(addr.sun_path)) return 1;
+	memset(&q, 0, sizeof(q));
+	q.in = strcmp(argv[argc-1], "-")? fopen(argv[argc-1], "rb") : stdin;
+	if (q.in == 0) {
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to open the sequence file '%s'\n", argv[argc-1]);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[1]);
+	if ((q.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(q.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		if (rb3_verbose >= 1)
+			fprintf(stderr, "ERROR: failed to connect to '%s'\n", argv[1]);
+		if (q.in != stdin) fclose(q.in);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN); // the server may close early on errors
+	for (i = 2; i < argc - 1; ++i)
+		rb3_sprintf_lite(&q.hdr, "%s%c", argv[i], i < argc - 2? ' ' : '\n');
+	pthread_create(&tid, 0, qry_send, &q);
+	while ((r = read(q.fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, r, stdout);
+	pthread_join(tid, 0);
+	close(q.fd);
+	if (q.in != stdin) fclose(q.in);
+	free(q.hdr.s);
+	return q.ret;
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "ketopt.h"
+
+/*
+ * Shared-memory index images
+ *
+ * "ropebwt3 shm-load idx.fmd" copies the FMD and its companion files to a
+ * tmpfs directory (/dev/shm by default). If $RB3_SHM is set to a value other
+ * than "0", rb3_fmi_load_all() checks for such an image first and, if it is up
+ * to date and owned by the caller, maps the components from there. The
+ * FMD, the sampled suffix array, the SR-index and the k-mer intervals are used
+ * in place, so all processes on the host share one copy of them in the page
+ * cache and loading takes no time. The image of /path/to/idx.fmd is named
+ * "rb3%path%to%idx.fmd", with the same suffixes for the companion files.
+ */
+
+static const char *shm_suffix[] = { ".ssa", ".sri", ".sid", ".len.gz", ".mvi", ".kmi", "", 0 }; // the FMD last: it marks a complete image
+
+const char *rb3_shm_dir(void)
+{
+	const char *dir = getenv("RB3_SHM_DIR");
+	return dir && *dir? dir : "/dev/shm";
+}
+
+int rb3_shm_enabled(void)
+{
+	const char *s = getenv("RB3_SHM");
+	return s && *s && strcmp(s, "0") != 0;
+}
+
+char *rb3_shm_path(const char *fn)
+{
+	char *abs, *path, *p;
+	const char *dir = rb3_shm_dir();
+	if ((abs = realpath(fn, 0)) == 0) return 0;
+	path = RB3_MALLOC(char, strlen(dir) + strlen(abs) + 5);
+	sprintf(path, "%s/rb3%s", dir, abs);
+	for (p = path + strlen(dir) + 4; *p; ++p)
+		if (*p == '/') *p = '%';
+	free(abs);
+	return path;
+}
+
+static int shm_is_older(const char *fn, const char *shm_fn, int check_size) // 1 if shm_fn is absent or older than an existing fn
+{
+	struct stat s0, s1;
+	if (stat(fn, &s0) != 0) return 0;
+	if (stat(shm_fn, &s1) != 0) return 1;
+	if (check_size && s0.st_size != s1.st_size) return 1;
+	return s1.st_mtime < s0.st_mtime;
+}
+
+static int shm_is_trusted(const char *shm_fn) // 1 if shm_fn is absent or a regular file of ours that others cannot write
+{
+	struct stat s;
+	if (lstat(shm_fn, &s) != 0) return errno == ENOENT;
+	return S_ISREG(s.st_mode) && s.st_uid == geteuid() && !(s.st_mode & (S_IWGRP|S_IWOTH));
+}
+
+char *rb3_shm_find(const char *fn)
+{
+	char *path, *src, *dst;
+	int i, ok = 1;
+	if ((path = rb3_shm_path(fn)) == 0) return 0;
+	src = RB3_MALLOC(char, strlen(fn) + 8);
+	dst = RB3_MALLOC(char, strlen(path) + 8);
+	for (i = 0; shm_suffix[i] && ok; ++i) {
+		strcat(strcpy(src, fn), shm_suffix[i]);
+		strcat(strcpy(dst, path), shm_suffix[i]);
+		if (shm_is_older(src, dst, strcmp(shm_suffix[i], ".ssa") != 0 && strcmp(shm_suffix[i], ".sri") != 0)) // .ssa and .sri may be converted to the mappable formats
+			ok = 0;
+		else if (!shm_is_trusted(dst)) {
+			if (rb3_verbose >= 2)
+				fprintf(stderr, "[W::%s] ignoring %s: not owned by the user or writable by others\n", __func__, dst);
+			ok = 0;
+		}
+	}
+	free(src); free(dst);
+	if (!ok) free(path);
+	return ok? path : 0;
+}
+
+static int shm_copy(const char *src, const char *dst)
+{
+	char *buf;
+	int fd0, fd1;
+	ssize_t l;
+	if ((fd0 = open(src, O_RDONLY)) < 0) return -1;
+	if ((fd1 = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		close(fd0);
+		return -1;
+	}
+	buf = RB3_MALLOC(char, 1<<20);
+	while ((l = read(fd0, buf, 1<<20)) > 0)
+		if (write(fd1, buf, l) != l) break;
+	free(buf);
+	close(fd0);
+	return close(fd1) == 0 && l == 0? 0 : -1;
+}
+
+static int shm_load1(const char *src, const char *dst)
+{
+	char *tmp;
+	int ret;
+	tmp = RB3_MALLOC(char, strlen(dst) + 16);
+	sprintf(tmp, "%s.tmp%d", dst, (int)getpid());
+	if (strcmp(src + strlen(src) - 4, ".ssa") == 0) { // rewrite the sampled suffix array in the packed format
+		rb3_ssa_t *sa;
+		ret = (sa = rb3_ssa_restore(src)) != 0? rb3_ssa_dump(sa, tmp) : -1;
+		rb3_ssa_destroy(sa);
+	} else if (strcmp(src + strlen(src) - 4, ".sri") == 0) { // rewrite the SR-index in the "SRI\5" format
+		rb3_srindex_t *sr;
+		ret = (sr = rb3_srindex_restore(src)) != 0? rb3_srindex_dump(sr, tmp) : -1;
+		rb3_srindex_destroy(sr);
+	} else ret = shm_copy(src, tmp);
+	if (ret == 0) ret = chmod(tmp, 0644); // rb3_shm_find() ignores images writable by others
+	if (ret == 0) ret = rename(tmp, dst); // so that readers never see a partial file
+	if (ret != 0) unlink(tmp);
+	free(tmp);
+	return ret;
+}
+
+int main_shm_load(int argc, char *argv[])
+{
+	int c, i, drop = 0, ret = 0;
+	char *fn, *path, *src, *dst, magic[4];
+	ketopt_t o = KETOPT_INIT;
+	FILE *fp;
+
+	while ((c = ketopt(&o, argc, argv, 1, "dp", 0)) >= 0) {
+		if (c == 'd') drop = 1;
+		else if (c == 'p') drop = 2;
+	}
+	if (argc == o.ind) {
+		fprintf(stderr, "Usage: ropebwt3 shm-load [options] <idx.fmd>\n");
+		fprintf(stderr, "Options:\n");
+		fprintf(stderr, "  -d      remove the shared-memory image\n");
+		fprintf(stderr, "  -p      print the path of the image if it is up to date\n");
+		fprintf(stderr, "Notes: the image is written to $RB3_SHM_DIR, or to /dev/shm if unset;\n");
+		fprintf(stderr, "       other commands only use it if $RB3_SHM is set to 1\n");
+		return 1;
+	}
+	fn = argv[o.ind];
+	if ((path = rb3_shm_path(fn)) == 0) {
+		fprintf(stderr, "ERROR: failed to resolve the path of \"%s\"\n", fn);
+		return 1;
+	}
+	if (drop == 2) {
+		char *p = rb3_shm_find(fn);
+		if (p) printf("%s\n", p);
+		free(p); free(path);
+		return p? 0 : 1;
+	}
+	src = RB3_MALLOC(char, strlen(fn) + 8);
+	dst = RB3_MALLOC(char, strlen(path) + 8);
+	if (drop) {
+		for (i = 0; shm_suffix[i]; ++i) {
+			strcat(strcpy(dst, path), shm_suffix[i]);
+			if (unlink(dst) == 0 && rb3_verbose >= 3)
+				fprintf(stderr, "[M::%s] removed %s\n", __func__, dst);
+		}
+		goto end_load;
+	}
+	if ((fp = fopen(fn, "rb")) == 0 || fread(magic, 1, 4, fp) != 4 || (strncmp(magic, "RLD\3", 4) != 0 && strncmp(magic, "RB3\1", 4) != 0)) {
+		fprintf(stderr, "ERROR: \"%s\" is not in the FMD format or an index container; only these can be mapped\n", fn);
+		if (fp) fclose(fp);
+		ret = 1;
+		goto end_load;
+	}
+	fclose(fp);
+	strcpy(dst, path);
+	unlink(dst); // invalidate the old image before updating the companion files
+	for (i = 0; shm_suffix[i]; ++i) {
+		strcat(strcpy(src, fn), shm_suffix[i]);
+		strcat(strcpy(dst, path), shm_suffix[i]);
+		if (access(src, R_OK) != 0) {
+			unlink(dst); // a stale component would be picked up otherwise
+			continue;
+		}
+		if (shm_load1(src, dst) != 0) {
+			fprintf(stderr, "ERROR: failed to copy \"%s\" to \"%s\": %s\n", src, dst, strerror(errno));
+			ret = 1;
+			break;
+		}
+		if (rb3_verbose >= 3)
+			fprintf(stderr, "[M::%s::%.3f*%.2f] copied %s\n", __func__, rb3_realtime(), rb3_percent_cpu(), dst);
+	}
+	if (ret == 0) printf("%s\n", path);
+end_load:
+	free(src); free(dst); free(path);
+	return ret;
+}
@@ -2,6 +2,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "rb3priv.h"
 #include "fm-index.h"
 #include "srindex.h"
@@ -26,37 +32,56 @@ typedef struct {
 	int64_t n, m;
 	int64_t *bwt_start; /* BWT position of first char in each run */
 	int64_t *bwt_end;   /* BWT position of last char in each run */
+	uint8_t *c;         /* character of each run */
 } run_bounds_t;
 
+static void run_push(run_bounds_t *rb, int64_t pos, int64_t l, int c)
+{
+	if (rb->n == rb->m) {
+		rb->m += (rb->m >> 1) + 16;
+		rb->bwt_start = RB3_REALLOC(int64_t, rb->bwt_start, rb->m);
+		rb->bwt_end = RB3_REALLOC(int64_t, rb->bwt_end, rb->m);
+		rb->c = RB3_REALLOC(uint8_t, rb->c, rb->m);
+	}
+	rb->bwt_start[rb->n] = pos;
+	rb->bwt_end[rb->n] = pos + l - 1;
+	rb->c[rb->n++] = c;
+}
+
+/*
+ * Phi is linear inside a run only because LF steps every row of the run one
+ * text position back. That does not hold for a sentinel: its LF lands on the
+ * end of whichever sequence comes next in the sentinel order. Every sentinel
+ * is therefore a run of its own.
+ */
+static void run_add(run_bounds_t *rb, int64_t pos, int64_t l, int c)
+{
+	if (c == 0) {
+		int64_t k;
+		for (k = 0; k < l; ++k)
+			run_push(rb, pos + k, 1, 0);
+	} else if (rb->n > 0 && rb->c[rb->n - 1] == c && rb->bwt_end[rb->n - 1] == pos - 1) {
+		rb->bwt_end[rb->n - 1] = pos + l - 1; /* same character across an encoding boundary */
+	} else run_push(rb, pos, l, c);
+}
+
 static run_bounds_t *scan_bwt_runs(const rb3_fmi_t *f)
 {
 	run_bounds_t *rb;
 	int64_t pos = 0, l;
-	int c, last_c = -1;
+	int c;
 
 	rb = RB3_CALLOC(run_bounds_t, 1);
-	rb->n = 0;
 	rb->m = 1024;
 	rb->bwt_start = RB3_MALLOC(int64_t, rb->m);
 	rb->bwt_end = RB3_MALLOC(int64_t, rb->m);
+	rb->c = RB3_MALLOC(uint8_t, rb->m);
 
 	if (f->e) {
 		rlditr_t itr;
 		rld_itr_init(f->e, &itr, 0);
 		while ((l = rld_dec(f->e, &itr, &c, 0)) > 0) {
-			RB3_GROW(int64_t, rb->bwt_start, rb->n, rb->m);
-			/* bwt_end must be grown in sync; re-grow if needed */
-			if (rb->n >= (rb->m >> 1)) { /* ensure bwt_end has enough space too */
-				int64_t old_m = rb->m;
-				rb->m = rb->n + 1;
-				rb->m += (rb->m >> 1) + 16;
-				rb->bwt_start = RB3_REALLOC(int64_t, rb->bwt_start, rb->m);
-				rb->bwt_end = RB3_REALLOC(int64_t, rb->bwt_end, rb->m);
-				(void)old_m;
-			}
-			rb->bwt_start[rb->n] = pos;
-			rb->bwt_end[rb->n] = pos + l - 1;
-			rb->n++;
+			run_add(rb, pos, l, c);
 			pos += l;
 		}
 	} else if (f->r) {
@@ -67,26 +92,7 @@ static run_bounds_t *scan_bwt_runs(const rb3_fmi_t *f)
 			const uint8_t *q = block + 2, *end = block + 2 + *rle_nptr(block);
 			while (q < end) {
 				rle_dec1(q, c, l);
-				if (c != last_c) {
-					/* New run or continuation after block boundary */
-					if (last_c >= 0 && rb->n > 0) {
-						/* finalize the previous run's end if last_c changed */
-					}
-					RB3_GROW(int64_t, rb->bwt_start, rb->n, rb->m);
-					if (rb->n >= (rb->m >> 1)) {
-						rb->m = rb->n + 1;
-						rb->m += (rb->m >> 1) + 16;
-						rb->bwt_start = RB3_REALLOC(int64_t, rb->bwt_start, rb->m);
-						rb->bwt_end = RB3_REALLOC(int64_t, rb->bwt_end, rb->m);
-					}
-					rb->bwt_start[rb->n] = pos;
-					rb->bwt_end[rb->n] = pos + l - 1;
-					rb->n++;
-					last_c = c;
-				} else {
-					/* Same character, extend current run */
-					rb->bwt_end[rb->n - 1] = pos + l - 1;
-				}
+				run_add(rb, pos, l, c);
 				pos += l;
 			}
 		}
@@ -99,6 +105,7 @@ static void run_bounds_destroy(run_bounds_t *rb)
 	if (rb == 0) return;
 	free(rb->bwt_start);
 	free(rb->bwt_end);
+	free(rb->c);
 	free(rb);
 }
 
@@ -113,242 +120,451 @@ typedef struct {
 	int64_t sa_val;
 } pos_sa_pair_t;
 
-/* Sort helper for binary search on bwt_pos */
-static int cmp_pos_sa(const void *a, const void *b)
+/***************************
+ * Bounded sample store    *
+ ***************************/
+
+/*
+ * Samples found by the walks are appended to per-thread buffers as (bwt_pos,
+ * steps, sentinel). A buffer that reaches its share of the memory cap is
+ * sorted by bwt_pos and written to an unlinked temporary file as a run. At
+ * the end, all runs are merged into the final sorted arrays, and steps are
+ * converted to SA values then. Memory during the walks is thus bounded by the
+ * cap, and the merge only adds the output arrays.
+ */
+typedef struct {
+	int64_t bwt_pos, d, sid;
+} sa_rec_t;
+
+typedef struct {
+	int64_t n, m;
+	sa_rec_t *a;
+} sa_buf_t;
+
+typedef struct {
+	int32_t n_buf;
+	int64_t max_rec;     /* max records per buffer */
+	sa_buf_t *buf;       /* one buffer per thread */
+	int fd;              /* spill file; -1 if nothing spilled */
+	pthread_mutex_t lock;
+	int64_t n_run, m_run, *run_off, *run_n; /* sorted runs in the spill file, offsets in records */
+	int64_t n_rec, n_spill;
+} sa_store_t;
+
+static int cmp_sa_rec(const void *a, const void *b)
 {
-	int64_t x = ((const pos_sa_pair_t*)a)->bwt_pos;
-	int64_t y = ((const pos_sa_pair_t*)b)->bwt_pos;
+	int64_t x = ((const sa_rec_t*)a)->bwt_pos;
+	int64_t y = ((const sa_rec_t*)b)->bwt_pos;
 	return (x > y) - (x < y);
 }
 
-/* Sort helper for int64_t */
-static int cmp_int64(const void *a, const void *b)
+static sa_store_t *sa_store_init(int32_t n_buf, int64_t max_mem)
 {
-	int64_t x = *(const int64_t*)a;
-	int64_t y = *(const int64_t*)b;
-	return (x > y) - (x < y);
+	sa_store_t *st;
+	st = RB3_CALLOC(sa_store_t, 1);
+	st->n_buf = n_buf;
+	st->max_rec = max_mem / n_buf / sizeof(sa_rec_t);
+	if (st->max_rec < 16) st->max_rec = 16;
+	st->buf = RB3_CALLOC(sa_buf_t, n_buf);
+	st->fd = -1;
+	pthread_mutex_init(&st->lock, 0);
+	return st;
 }
 
-/*
- * Walk backward from sentinel at BWT position k.
- *
- * Two-pass approach:
- * Pass 1: Walk to count total length.
- * Pass 2: Walk again, computing SA values on the fly. Record at target
- *          positions (run boundaries) and subsampled positions (SA % s == 0).
- */
-static void sa_walk_one(const rb3_fmi_t *f, int64_t k, int32_t s,
-                        const int64_t *targets, int64_t n_targets,
-                        pos_sa_pair_t *tgt_out, int64_t *n_tgt_out,
-                        pos_sa_pair_t *sub_out, int64_t max_sub, int64_t *n_sub_out,
-                        int64_t *walk_dist_out, int64_t *dest_sent_out)
+static void sa_store_destroy(sa_store_t *st)
 {
-	int64_t ok[RB3_ASIZE];
-	int32_t c;
-	int64_t pos, dist, d, n_tgt = 0, n_sub = 0;
+	int32_t i;
+	if (st == 0) return;
+	for (i = 0; i < st->n_buf; ++i)
+		free(st->buf[i].a);
+	if (st->fd >= 0) close(st->fd);
+	pthread_mutex_destroy(&st->lock);
+	free(st->buf); free(st->run_off); free(st->run_n); free(st);
+}
 
-	/* Pass 1: count total walk length */
-	pos = k;
-	dist = 0;
-	do {
-		c = rb3_fmi_rank1a(f, pos, ok);
-		pos = f->acc[c] + ok[c];
-		dist++;
-	} while (c);
+static int sa_spill_open(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char *fn;
+	int fd;
+	if (dir == 0 || *dir == 0) dir = "/tmp";
+	fn = RB3_MALLOC(char, strlen(dir) + 32);
+	sprintf(fn, "%s/rb3-sri.XXXXXX", dir);
+	if ((fd = mkstemp(fn)) >= 0) unlink(fn); /* removed when closed */
+	free(fn);
+	return fd;
+}
 
-	*walk_dist_out = dist;
-	*dest_sent_out = pos; /* BWT position of destination sentinel (c was 0, pos = ok[0]) */
+static void sa_store_spill(sa_store_t *st, sa_buf_t *b)
+{
+	int64_t off;
+	qsort(b->a, b->n, sizeof(sa_rec_t), cmp_sa_rec);
+	pthread_mutex_lock(&st->lock);
+	if (st->fd < 0 && (st->fd = sa_spill_open()) < 0) {
+		fprintf(stderr, "[E::%s] failed to create a temporary file: %s\n", __func__, strerror(errno));
+		abort();
+	}
+	off = st->n_spill;
+	st->n_spill += b->n;
+	if (st->n_run == st->m_run) {
+		st->m_run = st->m_run? st->m_run << 1 : 16;
+		st->run_off = RB3_REALLOC(int64_t, st->run_off, st->m_run);
+		st->run_n = RB3_REALLOC(int64_t, st->run_n, st->m_run);
+	}
+	st->run_off[st->n_run] = off, st->run_n[st->n_run++] = b->n;
+	pthread_mutex_unlock(&st->lock);
+	if (pwrite(st->fd, b->a, b->n * sizeof(sa_rec_t), off * sizeof(sa_rec_t)) != (ssize_t)(b->n * sizeof(sa_rec_t))) { /* writes of different threads don't overlap */
+		fprintf(stderr, "[E::%s] failed to write to the temporary file: %s\n", __func__, strerror(errno));
+		abort();
+	}
+	b->n = 0;
+}
 
-	/* Pass 2: walk again, recording */
-	pos = k;
-	d = 0;
-	do {
-		int64_t sa_val = dist - 1 - d;
+static inline void sa_store_push(sa_store_t *st, int tid, int64_t bwt_pos, int64_t d, int64_t sid)
+{
+	sa_buf_t *b = &st->buf[tid];
+	if (b->n == st->max_rec) sa_store_spill(st, b);
+	if (b->n == b->m) { /* never allocate beyond the cap */
+		b->m = b->m? b->m << 1 : 1024;
+		if (b->m > st->max_rec) b->m = st->max_rec;
+		b->a = RB3_REALLOC(sa_rec_t, b->a, b->m);
+	}
+	b->a[b->n].bwt_pos = bwt_pos, b->a[b->n].d = d, b->a[b->n++].sid = sid;
+}
 
-		/* Check target (binary search) */
-		{
-			int64_t lo = 0, hi = n_targets;
-			while (lo < hi) {
-				int64_t mid = lo + (hi - lo) / 2;
-				if (targets[mid] < pos) lo = mid + 1;
-				else hi = mid;
-			}
-			if (lo < n_targets && targets[lo] == pos) {
-				tgt_out[n_tgt].bwt_pos = pos;
-				tgt_out[n_tgt].sa_val = sa_val;
-				n_tgt++;
-			}
-		}
+#define SA_MERGE_BLOCK 4096 /* records read from a spilled run at a time */
 
-		/* Check subsampled (SA % s == 0) for s > 1 */
-		if (s > 1 && sa_val % s == 0 && n_sub < max_sub) {
-			sub_out[n_sub].bwt_pos = pos;
-			sub_out[n_sub].sa_val = sa_val;
-			n_sub++;
-		}
+typedef struct {
+	const sa_rec_t *a; /* current block */
+	int64_t i, n;      /* position in and size of the block */
+	int64_t off, rest; /* next record in the spill file and the number left */
+} sa_cursor_t;
 
-		c = rb3_fmi_rank1a(f, pos, ok);
-		pos = f->acc[c] + ok[c];
-		d++;
-	} while (c);
+static int sa_cursor_next(const sa_store_t *st, sa_cursor_t *c, sa_rec_t *blk) /* make c->a[c->i] valid; return 0 at the end */
+{
+	int64_t l;
+	if (c->i < c->n) return 1;
+	if (blk == 0 || c->rest == 0) return 0;
+	l = c->rest < SA_MERGE_BLOCK? c->rest : SA_MERGE_BLOCK;
+	if (pread(st->fd, blk, l * sizeof(sa_rec_t), c->off * sizeof(sa_rec_t)) != (ssize_t)(l * sizeof(sa_rec_t))) {
+		fprintf(stderr, "[E::%s] failed to read the temporary file: %s\n", __func__, strerror(errno));
+		abort();
+	}
+	c->a = blk, c->i = 0, c->n = l;
+	c->off += l, c->rest -= l;
+	return 1;
+}
+
+/*
+ * Merge all records in bwt_pos order. The k-th output is written to
+ * pos[k*stride] and sa[k*stride], where the SA value is end[sid] - d.
+ */
+static int64_t sa_store_merge(sa_store_t *st, const int64_t *end, int64_t *pos, int64_t *sa, int64_t stride)
+{
+	int64_t i, j, k = 0, n_cur = st->n_run + st->n_buf;
+	sa_cursor_t *cur;
+	sa_rec_t *blk;
+	int32_t *heap, n_heap = 0;
+
+	cur = RB3_CALLOC(sa_cursor_t, n_cur);
+	blk = RB3_MALLOC(sa_rec_t, st->n_run * SA_MERGE_BLOCK + 1);
+	heap = RB3_MALLOC(int32_t, n_cur);
+	for (i = 0; i < st->n_run; ++i)
+		cur[i].off = st->run_off[i], cur[i].rest = st->run_n[i];
+	for (i = 0; i < st->n_buf; ++i) {
+		sa_buf_t *b = &st->buf[i];
+		qsort(b->a, b->n, sizeof(sa_rec_t), cmp_sa_rec);
+		cur[st->n_run + i].a = b->a, cur[st->n_run + i].n = b->n;
+	}
+	for (i = 0; i < n_cur; ++i) { /* build a min-heap of cursors */
+		if (!sa_cursor_next(st, &cur[i], i < st->n_run? &blk[i * SA_MERGE_BLOCK] : 0)) continue;
+		for (j = n_heap++; j > 0 && cur[heap[(j-1)/2]].a[cur[heap[(j-1)/2]].i].bwt_pos > cur[i].a[cur[i].i].bwt_pos; j = (j-1)/2)
+			heap[j] = heap[(j-1)/2];
+		heap[j] = i;
+	}
+	while (n_heap > 0) {
+		int32_t t = heap[0];
+		sa_cursor_t *c = &cur[t];
+		const sa_rec_t *r = &c->a[c->i++];
+		pos[k * stride] = r->bwt_pos, sa[k * stride] = end[r->sid] - r->d;
+		++k;
+		if (!sa_cursor_next(st, c, t < st->n_run? &blk[t * SA_MERGE_BLOCK] : 0))
+			t = heap[--n_heap];
+		for (j = 0;;) { /* sift down t from the root */
+			int64_t l = 2 * j + 1, x;
+			if (l >= n_heap) break;
+			if (l + 1 < n_heap && cur[heap[l+1]].a[cur[heap[l+1]].i].bwt_pos < cur[heap[l]].a[cur[heap[l]].i].bwt_pos) ++l;
+			x = cur[t].a[cur[t].i].bwt_pos;
+			if (x <= cur[heap[l]].a[cur[heap[l]].i].bwt_pos) break;
+			heap[j] = heap[l], j = l;
+		}
+		if (n_heap > 0) heap[j] = t;
+	}
+	free(heap); free(blk); free(cur);
+	return k;
+}
 
-	*n_tgt_out = n_tgt;
-	*n_sub_out = n_sub;
+static inline int64_t sa_store_size(const sa_store_t *st)
+{
+	int32_t i;
+	int64_t n = st->n_spill;
+	for (i = 0; i < st->n_buf; ++i) n += st->buf[i].n;
+	return n;
 }
 
+/***************************
+ * SA computation at run   *
+ * boundaries via backward *
+ * walk from sentinels     *
+ ***************************/
+
+/*
+ * Walk backward from sentinels at BWT positions [st,en) in a single pass.
+ *
+ * At each position reached, record (bwt_pos, d) where d is the number of LF
+ * steps from the sentinel if the position is a target (run boundary, looked up
+ * in a bitvector) or if d % s == 0. Once all walks are done, sequence lengths
+ * are known and d is converted to the SA value end[i]-d for the walk from
+ * sentinel i, where end[i] is the last text position of sequence i.
+ * Subsamples are thus spaced by s counting from the end of each sequence; any
+ * spacing bounded by s works for rb3_srindex_locate_one().
+ *
+ * The walks of a batch advance in round-robin. The rank blocks of a round are
+ * prefetched before any of them is used, so that up to SA_WALK_BATCH
+ * independent LF steps are in flight instead of one.
+ */
+#define SA_WALK_BATCH 16
+
 typedef struct {
 	const rb3_fmi_t *f;
-	const int64_t *targets;
-	int64_t n_targets;
+	const uint64_t *tgt_bv; /* bit k set iff BWT position k is a target */
 	int32_t s;
-	/* Per-sentinel output buffers */
-	pos_sa_pair_t **per_sent_tgt;
-	int64_t *per_sent_tgt_n;
-	pos_sa_pair_t **per_sent_sub;
-	int64_t *per_sent_sub_n;
-	int64_t total_n; /* total BWT length, for buffer sizing */
-	int64_t n_sent;  /* number of sentinels */
-	/* Per-sentinel walk info for multi-string correction */
+	sa_store_t *tgt, *sub; /* samples at targets and subsamples */
+	int64_t sent0, n_sent; /* walk from sentinels [sent0,n_sent) */
+	int64_t batch;   /* number of sentinels per task, at most SA_WALK_BATCH */
 	int64_t *walk_dist;  /* walk distance per sentinel */
-	int64_t *dest_sent;  /* destination sentinel BWT position per sentinel */
+	uint64_t *new_bv;    /* if not NULL, set the bits of all positions visited */
 } sa_mt_t;
 
-static void sa_worker_func(void *data, long i, int tid)
+static void sa_worker_func(void *data, long b, int tid)
 {
 	sa_mt_t *mt = (sa_mt_t*)data;
-	int64_t max_sub;
-	(void)tid;
+	const rb3_fmi_t *f = mt->f;
+	int64_t st = mt->sent0 + b * mt->batch, en = st + mt->batch;
+	int64_t pos[SA_WALK_BATCH], d[SA_WALK_BATCH];
+	int32_t a, n, n_act, act[SA_WALK_BATCH];
+	if (en > mt->n_sent) en = mt->n_sent;
+	n = en - st;
+
+	for (a = 0; a < n; ++a)
+		act[a] = a, pos[a] = st + a, d[a] = 0;
+	for (n_act = n; n_act > 0; ) {
+		int32_t k, t;
+		for (k = 0; k < n_act; ++k) { /* record at the positions reached before the step */
+			int64_t p;
+			a = act[k], p = pos[a];
+			if (mt->new_bv)
+				__sync_fetch_and_or(&mt->new_bv[p >> 6], 1ULL << (p & 63));
+			if (mt->tgt_bv[p >> 6] >> (p & 63) & 1)
+				sa_store_push(mt->tgt, tid, p, d[a], st + a);
+			if (mt->s > 1 && d[a] % mt->s == 0)
+				sa_store_push(mt->sub, tid, p, d[a], st + a);
+		}
+		for (k = 0; k < n_act; ++k)
+			rb3_fmi_prefetch(f, pos[act[k]], 0);
+		for (k = 0; k < n_act; ++k)
+			rb3_fmi_prefetch(f, pos[act[k]], 1);
+		for (k = t = 0; k < n_act; ++k) {
+			int64_t ok[RB3_ASIZE];
+			int32_t c;
+			a = act[k];
+			c = rb3_fmi_rank1a(f, pos[a], ok);
+			pos[a] = f->acc[c] + ok[c];
+			d[a]++;
+			if (c) act[t++] = a;
+			else mt->walk_dist[st + a] = d[a];
+		}
+		n_act = t;
+	}
+}
 
-	/* Estimate max subsampled entries per sentinel: n/(s*n_sent) + slack */
-	if (mt->s > 1)
-		max_sub = mt->total_n / mt->s + 2;
-	else
-		max_sub = 0;
+/***************************
+ * Compact arrays          *
+ ***************************/
 
-	{
-		/* Each sentinel walks ~n/n_sent positions; estimate targets proportionally.
-		 * Use 4x the proportional estimate + slack, capped at n_targets. */
-		int64_t max_tgt = mt->n_targets / (mt->n_sent > 0 ? mt->n_sent : 1) * 4 + 1024;
-		if (max_tgt > mt->n_targets) max_tgt = mt->n_targets;
-		mt->per_sent_tgt[i] = RB3_MALLOC(pos_sa_pair_t, max_tgt);
-	}
-	if (max_sub > 0)
-		mt->per_sent_sub[i] = RB3_MALLOC(pos_sa_pair_t, max_sub);
-	else
-		mt->per_sent_sub[i] = 0;
+#define sr_popcount(x) __builtin_popcountll(x)
 
-	sa_walk_one(mt->f, (int64_t)i, mt->s,
-	            mt->targets, mt->n_targets,
-	            mt->per_sent_tgt[i], &mt->per_sent_tgt_n[i],
-	            mt->per_sent_sub[i], max_sub, &mt->per_sent_sub_n[i],
-	            &mt->walk_dist[i], &mt->dest_sent[i]);
+static inline int64_t sr_n_words(int64_t n, int32_t w) /* words of n w-bit entries plus a padding word */
+{
+	return (int64_t)(((uint64_t)n * w + 63) >> 6) + 1;
 }
 
-/*
- * Compute SA values at all specified BWT positions and collect subsampled positions.
- */
-static pos_sa_pair_t *compute_sa_at_positions(const rb3_fmi_t *f,
-                                              int64_t *targets, int64_t n_targets,
-                                              int32_t s, int n_threads,
-                                              int64_t *n_results,
-                                              pos_sa_pair_t **sub_results_out,
-                                              int64_t *n_sub_out,
-                                              int64_t **walk_dist_out,
-                                              int64_t **dest_sent_out)
+static inline void sr_bits_set(uint64_t *a, int32_t w, int64_t i, uint64_t v) /* a[] zeroed; v < 2^w */
 {
-	sa_mt_t mt;
-	int64_t n_sent = f->acc[1];
-	int64_t i, total_tgt = 0, total_sub = 0;
-	pos_sa_pair_t *all_tgt, *all_sub, *out;
-
-	/* Sort targets for binary search */
-	qsort(targets, n_targets, sizeof(int64_t), cmp_int64);
-
-	mt.f = f;
-	mt.targets = targets;
-	mt.n_targets = n_targets;
-	mt.s = s;
-	mt.total_n = f->acc[RB3_ASIZE];
-	mt.n_sent = n_sent;
-	mt.per_sent_tgt = RB3_CALLOC(pos_sa_pair_t*, n_sent);
-	mt.per_sent_tgt_n = RB3_CALLOC(int64_t, n_sent);
-	mt.per_sent_sub = RB3_CALLOC(pos_sa_pair_t*, n_sent);
-	mt.per_sent_sub_n = RB3_CALLOC(int64_t, n_sent);
-	mt.walk_dist = RB3_CALLOC(int64_t, n_sent);
-	mt.dest_sent = RB3_CALLOC(int64_t, n_sent);
-
-	kt_for(n_threads, sa_worker_func, &mt, n_sent);
-
-	/* Compute multi-string corrections.
-	 * For multi-string BWTs, each sentinel walk produces per-sequence SA offsets.
-	 * We need to convert these to absolute text positions by adding a correction
-	 * equal to the cumulative length of preceding sequences.
-	 * In a multi-string BWT, dest_sent[k] == k (self-loops) because each string
-	 * is independent, so we use sequential sentinel order for corrections. */
-	{
-		int64_t *correction = RB3_CALLOC(int64_t, n_sent);
-		if (n_sent > 1) {
-			int64_t cum = 0;
-			for (i = 0; i < n_sent; ++i) {
-				correction[i] = cum;
-				cum += mt.walk_dist[i];
-			}
-		}
-		/* Apply corrections to target pairs */
-		for (i = 0; i < n_sent; ++i) {
-			int64_t j, corr = correction[i];
-			for (j = 0; j < mt.per_sent_tgt_n[i]; ++j)
-				mt.per_sent_tgt[i][j].sa_val += corr;
-			for (j = 0; j < mt.per_sent_sub_n[i]; ++j)
-				mt.per_sent_sub[i][j].sa_val += corr;
+	uint64_t b = (uint64_t)i * w, s = b & 63, j = b >> 6;
+	a[j] |= v << s;
+	if (s + w > 64) a[j+1] |= v >> (64 - s);
+}
+
+static int32_t sr_bit_width(int64_t max) /* bits to hold 0..max, at least 1 */
+{
+	int32_t w = 1;
+	while (w < 63 && max >> w) ++w;
+	return w;
+}
+
+/* Pack a[0..n) plus add at w bits per entry */
+static uint64_t *sr_pack(const int64_t *a, int64_t n, int32_t w, int64_t add)
+{
+	int64_t i;
+	uint64_t *p = RB3_CALLOC(uint64_t, sr_n_words(n, w));
+	for (i = 0; i < n; ++i)
+		sr_bits_set(p, w, i, (uint64_t)(a[i] + add));
+	return p;
+}
+
+/* Position of the k-th (0-based) set bit of x. Without BMI2, the byte holding
+ * it is found from the byte-wise prefix popcounts without branching. */
+static inline int sr_select64(uint64_t x, int64_t k)
+{
+#ifdef __BMI2__
+	return __builtin_ctzll(__builtin_ia32_pdep_di(1ULL << k, x));
+#else
+	const uint64_t ones = 0x0101010101010101ULL, msb = 0x8080808080808080ULL;
+	uint64_t s, b, y;
+	s = x - (x >> 1 & 0x5555555555555555ULL);
+	s = (s & 0x3333333333333333ULL) + (s >> 2 & 0x3333333333333333ULL);
+	s = ((s + (s >> 4)) & 0x0F0F0F0F0F0F0F0FULL) * ones; /* byte j: popcount of bytes 0..j */
+	b = sr_popcount((((uint64_t)k * ones | msb) - s) & msb) << 3; /* bytes with prefix <= k, times 8 */
+	k -= (s << 8) >> b & 0xff;
+	y = x >> b & 0xff;
+	for (; k > 0; --k) y &= y - 1; /* at most 7 iterations */
+	return b + __builtin_ctzll(y);
+#endif
+}
+
+/* Position of the k-th (0-based) one in a[], or of the k-th zero if inv is ~0 */
+static inline int64_t ef_select(const uint64_t *a, const int64_t *smp, int64_t k, uint64_t inv)
+{
+	int64_t p = smp[k >> RB3_EF_SEL_SHIFT], j = p >> 6, c;
+	uint64_t x = (a[j] ^ inv) & ~0ULL << (p & 63);
+	k &= (1LL << RB3_EF_SEL_SHIFT) - 1;
+	while ((c = sr_popcount(x)) <= k)
+		k -= c, x = a[++j] ^ inv;
+	return j << 6 | sr_select64(x, k);
+}
+
+void rb3_ef_build(rb3_ef_t *ef, const int64_t *a, int64_t n, const int64_t *v, int32_t vw)
+{
+	int64_t i, n0 = 0, n1 = 0;
+	memset(ef, 0, sizeof(*ef));
+	ef->n = n, ef->u = n > 0? a[n-1] + 1 : 1;
+	for (ef->lw = 1; n > 0 && ef->lw < 62 && ef->u >> (ef->lw + 1) >= n; ++ef->lw) {}
+	ef->vw = v? vw : 0;
+	assert(ef->lw + ef->vw <= 64);
+	ef->n_hi = n + (ef->u >> ef->lw) + 1;
+	ef->lo = RB3_CALLOC(uint64_t, sr_n_words(n, ef->lw + ef->vw));
+	ef->hi = RB3_CALLOC(uint64_t, sr_n_words(ef->n_hi, 1));
+	ef->s1 = RB3_CALLOC(int64_t, (n >> RB3_EF_SEL_SHIFT) + 1);
+	ef->s0 = RB3_CALLOC(int64_t, ((ef->n_hi - n) >> RB3_EF_SEL_SHIFT) + 1);
+	for (i = 0; i < n; ++i) {
+		int64_t p = (a[i] >> ef->lw) + i;
+		uint64_t x = a[i] & ((1ULL << ef->lw) - 1);
+		ef->hi[p >> 6] |= 1ULL << (p & 63);
+		if (ef->vw) x |= (uint64_t)v[i] << ef->lw;
+		sr_bits_set(ef->lo, ef->lw + ef->vw, i, x);
+	}
+	for (i = 0; i < ef->n_hi; ++i) {
+		if (ef->hi[i >> 6] >> (i & 63) & 1) {
+			if ((n1 & ((1LL << RB3_EF_SEL_SHIFT) - 1)) == 0) ef->s1[n1 >> RB3_EF_SEL_SHIFT] = i;
+			++n1;
+		} else {
+			if ((n0 & ((1LL << RB3_EF_SEL_SHIFT) - 1)) == 0) ef->s0[n0 >> RB3_EF_SEL_SHIFT] = i;
+			++n0;
 		}
-		free(correction);
 	}
+}
 
-	/* Merge target results */
-	for (i = 0; i < n_sent; ++i)
-		total_tgt += mt.per_sent_tgt_n[i];
+void rb3_ef_destroy(rb3_ef_t *ef)
+{
+	free(ef->lo); free(ef->hi); free(ef->s1); free(ef->s0);
+}
 
-	all_tgt = RB3_MALLOC(pos_sa_pair_t, total_tgt > 0 ? total_tgt : 1);
-	out = all_tgt;
-	for (i = 0; i < n_sent; ++i) {
-		if (mt.per_sent_tgt_n[i] > 0)
-			memcpy(out, mt.per_sent_tgt[i], mt.per_sent_tgt_n[i] * sizeof(pos_sa_pair_t));
-		out += mt.per_sent_tgt_n[i];
-		free(mt.per_sent_tgt[i]);
-	}
-	qsort(all_tgt, total_tgt, sizeof(pos_sa_pair_t), cmp_pos_sa);
+static inline uint64_t ef_low(const rb3_ef_t *ef, int64_t i)
+{
+	return rb3_bits_get(ef->lo, ef->lw + ef->vw, i) & ((1ULL << ef->lw) - 1);
+}
 
-	/* Merge subsampled results */
-	if (s > 1) {
-		for (i = 0; i < n_sent; ++i)
-			total_sub += mt.per_sent_sub_n[i];
-		all_sub = RB3_MALLOC(pos_sa_pair_t, total_sub > 0 ? total_sub : 1);
-		out = all_sub;
-		for (i = 0; i < n_sent; ++i) {
-			if (mt.per_sent_sub_n[i] > 0)
-				memcpy(out, mt.per_sent_sub[i], mt.per_sent_sub_n[i] * sizeof(pos_sa_pair_t));
-			out += mt.per_sent_sub_n[i];
-			free(mt.per_sent_sub[i]);
+static inline int64_t ef_val(const rb3_ef_t *ef, int64_t i)
+{
+	return rb3_bits_get(ef->lo, ef->lw + ef->vw, i) >> ef->lw;
+}
+
+int64_t rb3_ef_val(const rb3_ef_t *ef, int64_t i)
+{
+	return ef_val(ef, i);
+}
+
+int64_t rb3_ef_get(const rb3_ef_t *ef, int64_t i)
+{
+	int64_t p = ef_select(ef->hi, ef->s1, i, 0);
+	return (p - i) << ef->lw | ef_low(ef, i);
+}
+
+/* Hint a future rb3_ef_pred() of x; stage 0 for the select sample and 1 for the bucket */
+static inline void ef_prefetch(const rb3_ef_t *ef, int64_t x, int stage)
+{
+	int64_t h;
+	if (x < 0 || x >= ef->u) return;
+	h = x >> ef->lw;
+	if (stage == 0) __builtin_prefetch(&ef->s0[h >> RB3_EF_SEL_SHIFT]);
+	else __builtin_prefetch(&ef->hi[(ef->s0[h >> RB3_EF_SEL_SHIFT] >> 6) + (h & ((1 << RB3_EF_SEL_SHIFT) - 1)) / 32]);
+}
+
+/* Predecessor of x given p, the position of the last one of bucket x>>lw in hi[] or the zero before it */
+static int64_t ef_pred_at(const rb3_ef_t *ef, int64_t x, int64_t p, int64_t *v)
+{
+	int64_t h = x >> ef->lw, i, j;
+	uint64_t xl = x & ((1ULL << ef->lw) - 1), w;
+	for (i = p - h; i >= 0 && (ef->hi[p >> 6] >> (p & 63) & 1); --i, --p) { /* entries in bucket h, backward */
+		uint64_t l = ef_low(ef, i);
+		if (l <= xl) {
+			*v = h << ef->lw | l;
+			return i;
 		}
-		qsort(all_sub, total_sub, sizeof(pos_sa_pair_t), cmp_pos_sa);
-	} else {
-		all_sub = 0;
-		for (i = 0; i < n_sent; ++i)
-			free(mt.per_sent_sub[i]);
 	}
+	if (i < 0) return -1;
+	/* a[i] is in an earlier bucket: find the last one at or before p */
+	for (j = p >> 6, w = ef->hi[j] & ~0ULL >> (63 - (p & 63)); w == 0; w = ef->hi[--j]) {}
+	p = j << 6 | (63 - __builtin_clzll(w));
+	*v = (p - i) << ef->lw | ef_low(ef, i);
+	return i;
+}
 
-	free(mt.per_sent_tgt);
-	free(mt.per_sent_tgt_n);
-	free(mt.per_sent_sub);
-	free(mt.per_sent_sub_n);
+static inline int64_t ef_bucket_end(const rb3_ef_t *ef, int64_t x) /* 0 <= x < u */
+{
+	return ef_select(ef->hi, ef->s0, x >> ef->lw, ~0ULL) - 1; /* the ones of bucket h end before zero h */
+}
+
+int64_t rb3_ef_pred(const rb3_ef_t *ef, int64_t x, int64_t *v)
+{
+	if (ef->n == 0 || x < 0) return -1;
+	if (x >= ef->u) {
+		*v = rb3_ef_get(ef, ef->n - 1);
+		return ef->n - 1;
+	}
+	return ef_pred_at(ef, x, ef_bucket_end(ef, x), v);
+}
 
-	*n_results = total_tgt;
-	*sub_results_out = all_sub;
-	*n_sub_out = total_sub;
-	*walk_dist_out = mt.walk_dist;
-	*dest_sent_out = mt.dest_sent;
-	return all_tgt;
+/* Decode an Elias-Fano coded array */
+static int64_t *ef_decode(const rb3_ef_t *ef)
+{
+	int64_t i, p, *a = RB3_MALLOC(int64_t, ef->n > 0? ef->n : 1);
+	for (i = p = 0; i < ef->n; ++i, ++p) {
+		while (!(ef->hi[p >> 6] >> (p & 63) & 1)) ++p;
+		a[i] = (p - i) << ef->lw | ef_low(ef, i);
+	}
+	return a;
 }
 
 /***************************
@@ -366,12 +582,12 @@ static int cmp_pos_sa_by_sa(const void *a, const void *b)
 static void build_phi(rb3_srindex_t *sr, const run_bounds_t *rb,
                       const pos_sa_pair_t *sa_pairs, int64_t n_pairs)
 {
-	int64_t i;
+	int64_t i, *phi_sa, *phi_da;
 	pos_sa_pair_t *start_pairs;
 
 	sr->n_runs = rb->n;
-	sr->phi_sa = RB3_MALLOC(int64_t, rb->n);
-	sr->phi_da = RB3_MALLOC(int64_t, rb->n);
+	phi_sa = RB3_MALLOC(int64_t, rb->n);
+	phi_da = RB3_MALLOC(int64_t, rb->n);
 
 	/* For each run start, look up SA value */
 	start_pairs = RB3_MALLOC(pos_sa_pair_t, rb->n);
@@ -390,10 +606,10 @@ static void build_phi(rb3_srindex_t *sr, const run_bounds_t *rb,
 	/* Collect (SA_at_start, SA_at_prev_position) pairs */
 	for (i = 0; i < rb->n; ++i) {
 		int64_t prev_pos;
-		sr->phi_sa[i] = start_pairs[i].sa_val;
+		phi_sa[i] = start_pairs[i].sa_val;
 
 		if (rb->bwt_start[i] == 0) {
-			sr->phi_da[i] = -1;
+			phi_da[i] = -1;
 			continue;
 		}
 
@@ -406,26 +622,29 @@ static void build_phi(rb3_srindex_t *sr, const run_bounds_t *rb,
 				else hi = mid;
 			}
 			assert(lo < n_pairs && sa_pairs[lo].bwt_pos == prev_pos);
-			sr->phi_da[i] = sa_pairs[lo].sa_val;
+			phi_da[i] = sa_pairs[lo].sa_val;
 		}
 	}
 
 	free(start_pairs);
 
-	/* Sort phi_sa[] and phi_da[] together by phi_sa value for binary search */
+	/* Sort phi_sa[] and phi_da[] together by phi_sa value for predecessor queries */
 	{
 		pos_sa_pair_t *tmp = RB3_MALLOC(pos_sa_pair_t, rb->n);
 		for (i = 0; i < rb->n; ++i) {
-			tmp[i].bwt_pos = sr->phi_da[i]; /* reuse bwt_pos field for phi_da */
-			tmp[i].sa_val = sr->phi_sa[i];
+			tmp[i].bwt_pos = phi_da[i]; /* reuse bwt_pos field for phi_da */
+			tmp[i].sa_val = phi_sa[i];
 		}
 		qsort(tmp, rb->n, sizeof(pos_sa_pair_t), cmp_pos_sa_by_sa);
 		for (i = 0; i < rb->n; ++i) {
-			sr->phi_sa[i] = tmp[i].sa_val;
-			sr->phi_da[i] = tmp[i].bwt_pos;
+			phi_sa[i] = tmp[i].sa_val;
+			phi_da[i] = tmp[i].bwt_pos;
 		}
 		free(tmp);
 	}
+	for (i = 0; i < rb->n; ++i) ++phi_da[i]; /* -1 at BWT position 0 */
+	rb3_ef_build(&sr->phi_sa, phi_sa, sr->n_runs, phi_da, sr->ws);
+	free(phi_sa); free(phi_da);
 }
 
 /***************************
@@ -435,10 +654,10 @@ static void build_phi(rb3_srindex_t *sr, const run_bounds_t *rb,
 static void build_toehold(rb3_srindex_t *sr, const run_bounds_t *rb,
                           const pos_sa_pair_t *sa_pairs, int64_t n_pairs)
 {
-	int64_t i;
+	int64_t i, *run_pos, *run_sa;
 
-	sr->run_pos = RB3_MALLOC(int64_t, rb->n);
-	sr->run_sa = RB3_MALLOC(int64_t, rb->n);
+	run_pos = RB3_MALLOC(int64_t, rb->n);
+	run_sa = RB3_MALLOC(int64_t, rb->n);
 	sr->n_samples = rb->n;
 
 	for (i = 0; i < rb->n; ++i) {
@@ -450,64 +669,92 @@ static void build_toehold(rb3_srindex_t *sr, const run_bounds_t *rb,
 			else hi = mid;
 		}
 		assert(lo < n_pairs && sa_pairs[lo].bwt_pos == target);
-		sr->run_pos[i] = target;
-		sr->run_sa[i] = sa_pairs[lo].sa_val;
+		run_pos[i] = target;
+		run_sa[i] = sa_pairs[lo].sa_val;
 	}
+	rb3_ef_build(&sr->run_pos, run_pos, rb->n, 0, 0);
+	sr->run_sa = sr_pack(run_sa, rb->n, sr->ws, 0);
+	free(run_pos); free(run_sa);
 }
 
 /***************************
  * Subsampled SA building  *
  ***************************/
 
-/* Build bitvector marking sub_pos positions for O(1) lookup in locate_one */
-static void build_sub_bitvector(rb3_srindex_t *sr)
+/* Rank directory of bv[0..n_words): the number of bits set in bv[0..8j) for each j */
+static int64_t *sr_bv_dir(const uint64_t *bv, int64_t n_words)
+{
+	int64_t i, r, *dir = RB3_MALLOC(int64_t, (n_words >> 3) + 1);
+	for (i = 0, r = 0; i < n_words; ++i) {
+		if ((i & 7) == 0) dir[i >> 3] = r;
+		r += sr_popcount(bv[i]);
+	}
+	return dir;
+}
+
+/* Number of bits set in bv before position p */
+static inline int64_t sr_bv_rank(const uint64_t *bv, const int64_t *dir, int64_t p)
+{
+	int64_t j = p >> 6, k, r = dir[p >> 9];
+	for (k = j & ~7LL; k < j; ++k) r += sr_popcount(bv[k]);
+	return r + sr_popcount(bv[j] & ((1ULL << (p & 63)) - 1));
+}
+
+/* Build the bitvector marking sampled positions and its rank directory */
+static void build_sub_bitvector(rb3_srindex_t *sr, const int64_t *sub_pos)
 {
 	int64_t i, n_words = (sr->n + 63) / 64;
 	sr->sub_bv = RB3_CALLOC(uint64_t, n_words > 0 ? n_words : 1);
 	for (i = 0; i < sr->n_sub; ++i) {
-		int64_t p = sr->sub_pos[i];
+		int64_t p = sub_pos[i];
 		if (p >= 0 && p < sr->n)
 			sr->sub_bv[p >> 6] |= 1ULL << (p & 63);
 	}
+	sr->sub_rank = sr_bv_dir(sr->sub_bv, n_words);
+}
+
+/* Number of sampled positions before BWT position p */
+static inline int64_t sr_sub_rank(const rb3_srindex_t *sr, int64_t p)
+{
+	return sr_bv_rank(sr->sub_bv, sr->sub_rank, p);
 }
 
+/* Set up the subsampled SA; sub_pos[] and sub_sa[] are freed */
 static void build_subsampled(rb3_srindex_t *sr, int32_t s,
-                             const pos_sa_pair_t *sub_pairs, int64_t n_sub)
+                             int64_t *sub_pos, int64_t *sub_sa, int64_t n_sub)
 {
-	int64_t i;
 	if (s <= 1) {
 		/* For s=1, alias run boundary samples (no copy needed) */
 		sr->n_sub = sr->n_samples;
-		sr->sub_pos = sr->run_pos;
 		sr->sub_sa = sr->run_sa;
 		sr->sub_is_alias = 1;
+		free(sub_pos);
+		sub_pos = ef_decode(&sr->run_pos);
 	} else {
 		sr->n_sub = n_sub;
-		sr->sub_pos = RB3_MALLOC(int64_t, n_sub > 0 ? n_sub : 1);
-		sr->sub_sa = RB3_MALLOC(int64_t, n_sub > 0 ? n_sub : 1);
-		for (i = 0; i < n_sub; ++i) {
-			sr->sub_pos[i] = sub_pairs[i].bwt_pos;
-			sr->sub_sa[i] = sub_pairs[i].sa_val;
-		}
+		sr->sub_sa = sr_pack(sub_sa, n_sub, sr->ws, 0);
 		sr->sub_is_alias = 0;
 	}
-	build_sub_bitvector(sr);
+	build_sub_bitvector(sr, sub_pos);
+	free(sub_pos); free(sub_sa);
 }
 
 /***************************
  * Public API              *
  ***************************/
 
-rb3_srindex_t *rb3_srindex_build(const void *f_, int32_t s, int n_threads)
+rb3_srindex_t *rb3_srindex_build2(const void *f_, int32_t s, int n_threads, int64_t max_mem)
 {
 	const rb3_fmi_t *f = (const rb3_fmi_t*)f_;
 	rb3_srindex_t *sr;
 	run_bounds_t *rb;
-	int64_t *targets, n_targets, n_pairs, n_sub, i;
-	int64_t *walk_dist, *dest_sent;
-	pos_sa_pair_t *sa_pairs, *sub_pairs;
+	int64_t n_pairs, n_sub = 0, i, m = f->acc[1], *end, *sub_pos = 0, *sub_sa = 0;
+	uint64_t *tgt_bv;
+	pos_sa_pair_t *sa_pairs;
+	sa_mt_t mt;
 
 	if (s < 1) s = 1;
+	if (n_threads < 1) n_threads = 1;
 	if (f->e == 0 && f->r == 0) return 0;
 
 	/* Step 1: Scan BWT to find run boundaries */
@@ -520,31 +767,67 @@ rb3_srindex_t *rb3_srindex_build(const void *f_, int32_t s, int n_threads)
 	if (rb3_verbose >= 3)
 		fprintf(stderr, "[M::%s] found %lld BWT runs, s=%d\n", __func__, (long long)rb->n, s);
 
-	/* Step 2: Collect target BWT positions (run starts + ends) */
-	n_targets = 0;
-	targets = RB3_MALLOC(int64_t, rb->n * 2);
+	/* Step 2: Mark target BWT positions (run starts + ends) */
+	tgt_bv = RB3_CALLOC(uint64_t, (f->acc[RB3_ASIZE] + 63) / 64 + 1);
 	for (i = 0; i < rb->n; ++i) {
-		targets[n_targets++] = rb->bwt_start[i];
-		targets[n_targets++] = rb->bwt_end[i];
-	}
-	/* Deduplicate */
-	qsort(targets, n_targets, sizeof(int64_t), cmp_int64);
-	{
-		int64_t j = 0;
-		for (i = 0; i < n_targets; ++i)
-			if (i == 0 || targets[i] != targets[i-1])
-				targets[j++] = targets[i];
-		n_targets = j;
+		tgt_bv[rb->bwt_start[i] >> 6] |= 1ULL << (rb->bwt_start[i] & 63);
+		tgt_bv[rb->bwt_end[i] >> 6] |= 1ULL << (rb->bwt_end[i] & 63);
 	}
 
 	if (rb3_verbose >= 3)
-		fprintf(stderr, "[M::%s] computing SA at %lld BWT positions\n", __func__, (long long)n_targets);
-
-	/* Step 3: Compute SA values at targets + collect subsampled positions */
-	sa_pairs = compute_sa_at_positions(f, targets, n_targets, s, n_threads,
-	                                   &n_pairs, &sub_pairs, &n_sub,
-	                                   &walk_dist, &dest_sent);
-	free(targets);
+		fprintf(stderr, "[M::%s] computing SA at the boundaries of %lld runs\n", __func__, (long long)rb->n);
+
+	/* Step 3: Walk from all sentinels, collecting samples at targets and subsamples */
+	memset(&mt, 0, sizeof(mt));
+	mt.f = f, mt.tgt_bv = tgt_bv, mt.s = s, mt.n_sent = m;
+	mt.batch = (m + n_threads - 1) / n_threads;
+	if (mt.batch > SA_WALK_BATCH) mt.batch = SA_WALK_BATCH;
+	if (mt.batch < 1) mt.batch = 1;
+	mt.tgt = sa_store_init(n_threads, max_mem / 2);
+	mt.sub = sa_store_init(n_threads, max_mem / 2);
+	mt.walk_dist = RB3_CALLOC(int64_t, m > 0? m : 1);
+	kt_for(n_threads, sa_worker_func, &mt, (m + mt.batch - 1) / mt.batch);
+	free(tgt_bv);
+
+	/* Step 4: Build multi-string mapping (seq_st and text_order_sid).
+	 * In a multi-string BWT, dest_sent[k] == k (self-loops) because each
+	 * string is independent. We use sequential sentinel order: sentinel k
+	 * maps to text_order_sid[k] = k, and seq_st[k] = sum of walk_dist[0..k-1]. */
+	sr = RB3_CALLOC(rb3_srindex_t, 1);
+	sr->n = f->acc[RB3_ASIZE];
+	sr->s = s;
+	sr->ws = sr_bit_width(sr->n);
+	sr->m = m;
+	sr->text_order_sid = RB3_MALLOC(int64_t, m > 0 ? m : 1);
+	end = RB3_MALLOC(int64_t, m > 0 ? m : 1);
+	{
+		int64_t cum = 0, len;
+		for (i = 0; i < m; ++i) {
+			sr->text_order_sid[i] = i;
+			len = mt.walk_dist[i];
+			mt.walk_dist[i] = cum; /* reused for the start of sequence i */
+			cum += len;
+			end[i] = cum - 1; /* SA = end[i] - d for a sample d steps from sentinel i */
+		}
+	}
+	rb3_ef_build(&sr->seq_st, mt.walk_dist, m, 0, 0);
+	free(mt.walk_dist);
+
+	/* Step 5: Merge the samples in BWT order */
+	n_pairs = sa_store_size(mt.tgt);
+	sa_pairs = RB3_MALLOC(pos_sa_pair_t, n_pairs > 0 ? n_pairs : 1);
+	sa_store_merge(mt.tgt, end, &sa_pairs[0].bwt_pos, &sa_pairs[0].sa_val, 2);
+	if (rb3_verbose >= 3 && mt.tgt->n_run + mt.sub->n_run > 0)
+		fprintf(stderr, "[M::%s] spilled %lld runs to disk\n", __func__, (long long)(mt.tgt->n_run + mt.sub->n_run));
+	sa_store_destroy(mt.tgt);
+	if (s > 1) {
+		n_sub = sa_store_size(mt.sub);
+		sub_pos = RB3_MALLOC(int64_t, n_sub > 0 ? n_sub : 1);
+		sub_sa = RB3_MALLOC(int64_t, n_sub > 0 ? n_sub : 1);
+		sa_store_merge(mt.sub, end, sub_pos, sub_sa, 1);
+	}
+	sa_store_destroy(mt.sub);
+	free(end);
 
 	if (rb3_verbose >= 3) {
 		fprintf(stderr, "[M::%s] computed %lld SA values", __func__, (long long)n_pairs);
@@ -553,89 +836,424 @@ rb3_srindex_t *rb3_srindex_build(const void *f_, int32_t s, int n_threads)
 		fprintf(stderr, "\n");
 	}
 
-	/* Step 4: Build the SR-index */
-	sr = RB3_CALLOC(rb3_srindex_t, 1);
-	sr->n = f->acc[RB3_ASIZE];
-	sr->s = s;
-	sr->m = f->acc[1];
-
+	/* Step 6: Build the SR-index */
 	build_phi(sr, rb, sa_pairs, n_pairs);
 	build_toehold(sr, rb, sa_pairs, n_pairs);
-	build_subsampled(sr, s, sub_pairs, n_sub);
+	build_subsampled(sr, s, sub_pos, sub_sa, n_sub);
 
-	/* Step 5: Build multi-string mapping (cum_len and text_order_sid).
-	 * In a multi-string BWT, dest_sent[k] == k (self-loops) because each
-	 * string is independent. We use sequential sentinel order: sentinel k
-	 * maps to text_order_sid[k] = k, and cum_len[k] = sum of walk_dist[0..k-1]. */
-	{
-		int64_t m = sr->m, cum = 0;
-		sr->cum_len = RB3_MALLOC(int64_t, m + 1);
-		sr->text_order_sid = RB3_MALLOC(int64_t, m > 0 ? m : 1);
-		for (i = 0; i < m; ++i) {
-			sr->text_order_sid[i] = i;
-			sr->cum_len[i] = cum;
-			cum += walk_dist[i];
+	free(sa_pairs);
+	run_bounds_destroy(rb);
+	return sr;
+}
+
+rb3_srindex_t *rb3_srindex_build(const void *f, int32_t s, int n_threads)
+{
+	return rb3_srindex_build2(f, s, n_threads, RB3_SRI_MAX_MEM);
+}
+
+/***************************
+ * Incremental update      *
+ ***************************/
+
+/*
+ * Update an SR-index after sequences are appended with "build -i" or merged.
+ * The merged BWT interleaves the old rows, in their old order, with the rows
+ * of the new sequences; this is what rb3_mg_rank() computes during a merge.
+ * The rank arrays of the merge are not kept, but walking the new sequences in
+ * the merged index visits exactly the new rows, so the interleave is recovered
+ * together with the samples of the new sequences. Old row i then becomes the
+ * i-th row not visited. The old sequences keep their IDs and text positions,
+ * as the new ones are appended after them.
+ *
+ * A run boundary of the merged BWT at an old row was either a boundary of
+ * the old BWT, where SA is known from run_sa[] at a run end or from phi at a
+ * run start, or it is next to inserted rows. Only the latter need an LF walk,
+ * to the nearest known sample at most s steps away. The cost is the walks of
+ * the new sequences and of the new boundaries plus a few scans of n/64 words,
+ * instead of n LF steps.
+ */
+
+/* Map sorted BWT positions of the old index to the merged one: old position x
+ * becomes the x-th position whose bit is unset in new_bv */
+static void sr_remap(const uint64_t *new_bv, pos_sa_pair_t *a, int64_t n)
+{
+	int64_t i, w = 0, z = 0, zw = 64 - sr_popcount(new_bv[0]);
+	for (i = 0; i < n; ++i) {
+		int64_t x = a[i].bwt_pos;
+		while (z + zw <= x)
+			z += zw, zw = 64 - sr_popcount(new_bv[++w]);
+		a[i].bwt_pos = w << 6 | sr_select64(~new_bv[w], x - z);
+	}
+}
+
+/* Merge two arrays sorted by BWT position; a position in both is kept once */
+static pos_sa_pair_t *sr_merge_pairs(const pos_sa_pair_t *a, int64_t na, const pos_sa_pair_t *b, int64_t nb, int64_t *n)
+{
+	int64_t i = 0, j = 0, k = 0;
+	pos_sa_pair_t *c = RB3_MALLOC(pos_sa_pair_t, na + nb > 0? na + nb : 1);
+	while (i < na || j < nb) {
+		if (j == nb || (i < na && a[i].bwt_pos < b[j].bwt_pos)) c[k++] = a[i++];
+		else if (i == na || b[j].bwt_pos < a[i].bwt_pos) c[k++] = b[j++];
+		else c[k++] = a[i++], ++j;
+	}
+	*n = k;
+	return c;
+}
+
+/* SA values at the run boundaries of sr in BWT order: those at run ends are
+ * stored; phi at the start of run i+1 gives the SA value at the end of run i */
+static pos_sa_pair_t *sr_old_bounds(const rb3_srindex_t *sr, int64_t *n)
+{
+	int64_t i, k = 0, r = sr->n_samples, *end, *st_sa;
+	pos_sa_pair_t *by_sa, *a;
+	end = ef_decode(&sr->run_pos);
+	by_sa = RB3_MALLOC(pos_sa_pair_t, r > 0? r : 1);
+	st_sa = RB3_MALLOC(int64_t, r > 0? r : 1);
+	for (i = 0; i < r; ++i) {
+		by_sa[i].bwt_pos = i, by_sa[i].sa_val = rb3_bits_get(sr->run_sa, sr->ws, i);
+		st_sa[i] = -1;
+	}
+	qsort(by_sa, r, sizeof(pos_sa_pair_t), cmp_pos_sa_by_sa);
+	for (i = 0; i < sr->phi_sa.n; ++i) {
+		int64_t y = ef_val(&sr->phi_sa, i) - 1, lo = 0, hi = r;
+		if (y < 0) {
+			if (r > 0) st_sa[0] = rb3_ef_get(&sr->phi_sa, i);
+			continue;
+		}
+		while (lo < hi) {
+			int64_t mid = lo + (hi - lo) / 2;
+			if (by_sa[mid].sa_val < y) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo < r && by_sa[lo].sa_val == y && by_sa[lo].bwt_pos + 1 < r)
+			st_sa[by_sa[lo].bwt_pos + 1] = rb3_ef_get(&sr->phi_sa, i);
+	}
+	free(by_sa);
+	a = RB3_MALLOC(pos_sa_pair_t, 2 * r + 1);
+	for (i = 0; i < r; ++i) {
+		int64_t st = i? end[i-1] + 1 : 0;
+		if (st < end[i] && st_sa[i] >= 0)
+			a[k].bwt_pos = st, a[k++].sa_val = st_sa[i];
+		a[k].bwt_pos = end[i], a[k++].sa_val = rb3_bits_get(sr->run_sa, sr->ws, i);
+	}
+	free(end); free(st_sa);
+	*n = k;
+	return a;
+}
+
+/* Subsampled positions of sr with their SA values in BWT order */
+static pos_sa_pair_t *sr_old_subs(const rb3_srindex_t *sr)
+{
+	int64_t w, k = 0;
+	pos_sa_pair_t *a = RB3_MALLOC(pos_sa_pair_t, sr->n_sub > 0? sr->n_sub : 1);
+	for (w = 0; w < (sr->n + 63) >> 6; ++w) {
+		uint64_t x;
+		for (x = sr->sub_bv[w]; x; x &= x - 1, ++k)
+			a[k].bwt_pos = w << 6 | __builtin_ctzll(x), a[k].sa_val = rb3_bits_get(sr->sub_sa, sr->ws, k);
+	}
+	return a;
+}
+
+typedef struct {
+	const rb3_fmi_t *f;
+	const uint64_t *kn_bv; /* bit k set iff SA at BWT position k is known */
+	const int64_t *kn_dir, *kn_sa;
+	int64_t n;
+	int64_t *pos; /* in: BWT positions; out: SA values, or -1 if a sentinel is reached first */
+} sr_upd_t;
+
+/* Walk LF from pos[] until a known sample, advancing SA_WALK_BATCH walks in round-robin */
+static void sr_upd_worker(void *data, long b, int tid)
+{
+	sr_upd_t *u = (sr_upd_t*)data;
+	const rb3_fmi_t *f = u->f;
+	int64_t st = b * SA_WALK_BATCH, en = st + SA_WALK_BATCH, pos[SA_WALK_BATCH], d[SA_WALK_BATCH];
+	int32_t a, k, t, n_act, act[SA_WALK_BATCH];
+	if (en > u->n) en = u->n;
+	for (a = 0; a < en - st; ++a)
+		act[a] = a, pos[a] = u->pos[st + a], d[a] = 0;
+	for (n_act = en - st; n_act > 0; n_act = t) {
+		for (k = t = 0; k < n_act; ++k) {
+			int64_t p;
+			a = act[k], p = pos[a];
+			if (u->kn_bv[p >> 6] >> (p & 63) & 1)
+				u->pos[st + a] = u->kn_sa[sr_bv_rank(u->kn_bv, u->kn_dir, p)] + d[a];
+			else act[t++] = a;
+		}
+		n_act = t;
+		for (k = 0; k < n_act; ++k)
+			rb3_fmi_prefetch(f, pos[act[k]], 0);
+		for (k = 0; k < n_act; ++k)
+			rb3_fmi_prefetch(f, pos[act[k]], 1);
+		for (k = t = 0; k < n_act; ++k) {
+			int64_t ok[RB3_ASIZE];
+			int32_t c;
+			a = act[k];
+			c = rb3_fmi_rank1a(f, pos[a], ok);
+			pos[a] = f->acc[c] + ok[c];
+			d[a]++;
+			if (c) act[t++] = a;
+			else u->pos[st + a] = -1;
 		}
-		sr->cum_len[m] = cum;
 	}
+}
 
+rb3_srindex_t *rb3_srindex_update(const rb3_srindex_t *sr0, const void *f_, int n_threads, int64_t max_mem)
+{
+	const rb3_fmi_t *f = (const rb3_fmi_t*)f_;
+	rb3_srindex_t *sr = 0;
+	run_bounds_t *rb;
+	int64_t i, j, k, len, n = f->acc[RB3_ASIZE], m = f->acc[1], n_words = (n + 63) / 64;
+	int64_t n_kn, n_bd, n_sub = 0, n_a = 0, n_b, n_pairs, n_pend = 0, *st, *end, *kn_dir, *kn_sa;
+	uint64_t *tgt_bv, *new_bv, *kn_bv;
+	pos_sa_pair_t *bd, *kn, *sub = 0, *ta, *tb, *sa_pairs;
+	sa_mt_t mt;
+	sr_upd_t u;
+
+	if (n_threads < 1) n_threads = 1;
+	if ((f->e == 0 && f->r == 0) || m < sr0->m || n < sr0->n) return 0;
+
+	/* Step 1: run boundaries of the merged BWT, as in rb3_srindex_build2() */
+	rb = scan_bwt_runs(f);
+	if (rb == 0 || rb->n == 0) {
+		run_bounds_destroy(rb);
+		return 0;
+	}
+	tgt_bv = RB3_CALLOC(uint64_t, n_words + 1);
+	for (i = 0; i < rb->n; ++i) {
+		tgt_bv[rb->bwt_start[i] >> 6] |= 1ULL << (rb->bwt_start[i] & 63);
+		tgt_bv[rb->bwt_end[i] >> 6] |= 1ULL << (rb->bwt_end[i] & 63);
+	}
+
+	/* Step 2: walk the new sequences, marking the new positions */
+	new_bv = RB3_CALLOC(uint64_t, n_words + 1);
+	memset(&mt, 0, sizeof(mt));
+	mt.f = f, mt.tgt_bv = tgt_bv, mt.s = sr0->s, mt.sent0 = sr0->m, mt.n_sent = m, mt.new_bv = new_bv;
+	mt.batch = (m - sr0->m + n_threads - 1) / n_threads;
+	if (mt.batch > SA_WALK_BATCH) mt.batch = SA_WALK_BATCH;
+	if (mt.batch < 1) mt.batch = 1;
+	mt.tgt = sa_store_init(n_threads, max_mem / 2);
+	mt.sub = sa_store_init(n_threads, max_mem / 2);
+	mt.walk_dist = RB3_CALLOC(int64_t, m > 0? m : 1);
+	kt_for(n_threads, sa_worker_func, &mt, (m - sr0->m + mt.batch - 1) / mt.batch);
+	free(tgt_bv);
+	st = RB3_MALLOC(int64_t, m + 1);
+	end = RB3_MALLOC(int64_t, m > 0? m : 1);
+	for (i = 0; i < sr0->m; ++i)
+		st[i] = rb3_ef_get(&sr0->seq_st, i);
+	for (i = sr0->m, len = sr0->n; i < m; ++i)
+		st[i] = len, len += mt.walk_dist[i];
+	st[m] = len;
+	for (i = 0; i < m; ++i) end[i] = st[i + 1] - 1;
+	free(mt.walk_dist);
+	if (len != n) {
+		fprintf(stderr, "[E::%s] the first %lld sequences of the index are not those of the SR-index\n", __func__, (long long)sr0->m);
+		goto end_update;
+	}
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s] walked %lld new sequences of %lld positions; %lld BWT runs\n", __func__,
+				(long long)(m - sr0->m), (long long)(n - sr0->n), (long long)rb->n);
+
+	/* Step 3: move the old samples to their positions in the merged BWT */
+	bd = sr_old_bounds(sr0, &n_bd);
+	if (!sr0->sub_is_alias) {
+		n_sub = sr0->n_sub;
+		sub = sr_old_subs(sr0);
+	}
+	kn = sr_merge_pairs(bd, n_bd, sub, n_sub, &n_kn);
+	free(bd);
+	sr_remap(new_bv, kn, n_kn);
+	sr_remap(new_bv, sub, n_sub);
+	kn_bv = RB3_CALLOC(uint64_t, n_words + 1);
+	kn_sa = RB3_MALLOC(int64_t, n_kn > 0? n_kn : 1);
+	for (i = 0; i < n_kn; ++i) {
+		kn_bv[kn[i].bwt_pos >> 6] |= 1ULL << (kn[i].bwt_pos & 63);
+		kn_sa[i] = kn[i].sa_val;
+	}
+	free(kn);
+	kn_dir = sr_bv_dir(kn_bv, n_words);
+
+	/* Step 4: SA at the run boundaries at old positions; walk where unknown */
+	ta = RB3_MALLOC(pos_sa_pair_t, 2 * rb->n);
+	for (i = 0; i < rb->n; ++i) {
+		for (j = 0; j < 2; ++j) {
+			int64_t p = j? rb->bwt_end[i] : rb->bwt_start[i];
+			if (j && p == rb->bwt_start[i]) continue;
+			if (new_bv[p >> 6] >> (p & 63) & 1) continue;
+			ta[n_a].bwt_pos = p;
+			if (kn_bv[p >> 6] >> (p & 63) & 1)
+				ta[n_a++].sa_val = kn_sa[sr_bv_rank(kn_bv, kn_dir, p)];
+			else ta[n_a++].sa_val = -1, ++n_pend;
+		}
+	}
+	u.f = f, u.kn_bv = kn_bv, u.kn_dir = kn_dir, u.kn_sa = kn_sa, u.n = n_pend;
+	u.pos = RB3_MALLOC(int64_t, n_pend > 0? n_pend : 1);
+	for (i = k = 0; i < n_a; ++i)
+		if (ta[i].sa_val < 0) u.pos[k++] = ta[i].bwt_pos;
+	kt_for(n_threads, sr_upd_worker, &u, (n_pend + SA_WALK_BATCH - 1) / SA_WALK_BATCH);
+	for (i = k = 0; i < n_a; ++i)
+		if (ta[i].sa_val < 0 && (ta[i].sa_val = u.pos[k++]) < 0) break;
+	free(u.pos); free(kn_bv); free(kn_sa); free(kn_dir);
+	if (i < n_a) {
+		fprintf(stderr, "[E::%s] SA at BWT position %lld is not reachable from the samples; rebuild the SR-index\n", __func__, (long long)ta[i].bwt_pos);
+		free(ta); free(sub);
+		goto end_update;
+	}
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s] %lld run boundaries at old positions, %lld of which walked\n", __func__, (long long)n_a, (long long)n_pend);
+
+	/* Step 5: merge with the samples of the new sequences and build */
+	n_b = sa_store_size(mt.tgt);
+	tb = RB3_MALLOC(pos_sa_pair_t, n_b > 0? n_b : 1);
+	sa_store_merge(mt.tgt, end, &tb[0].bwt_pos, &tb[0].sa_val, 2);
+	sa_pairs = sr_merge_pairs(ta, n_a, tb, n_b, &n_pairs);
+	free(ta); free(tb);
+	sr = RB3_CALLOC(rb3_srindex_t, 1);
+	sr->n = n;
+	sr->s = sr0->s;
+	sr->ws = sr_bit_width(sr->n);
+	sr->m = m;
+	sr->text_order_sid = RB3_MALLOC(int64_t, m > 0 ? m : 1);
+	for (i = 0; i < m; ++i) sr->text_order_sid[i] = i;
+	rb3_ef_build(&sr->seq_st, st, m, 0, 0);
+	build_phi(sr, rb, sa_pairs, n_pairs);
+	build_toehold(sr, rb, sa_pairs, n_pairs);
 	free(sa_pairs);
-	free(sub_pairs);
-	free(walk_dist);
-	free(dest_sent);
-	run_bounds_destroy(rb);
+	{
+		int64_t *sub_pos = 0, *sub_sa = 0;
+		if (sr->s > 1) {
+			pos_sa_pair_t *sb, *all;
+			n_b = sa_store_size(mt.sub);
+			sb = RB3_MALLOC(pos_sa_pair_t, n_b > 0? n_b : 1);
+			sa_store_merge(mt.sub, end, &sb[0].bwt_pos, &sb[0].sa_val, 2);
+			all = sr_merge_pairs(sub, n_sub, sb, n_b, &n_sub);
+			sub_pos = RB3_MALLOC(int64_t, n_sub > 0? n_sub : 1);
+			sub_sa = RB3_MALLOC(int64_t, n_sub > 0? n_sub : 1);
+			for (i = 0; i < n_sub; ++i)
+				sub_pos[i] = all[i].bwt_pos, sub_sa[i] = all[i].sa_val;
+			free(sb); free(all);
+		}
+		build_subsampled(sr, sr->s, sub_pos, sub_sa, n_sub);
+	}
+	free(sub);
 
+end_update:
+	sa_store_destroy(mt.tgt);
+	sa_store_destroy(mt.sub);
+	free(st); free(end); free(new_bv);
+	run_bounds_destroy(rb);
 	return sr;
 }
 
 int64_t rb3_srindex_phi(const rb3_srindex_t *sr, int64_t sa_val)
 {
-	int64_t lo = 0, hi = sr->n_runs;
+	int64_t i, v;
 
 	if (sr == 0 || sr->n_runs == 0) return -1;
 
-	/* Binary search for the largest i such that phi_sa[i] <= sa_val */
-	while (lo < hi) {
-		int64_t mid = lo + (hi - lo) / 2;
-		if (sr->phi_sa[mid] <= sa_val) lo = mid + 1;
-		else hi = mid;
+	/* The largest i such that phi_sa[i] <= sa_val */
+	i = rb3_ef_pred(&sr->phi_sa, sa_val, &v);
+	if (i < 0) return -1;
+	return ef_val(&sr->phi_sa, i) - 1 + (sa_val - v);
+}
+
+/*
+ * A single phi query takes a few dependent cache misses: the select sample,
+ * the bucket in hi[] and the entry in lo[]. For independent queries, each of
+ * them is prefetched for all queries of a batch before the next is needed,
+ * in the same way as the rank blocks of interleaved LF walks.
+ */
+#define SR_PHI_BATCH 16
+
+/* Predecessors of x[0..m) for m <= SR_PHI_BATCH: k[i] = rb3_ef_pred(ef, x[i], &y[i]) */
+static void ef_pred_batch(const rb3_ef_t *ef, int64_t m, const int64_t *x, int64_t *k, int64_t *y)
+{
+	int64_t i, p[SR_PHI_BATCH];
+	for (i = 0; i < m; ++i)
+		ef_prefetch(ef, x[i], 0);
+	for (i = 0; i < m; ++i)
+		ef_prefetch(ef, x[i], 1);
+	for (i = 0; i < m; ++i) { /* locate the buckets and prefetch their last entries */
+		p[i] = x[i] >= 0 && x[i] < ef->u? ef_bucket_end(ef, x[i]) : -1;
+		if (p[i] >= 0) __builtin_prefetch(&ef->lo[(uint64_t)(p[i] - (x[i] >> ef->lw)) * (ef->lw + ef->vw) >> 6]);
 	}
-	if (lo == 0) return -1;
-	lo--;
+	for (i = 0; i < m; ++i)
+		k[i] = p[i] >= 0? ef_pred_at(ef, x[i], p[i], &y[i]) : rb3_ef_pred(ef, x[i], &y[i]);
+}
 
-	return sr->phi_da[lo] + (sa_val - sr->phi_sa[lo]);
+void rb3_srindex_phi_batch(const rb3_srindex_t *sr, int64_t n, const int64_t *v, int64_t *out)
+{
+	const rb3_ef_t *ef;
+	int64_t i, j, m, k[SR_PHI_BATCH], y[SR_PHI_BATCH];
+	if (sr == 0 || sr->n_runs == 0) {
+		for (i = 0; i < n; ++i) out[i] = -1;
+		return;
+	}
+	ef = &sr->phi_sa;
+	for (j = 0; j < n; j += SR_PHI_BATCH) {
+		const int64_t *x = &v[j];
+		m = n - j < SR_PHI_BATCH? n - j : SR_PHI_BATCH;
+		ef_pred_batch(ef, m, x, k, y);
+		for (i = 0; i < m; ++i)
+			out[j + i] = k[i] < 0? -1 : ef_val(ef, k[i]) - 1 + (x[i] - y[i]);
+	}
 }
 
 int64_t rb3_srindex_toehold(const rb3_srindex_t *sr, int64_t bwt_pos)
 {
-	int64_t lo = 0, hi;
+	int64_t i, v;
 
 	if (sr == 0 || sr->n_samples == 0) return -1;
-	hi = sr->n_samples;
+	i = rb3_ef_pred(&sr->run_pos, bwt_pos, &v);
+	if (i >= 0 && v == bwt_pos)
+		return rb3_bits_get(sr->run_sa, sr->ws, i);
+	return -1;
+}
 
-	while (lo < hi) {
-		int64_t mid = lo + (hi - lo) / 2;
-		if (sr->run_pos[mid] < bwt_pos) lo = mid + 1;
-		else hi = mid;
+/*
+ * Fill out[0..hi-lo) with SA[lo..hi), given th = SA[hi-1]. Successive phi
+ * steps depend on each other, but SA values at run ends are sampled, so each
+ * run end in [lo,hi-1) starts an independent chain that walks down to the
+ * next run end. Up to SR_PHI_BATCH chains advance together, so that the
+ * memory accesses of their phi steps overlap.
+ */
+static int64_t sr_phi_chains(const rb3_srindex_t *sr, int64_t lo, int64_t hi, int64_t th, int64_t *out)
+{
+	int64_t u, pu = -1, top, p[SR_PHI_BATCH], e[SR_PHI_BATCH], v[SR_PHI_BATCH];
+	int32_t k, t, n_act = 0;
+
+	if (hi <= lo) return 0;
+	out[hi - 1 - lo] = th;
+	top = hi - 1; /* the next chain starts at top, where the SA value is known */
+	u = sr->n_samples > 0? rb3_ef_pred(&sr->run_pos, hi - 2, &pu) : -1; /* the last run end below hi-1 */
+	for (;;) {
+		while (n_act < SR_PHI_BATCH && top >= lo) { /* start chains [end,top] */
+			int64_t end = lo, next = lo - 1;
+			if (u >= 0 && pu >= lo) {
+				end = pu + 1, next = pu;
+				out[pu - lo] = rb3_bits_get(sr->run_sa, sr->ws, u);
+				if (--u >= 0) pu = rb3_ef_get(&sr->run_pos, u);
+			}
+			if (top > end)
+				p[n_act] = top, e[n_act] = end, v[n_act++] = out[top - lo];
+			top = next;
+		}
+		if (n_act == 0) break;
+		rb3_srindex_phi_batch(sr, n_act, v, v);
+		for (k = t = 0; k < n_act; ++k) {
+			if (v[k] < 0) return -1;
+			out[--p[k] - lo] = v[k];
+			if (p[k] > e[k]) p[t] = p[k], e[t] = e[k], v[t++] = v[k];
+		}
+		n_act = t;
 	}
-	if (lo < sr->n_samples && sr->run_pos[lo] == bwt_pos)
-		return sr->run_sa[lo];
-	return -1;
+	return hi - lo;
 }
 
 int64_t rb3_srindex_locate(const rb3_srindex_t *sr, int64_t lo, int64_t hi,
                            int64_t toehold_sa, int64_t *out)
 {
-	int64_t i, n = hi - lo;
-
-	if (n <= 0) return 0;
-
-	out[n - 1] = toehold_sa;
-	for (i = n - 2; i >= 0; --i) {
-		out[i] = rb3_srindex_phi(sr, out[i + 1]);
-		if (out[i] < 0) return -1;
-	}
-	return n;
+	return sr_phi_chains(sr, lo, hi, toehold_sa, out);
 }
 
 int64_t rb3_srindex_locate_one(const rb3_srindex_t *sr, const void *f_, int64_t bwt_pos)
@@ -651,82 +1269,86 @@ int64_t rb3_srindex_locate_one(const rb3_srindex_t *sr, const void *f_, int64_t
 	 * SA[LF(pos)] = SA[pos] - 1, so after j steps SA = SA[bwt_pos] - j.
 	 * We stop when we find a stored sample. Return: stored_sa + steps. */
 	while (steps <= sr->s + sr->n) { /* safety bound */
-		/* O(1) bitvector test + O(log n_sub) binary search only on hit */
+		/* O(1) bitvector test; the rank of a sampled position indexes sub_sa */
 		if (sr->sub_bv && pos >= 0 && pos < sr->n &&
-		    (sr->sub_bv[pos >> 6] & (1ULL << (pos & 63)))) {
-			/* Confirmed in bitvector; binary search for exact SA value */
-			int64_t lo = 0, hi = sr->n_sub;
-			while (lo < hi) {
-				int64_t mid = lo + (hi - lo) / 2;
-				if (sr->sub_pos[mid] < pos) lo = mid + 1;
-				else hi = mid;
-			}
-			if (lo < sr->n_sub && sr->sub_pos[lo] == pos)
-				return sr->sub_sa[lo] + steps;
-		}
+		    (sr->sub_bv[pos >> 6] & (1ULL << (pos & 63))))
+			return rb3_bits_get(sr->sub_sa, sr->ws, sr_sub_rank(sr, pos)) + steps;
 
 		/* LF step */
 		c = rb3_fmi_rank1a(f, pos, ok);
-		pos = f->acc[c] + ok[c];
-		steps++;
-		if (c == 0) {
-			if (sr->cum_len && pos < sr->m)
-				return sr->cum_len[pos] + (steps - 1);
+		if (c == 0) { /* pos is the start of a sequence; each sentinel is a run of its own, sampled as a toehold */
+			int64_t sa = rb3_srindex_toehold(sr, pos);
+			if (sa >= 0) return sa + steps;
 			break;
 		}
+		pos = f->acc[c] + ok[c];
+		steps++;
 	}
 	return -1;
 }
 
-int64_t rb3_srindex_locate_all(const rb3_srindex_t *sr, const void *f_,
-                               int64_t lo, int64_t hi, int64_t *positions, int64_t max_pos)
+/* Resolve SA[hi-1]. Re-running the backward search with toehold tracking is
+ * not used here: it costs a rank and two Elias-Fano predecessors per symbol,
+ * which is more than an LF walk to a subsampled sample even for large s. */
+static int64_t sr_resolve_toehold(const rb3_srindex_t *sr, const void *f_, int64_t hi)
 {
-	int64_t n, i, toehold_sa;
+	int64_t th;
+	th = rb3_srindex_toehold(sr, hi - 1);
+	if (th >= 0) return th;
+	return rb3_srindex_locate_one(sr, f_, hi - 1);
+}
+
+static int64_t sr_locate(const rb3_srindex_t *sr, const void *f_, int64_t lo, int64_t hi, int64_t *positions, int64_t max_pos)
+{
+	int64_t n, toehold_sa;
 
 	if (sr == 0) return -1;
 	n = hi - lo;
 	if (n <= 0) return 0;
 	if (n > max_pos) n = max_pos;
 
-	/* Resolve toehold SA[hi-1]:
-	 * First try direct toehold lookup (works if hi-1 is at a run boundary) */
-	toehold_sa = rb3_srindex_toehold(sr, hi - 1);
-	if (toehold_sa < 0) {
-		/* hi-1 is not at a run boundary; use LF walking */
-		toehold_sa = rb3_srindex_locate_one(sr, f_, hi - 1);
-	}
+	toehold_sa = sr_resolve_toehold(sr, f_, hi);
 	if (toehold_sa < 0) return -1;
 
-	/* Enumerate using phi: SA[hi-1], SA[hi-2], ..., SA[lo] */
-	positions[n - 1] = toehold_sa;
-	for (i = n - 2; i >= 0; --i) {
-		positions[i] = rb3_srindex_phi(sr, positions[i + 1]);
-		if (positions[i] < 0) return -1;
+	/* Enumerate using phi: SA[hi-1], SA[hi-2], ..., SA[hi-n] */
+	return sr_phi_chains(sr, hi - n, hi, toehold_sa, positions);
+}
+
+int64_t rb3_srindex_locate_all(const rb3_srindex_t *sr, const void *f_,
+                               int64_t lo, int64_t hi, int64_t *positions, int64_t max_pos)
+{
+	return sr_locate(sr, f_, lo, hi, positions, max_pos);
+}
+
+/*
+ * Map SA values to (sid, pos). The sequence of an SA value is the predecessor
+ * of the value among the sequence starts, so the mapping takes the same
+ * batched queries as phi rather than a binary search per hit.
+ */
+static void sr_sa2pos(const rb3_srindex_t *sr, int64_t n, const int64_t *sa, rb3_pos_t *pos)
+{
+	int64_t i, j, m, k[SR_PHI_BATCH], y[SR_PHI_BATCH];
+	for (j = 0; j < n; j += SR_PHI_BATCH) {
+		m = n - j < SR_PHI_BATCH? n - j : SR_PHI_BATCH;
+		ef_pred_batch(&sr->seq_st, m, &sa[j], k, y);
+		for (i = 0; i < m; ++i) {
+			pos[j + i].sid = k[i] < 0? -1 : sr->text_order_sid[k[i]];
+			pos[j + i].pos = k[i] < 0? -1 : sa[j + i] - y[i];
+		}
 	}
-	return n;
 }
 
 int64_t rb3_srindex_multi(void *km, const rb3_fmi_t *f, const rb3_srindex_t *sr,
                           int64_t lo, int64_t hi, int64_t max_pos, rb3_pos_t *pos)
 {
-	int64_t i, n, *sa_vals;
+	int64_t n, *sa_vals;
 	n = hi - lo;
 	if (n <= 0) return 0;
 	if (n > max_pos) n = max_pos;
 	sa_vals = (int64_t*)kmalloc(km, n * sizeof(int64_t));
-	n = rb3_srindex_locate_all(sr, f, lo, hi, sa_vals, n);
+	n = sr_locate(sr, f, lo, hi, sa_vals, n);
 	if (n < 0) { kfree(km, sa_vals); return 0; }
-	for (i = 0; i < n; ++i) {
-		int64_t sa = sa_vals[i];
-		int64_t lo2 = 0, hi2 = sr->m;
-		while (lo2 < hi2) {
-			int64_t mid = lo2 + (hi2 - lo2) / 2;
-			if (sr->cum_len[mid + 1] <= sa) lo2 = mid + 1;
-			else hi2 = mid;
-		}
-		pos[i].sid = sr->text_order_sid[lo2];
-		pos[i].pos = sa - sr->cum_len[lo2];
-	}
+	sr_sa2pos(sr, n, sa_vals, pos);
 	kfree(km, sa_vals);
 	return n;
 }
@@ -734,16 +1356,19 @@ int64_t rb3_srindex_multi(void *km, const rb3_fmi_t *f, const rb3_srindex_t *sr,
 void rb3_srindex_destroy(rb3_srindex_t *sr)
 {
 	if (sr == 0) return;
-	free(sr->phi_sa);
-	free(sr->phi_da);
-	free(sr->run_pos);
+	if (sr->mm) { /* all arrays are in the mapped file */
+		munmap(sr->mm, sr->mm_len);
+		free(sr);
+		return;
+	}
+	rb3_ef_destroy(&sr->phi_sa);
+	rb3_ef_destroy(&sr->run_pos);
 	free(sr->run_sa);
-	if (!sr->sub_is_alias) {
-		free(sr->sub_pos);
+	if (!sr->sub_is_alias)
 		free(sr->sub_sa);
-	}
 	free(sr->sub_bv);
-	free(sr->cum_len);
+	free(sr->sub_rank);
+	rb3_ef_destroy(&sr->seq_st);
 	free(sr->text_order_sid);
 	free(sr);
 }
@@ -753,7 +1378,25 @@ void rb3_srindex_destroy(rb3_srindex_t *sr)
  ***************************/
 
 /*
- * V3 format: compressed SR-index with three optimizations:
+ * V5 format: the in-memory representation, so that the index can be used in
+ * place from a mapped file and is shared by all processes mapping it.
+ *
+ * Header (152 bytes):
+ *   magic "SRI\5"     4 bytes
+ *   s                  int32
+ *   n, m, n_runs       int64
+ *   n_samples, n_sub   int64
+ *   ws                 int32
+ *   flags              int32 - SRI_F_ALIAS if sub_sa aliases run_sa
+ *   phi_sa, run_pos and seq_st: n, u and n_hi (int64), lw and vw (int32)
+ *
+ * Arrays, each padded to a multiple of 8 bytes:
+ *   lo, hi, s1 and s0 of phi_sa, run_pos and seq_st
+ *   run_sa, sub_sa (if not alias), sub_bv, sub_rank, text_order_sid
+ *
+ * SRI\1 to SRI\3 are read and converted to the in-memory representation.
+ *
+ * V3 format (read only): compressed with three optimizations:
  *
  * 1. 32-bit integer mode: For n < 2^32, sorted array samples and all
  *    absolute values stored as uint32 instead of int64. Halves the index.
@@ -786,63 +1429,12 @@ void rb3_srindex_destroy(rb3_srindex_t *sr)
  *   run_sa     bit-packed
  *   sub_pos    delta-encoded (if not alias)
  *   sub_sa     bit-packed (if not alias)
- *   cum_len    raw int64 (small)
+ *   cum_len    raw int64 (small); the sequence starts and the text length
  *   tosid      raw int64 (small)
  */
 
 #define DELTA_SAMPLE_K 64
 
-/* Compute ceil(log2(n)), minimum 1 */
-static int compute_bit_width(int64_t n)
-{
-	int bits = 0;
-	int64_t v = n - 1;
-	if (v <= 0) return 1;
-	while (v > 0) { bits++; v >>= 1; }
-	return bits;
-}
-
-/* Check if any delta in a sorted array exceeds 16-bit range */
-static int need_32bit_deltas(const int64_t *arr, int64_t count)
-{
-	int64_t i;
-	for (i = 1; i < count; ++i)
-		if (arr[i] - arr[i-1] > 65535) return 1;
-	return 0;
-}
-
-/*
- * Write a delta-encoded sorted array.
- * Format: [n_samples uint32 absolute samples] [count deltas of delta_bits/8 bytes each]
- * Sample at positions 0, K, 2K, ...
- */
-static void write_delta_array(FILE *fp, const int64_t *arr, int64_t count,
-                               int delta_bits)
-{
-	int64_t i, n_samp;
-	if (count == 0) return;
-
-	/* Write absolute samples every K entries */
-	n_samp = (count + DELTA_SAMPLE_K - 1) / DELTA_SAMPLE_K;
-	for (i = 0; i < n_samp; ++i) {
-		uint32_t v = (uint32_t)arr[i * DELTA_SAMPLE_K];
-		fwrite(&v, 4, 1, fp);
-	}
-
-	/* Write deltas for all entries after the first */
-	if (delta_bits == 16) {
-		for (i = 1; i < count; ++i) {
-			uint16_t d = (uint16_t)(arr[i] - arr[i-1]);
-			fwrite(&d, 2, 1, fp);
-		}
-	} else {
-		for (i = 1; i < count; ++i) {
-			uint32_t d = (uint32_t)(arr[i] - arr[i-1]);
-			fwrite(&d, 4, 1, fp);
-		}
-	}
-}
-
 /*
  * Read a delta-encoded sorted array back into int64_t.
  */
@@ -880,42 +1472,6 @@ static void read_delta_array(FILE *fp, int64_t *arr, int64_t count,
 	}
 }
 
-/*
- * Write a bit-packed array. Each value uses 'bits' bits, packed into bytes.
- * Total bytes: ceil(count * bits / 8)
- */
-static void write_packed_array(FILE *fp, const int64_t *arr, int64_t count,
-                                int bits)
-{
-	int64_t i, n_bytes;
-	uint8_t *buf;
-	if (count == 0 || bits == 0) return;
-
-	n_bytes = ((int64_t)count * bits + 7) / 8;
-	buf = RB3_CALLOC(uint8_t, n_bytes);
-
-	for (i = 0; i < count; ++i) {
-		uint64_t val = (uint64_t)arr[i];
-		int64_t bit_pos = i * bits;
-		int64_t byte_pos = bit_pos >> 3;
-		int bit_off = (int)(bit_pos & 7);
-		int remaining = bits;
-
-		/* Write value across byte boundaries */
-		while (remaining > 0) {
-			int can_write = 8 - bit_off;
-			if (can_write > remaining) can_write = remaining;
-			buf[byte_pos] |= (uint8_t)((val & ((1U << can_write) - 1)) << bit_off);
-			val >>= can_write;
-			remaining -= can_write;
-			byte_pos++;
-			bit_off = 0;
-		}
-	}
-	fwrite(buf, 1, n_bytes, fp);
-	free(buf);
-}
-
 /*
  * Read a bit-packed array back into int64_t.
  */
@@ -952,90 +1508,199 @@ static void read_packed_array(FILE *fp, int64_t *arr, int64_t count,
 	free(buf);
 }
 
-int rb3_srindex_dump(const rb3_srindex_t *sr, const char *fn)
+#define SRI_HDR_SIZE 152
+#define SRI_MAX_ARR  18
+#define SRI_F_ALIAS  0x1
+
+#define sri_arr(type, f, sz) do { if (set) (f) = (type*)p[k]; else p[k] = (void*)(f); size[k++] = (sz); } while (0)
+
+static int32_t sri_arrays_ef(rb3_ef_t *ef, void **p, int64_t *size, int set)
 {
-	FILE *fp;
-	int32_t y;
-	int64_t n_sub_disk;
-	int bit_width, delta_bits;
-	uint8_t hdr_extra[4];
+	int32_t k = 0;
+	sri_arr(uint64_t, ef->lo, sr_n_words(ef->n, ef->lw + ef->vw) * 8);
+	sri_arr(uint64_t, ef->hi, sr_n_words(ef->n_hi, 1) * 8);
+	sri_arr(int64_t, ef->s1, ((ef->n >> RB3_EF_SEL_SHIFT) + 1) * 8);
+	sri_arr(int64_t, ef->s0, (((ef->n_hi - ef->n) >> RB3_EF_SEL_SHIFT) + 1) * 8);
+	return k;
+}
 
-	if (sr == 0) return -1;
-	fp = fn && strcmp(fn, "-") ? fopen(fn, "wb") : fdopen(1, "wb");
-	if (fp == 0) return -1;
+/* Collect the arrays of sr in the V5 order into p[], or point sr to p[] if set */
+static int32_t sri_arrays(rb3_srindex_t *sr, int32_t flags, void **p, int64_t *size, int set)
+{
+	int64_t n_words = (sr->n + 63) / 64;
+	int32_t k = 0;
+	k += sri_arrays_ef(&sr->phi_sa, &p[k], &size[k], set);
+	k += sri_arrays_ef(&sr->run_pos, &p[k], &size[k], set);
+	k += sri_arrays_ef(&sr->seq_st, &p[k], &size[k], set);
+	sri_arr(uint64_t, sr->run_sa, sr_n_words(sr->n_samples, sr->ws) * 8);
+	if (!(flags & SRI_F_ALIAS))
+		sri_arr(uint64_t, sr->sub_sa, sr_n_words(sr->n_sub, sr->ws) * 8);
+	else if (set) sr->sub_sa = sr->run_sa;
+	sri_arr(uint64_t, sr->sub_bv, (n_words > 0? n_words : 1) * 8);
+	sri_arr(int64_t, sr->sub_rank, ((n_words >> 3) + 1) * 8);
+	sri_arr(int64_t, sr->text_order_sid, (sr->m > 0? sr->m : 1) * 8);
+	return k;
+}
 
-	bit_width = compute_bit_width(sr->n);
-	delta_bits = (need_32bit_deltas(sr->phi_sa, sr->n_runs) ||
-	              need_32bit_deltas(sr->run_pos, sr->n_samples) ||
-	              (!sr->sub_is_alias && need_32bit_deltas(sr->sub_pos, sr->n_sub)))
-	             ? 32 : 16;
-
-	/*
-	 * Format version 3: compressed with delta-encoding and bit-packing.
-	 * For s<=1, n_sub is written as 0 to indicate alias.
-	 */
-	fwrite("SRI\3", 1, 4, fp);
+int64_t rb3_srindex_write(const rb3_srindex_t *sr, FILE *fp)
+{
+	static const uint8_t pad[8] = {0,0,0,0,0,0,0,0};
+	const rb3_ef_t *ef[3];
+	void *p[SRI_MAX_ARR];
+	int64_t size[SRI_MAX_ARR], tot = SRI_HDR_SIZE;
+	int32_t i, k, y, flags;
+
+	flags = sr->sub_is_alias? SRI_F_ALIAS : 0;
+	fwrite("SRI\5", 1, 4, fp);
 	y = sr->s; fwrite(&y, 4, 1, fp);
-	fwrite(&sr->m, 8, 1, fp);
 	fwrite(&sr->n, 8, 1, fp);
+	fwrite(&sr->m, 8, 1, fp);
 	fwrite(&sr->n_runs, 8, 1, fp);
 	fwrite(&sr->n_samples, 8, 1, fp);
-	n_sub_disk = sr->sub_is_alias ? 0 : sr->n_sub;
-	fwrite(&n_sub_disk, 8, 1, fp);
-	hdr_extra[0] = (uint8_t)bit_width;
-	hdr_extra[1] = (uint8_t)delta_bits;
-	hdr_extra[2] = 0;
-	hdr_extra[3] = 0;
-	fwrite(hdr_extra, 1, 4, fp);
-
-	/* Sorted arrays: delta-encoded */
-	write_delta_array(fp, sr->phi_sa, sr->n_runs, delta_bits);
-	/* Unsorted: phi_da can contain -1, so we map -1 -> (1<<bw)-1 before packing.
-	 * Use bw+1 bits to avoid collision when n-1 == (1<<bw)-1. */
-	{
-		int64_t ii;
-		int phi_da_bits = bit_width + 1;
-		int64_t *phi_da_mapped = RB3_MALLOC(int64_t, sr->n_runs > 0 ? sr->n_runs : 1);
-		for (ii = 0; ii < sr->n_runs; ++ii)
-			phi_da_mapped[ii] = sr->phi_da[ii] < 0 ? ((1LL << phi_da_bits) - 1) : sr->phi_da[ii];
-		write_packed_array(fp, phi_da_mapped, sr->n_runs, phi_da_bits);
-		free(phi_da_mapped);
-	}
-	/* Sorted arrays: delta-encoded */
-	write_delta_array(fp, sr->run_pos, sr->n_samples, delta_bits);
-	/* Unsorted arrays: bit-packed */
-	write_packed_array(fp, sr->run_sa, sr->n_samples, bit_width);
-
-	if (!sr->sub_is_alias) {
-		write_delta_array(fp, sr->sub_pos, sr->n_sub, delta_bits);
-		write_packed_array(fp, sr->sub_sa, sr->n_sub, bit_width);
-	}
-
-	/* Small arrays: raw int64 */
-	fwrite(sr->cum_len, 8, sr->m + 1, fp);
-	fwrite(sr->text_order_sid, 8, sr->m, fp);
-	fclose(fp);
-	return 0;
+	fwrite(&sr->n_sub, 8, 1, fp);
+	fwrite(&sr->ws, 4, 1, fp);
+	fwrite(&flags, 4, 1, fp);
+	ef[0] = &sr->phi_sa, ef[1] = &sr->run_pos, ef[2] = &sr->seq_st;
+	for (i = 0; i < 3; ++i) {
+		fwrite(&ef[i]->n, 8, 1, fp);
+		fwrite(&ef[i]->u, 8, 1, fp);
+		fwrite(&ef[i]->n_hi, 8, 1, fp);
+		fwrite(&ef[i]->lw, 4, 1, fp);
+		fwrite(&ef[i]->vw, 4, 1, fp);
+	}
+	k = sri_arrays((rb3_srindex_t*)sr, flags, p, size, 0);
+	for (i = 0; i < k; ++i) {
+		fwrite(p[i], 1, size[i], fp);
+		fwrite(pad, 1, -size[i] & 7, fp);
+		tot += (size[i] + 7) & ~7LL;
+	}
+	return tot;
 }
 
-rb3_srindex_t *rb3_srindex_restore(const char *fn)
+int rb3_srindex_dump(const rb3_srindex_t *sr, const char *fn)
+{
+	FILE *fp;
+	if (sr == 0) return -1;
+	fp = fn && strcmp(fn, "-") ? fopen(fn, "wb") : fdopen(1, "wb");
+	if (fp == 0) return -1;
+	rb3_srindex_write(sr, fp);
+	return fclose(fp) == 0? 0 : -1;
+}
+
+/* Parse the V5 header; returns the flags, or -1 if the header is invalid */
+static int32_t sri_hdr_parse(rb3_srindex_t *sr, const uint8_t *h)
+{
+	rb3_ef_t *ef[3];
+	int32_t i, y, flags;
+	memcpy(&y, h + 4, 4); sr->s = y;
+	memcpy(&sr->n, h + 8, 8);
+	memcpy(&sr->m, h + 16, 8);
+	memcpy(&sr->n_runs, h + 24, 8);
+	memcpy(&sr->n_samples, h + 32, 8);
+	memcpy(&sr->n_sub, h + 40, 8);
+	memcpy(&sr->ws, h + 48, 4);
+	memcpy(&flags, h + 52, 4);
+	ef[0] = &sr->phi_sa, ef[1] = &sr->run_pos, ef[2] = &sr->seq_st;
+	for (i = 0; i < 3; ++i) {
+		const uint8_t *q = h + 56 + i * 32;
+		memcpy(&ef[i]->n, q, 8);
+		memcpy(&ef[i]->u, q + 8, 8);
+		memcpy(&ef[i]->n_hi, q + 16, 8);
+		memcpy(&ef[i]->lw, q + 24, 4);
+		memcpy(&ef[i]->vw, q + 28, 4);
+		if (ef[i]->n < 0 || ef[i]->n_hi < ef[i]->n || ef[i]->lw < 1 || ef[i]->vw < 0 || ef[i]->lw + ef[i]->vw > 64)
+			return -1;
+	}
+	if (sr->n < 0 || sr->m < 0 || sr->n_samples < 0 || sr->n_sub < 0 || sr->ws < 1 || sr->ws > 64)
+		return -1;
+	if (flags & ~SRI_F_ALIAS) return -1; /* unknown arrays */
+	sr->sub_is_alias = !!(flags & SRI_F_ALIAS);
+	return flags;
+}
+
+/* Read the V5 format into memory; the magic has been read */
+static rb3_srindex_t *sri_read5(FILE *fp)
+{
+	uint8_t h[SRI_HDR_SIZE];
+	void *p[SRI_MAX_ARR];
+	int64_t size[SRI_MAX_ARR];
+	int32_t i, k, flags;
+	rb3_srindex_t *sr;
+
+	memcpy(h, "SRI\5", 4);
+	if (fread(h + 4, 1, SRI_HDR_SIZE - 4, fp) != SRI_HDR_SIZE - 4) return 0;
+	sr = RB3_CALLOC(rb3_srindex_t, 1);
+	if ((flags = sri_hdr_parse(sr, h)) < 0) {
+		free(sr);
+		return 0;
+	}
+	k = sri_arrays(sr, flags, p, size, 0);
+	for (i = 0; i < k; ++i) {
+		int64_t l = (size[i] + 7) & ~7LL;
+		p[i] = RB3_MALLOC(uint64_t, l > 0? l >> 3 : 1);
+		if (fread(p[i], 1, l, fp) != (size_t)l) break;
+	}
+	if (i < k) {
+		for (k = i, i = 0; i <= k; ++i) free(p[i]);
+		free(sr);
+		return 0;
+	}
+	sri_arrays(sr, flags, p, size, 1);
+	return sr;
+}
+
+/* Read a sorted array in the format of the given version */
+static void read_sorted(FILE *fp, int32_t version, int delta_bits, int64_t *a, int64_t n)
+{
+	if (version >= 3) read_delta_array(fp, a, n, delta_bits);
+	else fread(a, 8, n, fp);
+}
+
+/* Read an unsorted array in the format of the given version */
+static void read_values(FILE *fp, int32_t version, int bits, int64_t *a, int64_t n)
+{
+	if (version >= 3) read_packed_array(fp, a, n, bits);
+	else fread(a, 8, n, fp);
+}
+
+/* Before SRI\5, adjacent sentinels in the BWT were merged into one run. A
+ * sentinel row is sampled only if it is a run of its own, and its SA is the
+ * start of a sequence, so a correct index has exactly m such samples. */
+static int sr_sentinels_merged(const rb3_srindex_t *sr)
+{
+	int64_t i, n_st = 0;
+	for (i = 0; i < sr->n_samples; ++i) {
+		int64_t x = rb3_bits_get(sr->run_sa, sr->ws, i), v;
+		if (rb3_ef_pred(&sr->seq_st, x, &v) >= 0 && v == x) ++n_st;
+	}
+	return n_st != sr->m;
+}
+
+rb3_srindex_t *rb3_srindex_restore_at(const char *fn, int64_t off)
 {
 	FILE *fp;
 	int32_t y, version;
 	char magic[4];
 	rb3_srindex_t *sr;
+	int bit_width = 0, delta_bits = 0;
+	int64_t i, max, *a, *b;
 
 	fp = fn && strcmp(fn, "-") ? fopen(fn, "rb") : fdopen(0, "rb");
 	if (fp == 0) return 0;
-	if (fread(magic, 1, 4, fp) != 4 || magic[0] != 'S' || magic[1] != 'R' || magic[2] != 'I') {
+	if ((off > 0 && fseeko(fp, off, SEEK_SET) != 0) || fread(magic, 1, 4, fp) != 4 || magic[0] != 'S' || magic[1] != 'R' || magic[2] != 'I') {
 		fclose(fp);
 		return 0;
 	}
 	version = (unsigned char)magic[3];
-	if (version < 1 || version > 3) {
+	if (version < 1 || version == 4 || version > 5) {
 		fclose(fp);
 		return 0;
 	}
+	if (version == 5) {
+		sr = sri_read5(fp);
+		fclose(fp);
+		return sr;
+	}
 	sr = RB3_CALLOC(rb3_srindex_t, 1);
 	fread(&y, 4, 1, fp); sr->s = y;
 	fread(&sr->m, 8, 1, fp);
@@ -1043,82 +1708,106 @@ rb3_srindex_t *rb3_srindex_restore(const char *fn)
 	fread(&sr->n_runs, 8, 1, fp);
 	fread(&sr->n_samples, 8, 1, fp);
 	fread(&sr->n_sub, 8, 1, fp);
-
-	if (version == 3) {
+	if (version >= 3) { /* v3: delta-encoded and bit-packed; v1/v2: raw int64 arrays */
 		uint8_t hdr_extra[4];
-		int bit_width, delta_bits;
-
 		fread(hdr_extra, 1, 4, fp);
 		bit_width = hdr_extra[0];
 		delta_bits = hdr_extra[1];
+	}
+	if (version >= 2 && sr->n_sub == 0 && sr->s <= 1) {
+		sr->n_sub = sr->n_samples;
+		sr->sub_is_alias = 1;
+	}
 
-		sr->phi_sa = RB3_MALLOC(int64_t, sr->n_runs > 0 ? sr->n_runs : 1);
-		sr->phi_da = RB3_MALLOC(int64_t, sr->n_runs > 0 ? sr->n_runs : 1);
-		sr->run_pos = RB3_MALLOC(int64_t, sr->n_samples > 0 ? sr->n_samples : 1);
-		sr->run_sa = RB3_MALLOC(int64_t, sr->n_samples > 0 ? sr->n_samples : 1);
-
-		read_delta_array(fp, sr->phi_sa, sr->n_runs, delta_bits);
-		/* phi_da uses bit_width+1 bits; sentinel (all 1s) maps back to -1 */
-		{
-			int phi_da_bits = bit_width + 1;
-			int64_t sentinel = (1LL << phi_da_bits) - 1;
-			int64_t ii;
-			read_packed_array(fp, sr->phi_da, sr->n_runs, phi_da_bits);
-			for (ii = 0; ii < sr->n_runs; ++ii)
-				if (sr->phi_da[ii] == sentinel) sr->phi_da[ii] = -1;
-		}
-		read_delta_array(fp, sr->run_pos, sr->n_samples, delta_bits);
-		read_packed_array(fp, sr->run_sa, sr->n_samples, bit_width);
-
-		if (sr->n_sub == 0 && sr->s <= 1) {
-			sr->n_sub = sr->n_samples;
-			sr->sub_pos = sr->run_pos;
-			sr->sub_sa = sr->run_sa;
-			sr->sub_is_alias = 1;
-		} else {
-			sr->sub_pos = RB3_MALLOC(int64_t, sr->n_sub > 0 ? sr->n_sub : 1);
-			sr->sub_sa = RB3_MALLOC(int64_t, sr->n_sub > 0 ? sr->n_sub : 1);
-			read_delta_array(fp, sr->sub_pos, sr->n_sub, delta_bits);
-			read_packed_array(fp, sr->sub_sa, sr->n_sub, bit_width);
-			sr->sub_is_alias = 0;
-		}
+	/* Each array is decoded into a[] (phi_sa into b[]) and converted to the in-memory representation before the next is read */
+	max = sr->n_runs > sr->n_samples? sr->n_runs : sr->n_samples;
+	max = max > sr->n_sub? max : sr->n_sub;
+	a = RB3_MALLOC(int64_t, max > 0 ? max : 1);
+	sr->ws = sr_bit_width(sr->n);
+	b = RB3_MALLOC(int64_t, sr->n_runs > 0 ? sr->n_runs : 1);
+	read_sorted(fp, version, delta_bits, b, sr->n_runs);
+	read_values(fp, version, bit_width + 1, a, sr->n_runs);
+	for (i = 0; i < sr->n_runs; ++i) /* stored as phi_da+1; in v3+, the sentinel (all 1s) stands for -1 */
+		a[i] = version >= 3 && a[i] == (1LL << (bit_width + 1)) - 1? 0 : a[i] + 1;
+	rb3_ef_build(&sr->phi_sa, b, sr->n_runs, a, sr->ws);
+	free(b);
+	read_sorted(fp, version, delta_bits, a, sr->n_samples);
+	rb3_ef_build(&sr->run_pos, a, sr->n_samples, 0, 0);
+	if (sr->sub_is_alias) build_sub_bitvector(sr, a);
+	read_values(fp, version, bit_width, a, sr->n_samples);
+	sr->run_sa = sr_pack(a, sr->n_samples, sr->ws, 0);
+	if (sr->sub_is_alias) {
+		sr->sub_sa = sr->run_sa;
 	} else {
-		/* v1/v2: raw int64 arrays */
-		sr->phi_sa = RB3_MALLOC(int64_t, sr->n_runs > 0 ? sr->n_runs : 1);
-		sr->phi_da = RB3_MALLOC(int64_t, sr->n_runs > 0 ? sr->n_runs : 1);
-		sr->run_pos = RB3_MALLOC(int64_t, sr->n_samples > 0 ? sr->n_samples : 1);
-		sr->run_sa = RB3_MALLOC(int64_t, sr->n_samples > 0 ? sr->n_samples : 1);
-		fread(sr->phi_sa, 8, sr->n_runs, fp);
-		fread(sr->phi_da, 8, sr->n_runs, fp);
-		fread(sr->run_pos, 8, sr->n_samples, fp);
-		fread(sr->run_sa, 8, sr->n_samples, fp);
-
-		if (version >= 2 && sr->n_sub == 0 && sr->s <= 1) {
-			sr->n_sub = sr->n_samples;
-			sr->sub_pos = sr->run_pos;
-			sr->sub_sa = sr->run_sa;
-			sr->sub_is_alias = 1;
-		} else {
-			sr->sub_pos = RB3_MALLOC(int64_t, sr->n_sub > 0 ? sr->n_sub : 1);
-			sr->sub_sa = RB3_MALLOC(int64_t, sr->n_sub > 0 ? sr->n_sub : 1);
-			fread(sr->sub_pos, 8, sr->n_sub, fp);
-			fread(sr->sub_sa, 8, sr->n_sub, fp);
-			sr->sub_is_alias = 0;
-		}
+		read_sorted(fp, version, delta_bits, a, sr->n_sub);
+		build_sub_bitvector(sr, a);
+		read_values(fp, version, bit_width, a, sr->n_sub);
+		sr->sub_sa = sr_pack(a, sr->n_sub, sr->ws, 0);
 	}
+	free(a);
 
-	sr->cum_len = RB3_MALLOC(int64_t, sr->m + 1);
+	a = RB3_MALLOC(int64_t, sr->m + 1);
+	fread(a, 8, sr->m + 1, fp);
+	rb3_ef_build(&sr->seq_st, a, sr->m, 0, 0);
+	free(a);
 	sr->text_order_sid = RB3_MALLOC(int64_t, sr->m > 0 ? sr->m : 1);
-	fread(sr->cum_len, 8, sr->m + 1, fp);
 	fread(sr->text_order_sid, 8, sr->m, fp);
 	fclose(fp);
+	if (sr_sentinels_merged(sr)) {
+		fprintf(stderr, "[E::%s] \"%s\" merges adjacent sentinels into one run and gives wrong positions; rebuild the SR-index\n", __func__, fn);
+		rb3_srindex_destroy(sr);
+		return 0;
+	}
+	return sr;
+}
 
-	/* Build bitvector for fast locate_one */
-	build_sub_bitvector(sr);
+rb3_srindex_t *rb3_srindex_restore(const char *fn)
+{
+	return rb3_srindex_restore_at(fn, 0);
+}
 
+rb3_srindex_t *rb3_srindex_restore_mmap_at(const char *fn, int64_t off, int64_t size)
+{
+	rb3_srindex_t *sr;
+	uint8_t *base;
+	void *p[SRI_MAX_ARR];
+	int64_t sz[SRI_MAX_ARR], q = SRI_HDR_SIZE;
+	int32_t i, k = 0, flags;
+	int fd;
+
+	if (size < SRI_HDR_SIZE || (fd = open(fn, O_RDONLY)) < 0) return 0;
+	base = (uint8_t*)mmap(0, size, PROT_READ, MAP_SHARED, fd, off);
+	close(fd);
+	if (base == MAP_FAILED) return 0;
+	if (memcmp(base, "SRI\5", 4) != 0) { /* an older format; decode into memory */
+		munmap(base, size);
+		return rb3_srindex_restore_at(fn, off);
+	}
+	sr = RB3_CALLOC(rb3_srindex_t, 1);
+	if ((flags = sri_hdr_parse(sr, base)) >= 0)
+		k = sri_arrays(sr, flags, p, sz, 0);
+	for (i = 0; i < k && q + sz[i] <= size; ++i) {
+		p[i] = base + q;
+		q += (sz[i] + 7) & ~7LL;
+	}
+	if (flags < 0 || i < k || q != size) {
+		munmap(base, size);
+		free(sr);
+		return 0;
+	}
+	sri_arrays(sr, flags, p, sz, 1);
+	sr->mm = base, sr->mm_len = size;
 	return sr;
 }
 
+rb3_srindex_t *rb3_srindex_restore_mmap(const char *fn)
+{
+	struct stat st;
+	if (fn == 0 || strcmp(fn, "-") == 0 || stat(fn, &st) != 0)
+		return rb3_srindex_restore(fn);
+	return rb3_srindex_restore_mmap_at(fn, 0, st.st_size);
+}
+
 /***************************
  * main_srindex CLI        *
  ***************************/
@@ -1126,15 +1815,18 @@ rb3_srindex_t *rb3_srindex_restore(const char *fn)
 int main_srindex(int argc, char *argv[])
 {
 	int c, n_threads = 4, s_param = 8;
-	rb3_srindex_t *sr;
+	int64_t max_mem = RB3_SRI_MAX_MEM;
+	rb3_srindex_t *sr, *sr0 = 0;
 	rb3_fmi_t f;
-	char *fn = 0;
+	char *fn = 0, *fn0 = 0;
 	ketopt_t o = KETOPT_INIT;
 
-	while ((c = ketopt(&o, argc, argv, 1, "t:s:o:", 0)) >= 0) {
+	while ((c = ketopt(&o, argc, argv, 1, "t:s:o:m:u:", 0)) >= 0) {
 		if (c == 't') n_threads = atoi(o.arg);
 		else if (c == 's') s_param = atoi(o.arg);
 		else if (c == 'o') fn = o.arg;
+		else if (c == 'm') max_mem = rb3_parse_num(o.arg);
+		else if (c == 'u') fn0 = o.arg;
 	}
 	if (argc == o.ind) {
 		fprintf(stderr, "Usage: ropebwt3 srindex [options] <in.fmd>\n");
@@ -1142,14 +1834,22 @@ int main_srindex(int argc, char *argv[])
 		fprintf(stderr, "  -t INT     number of threads [%d]\n", n_threads);
 		fprintf(stderr, "  -s INT     subsampling parameter [%d]\n", s_param);
 		fprintf(stderr, "  -o FILE    output file [<in.fmd>.sri]\n");
+		fprintf(stderr, "  -m NUM     buffer at most NUM bytes of samples in memory; spill the rest to $TMPDIR [4G]\n");
+		fprintf(stderr, "  -u FILE    update SR-index FILE of the index before \"build -i\" or merge; -s is ignored\n");
+		return 1;
+	}
+	if (fn0 && (sr0 = rb3_srindex_restore_mmap(fn0)) == 0) {
+		fprintf(stderr, "[E::%s] failed to load the SR-index \"%s\"\n", __func__, fn0);
 		return 1;
 	}
 	rb3_fmi_restore(&f, argv[o.ind], 0);
 	if (f.e == 0 && f.r == 0) {
 		fprintf(stderr, "[E::%s] failed to load the FM-index\n", __func__);
+		rb3_srindex_destroy(sr0);
 		return 1;
 	}
-	sr = rb3_srindex_build(&f, s_param, n_threads);
+	sr = sr0? rb3_srindex_update(sr0, &f, n_threads, max_mem) : rb3_srindex_build2(&f, s_param, n_threads, max_mem);
+	rb3_srindex_destroy(sr0); /* unmap it first: the output may overwrite fn0 */
 	if (sr == 0) {
 		fprintf(stderr, "[E::%s] failed to build SR-index\n", __func__);
 		rb3_fmi_free(&f);
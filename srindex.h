@@ -2,6 +2,7 @@
 #define RB3_SRINDEX_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,7 +13,7 @@ extern "C" {
  *
  * The phi function maps SA[k] -> SA[k-1] and is piecewise linear over r
  * intervals (where r = number of BWT runs). We store the breakpoints in
- * sorted order for O(log r) binary search evaluation.
+ * sorted order, Elias-Fano coded, and evaluate phi with a predecessor query.
  *
  * The toehold is a known text position SA[hi] maintained during backward
  * search. It is updated when a BWT run boundary is crossed, using stored
@@ -27,11 +28,48 @@ extern "C" {
  *   Cobas et al., CPM 2021 (subsampled r-index)
  */
 
+/*
+ * Elias-Fano coding of a sorted array a[0..n). The low lw bits of each entry
+ * are packed in lo[]; the high part of a[i] is stored in unary by setting bit
+ * (a[i]>>lw)+i of hi[]. The positions of every 2^RB3_EF_SEL_SHIFT-th one and
+ * zero in hi[] are sampled for select. An entry takes about 2+log2(u/n) bits.
+ * An optional vw-bit satellite value may be stored above the low bits of each
+ * entry, so that a predecessor query and the value it leads to share a cache
+ * line. All arrays are flat words, so that they can be used from a mapped file.
+ */
+#define RB3_EF_SEL_SHIFT 8
+
+typedef struct {
+	int64_t n, u;        /* number of entries; all entries are below u */
+	int64_t n_hi;        /* number of bits in hi[] */
+	int32_t lw;          /* number of low bits, at least 1 */
+	int32_t vw;          /* number of bits of the satellite values; 0 if none */
+	uint64_t *lo;        /* low parts and values, lw+vw bits each, plus a padding word */
+	uint64_t *hi;        /* high parts in unary, plus a padding word */
+	int64_t *s1, *s0;    /* positions of every 2^RB3_EF_SEL_SHIFT-th one and zero in hi[] */
+} rb3_ef_t;
+
+/* Encode the sorted array a[0..n), with satellite values v[0..n) of vw bits if v is not NULL */
+void rb3_ef_build(rb3_ef_t *ef, const int64_t *a, int64_t n, const int64_t *v, int32_t vw);
+
+/* Free the arrays of ef; not ef itself */
+void rb3_ef_destroy(rb3_ef_t *ef);
+
+/* Get a[i] */
+int64_t rb3_ef_get(const rb3_ef_t *ef, int64_t i);
+
+/* Get the satellite value of entry i */
+int64_t rb3_ef_val(const rb3_ef_t *ef, int64_t i);
+
+/* Predecessor: the largest i such that a[i] <= x, or -1 if there is none. *v is set to a[i]. */
+int64_t rb3_ef_pred(const rb3_ef_t *ef, int64_t x, int64_t *v);
+
 typedef struct {
 	int64_t n_runs;       /* number of BWT runs (r) */
 	int64_t n;            /* total BWT length */
 	int32_t s;            /* subsampling parameter; s=1 means no subsampling */
 	int64_t n_samples;    /* number of SA samples at run boundaries (up to 2r) */
+	int32_t ws;           /* number of bits per packed SA value (phi_da+1, run_sa and sub_sa) */
 	/*
 	 * Phi function representation:
 	 * phi_sa[0..n_runs-1]: SA values at the start of each BWT run, sorted by SA value.
@@ -41,50 +79,58 @@ typedef struct {
 	 *
 	 * For a general SA value v in [phi_sa[i], phi_sa[i+1]):
 	 *   phi(v) = phi_da[i] + (v - phi_sa[i])
-	 * because phi is linear (SA[k]-1 = SA[k-1]) within a BWT run.
+	 * because phi is linear (SA[k]-1 = SA[k-1]) within a BWT run. Each sentinel
+	 * is a run of its own, as LF does not step one text position back from it.
+	 *
+	 * phi_sa is Elias-Fano coded; a predecessor query finds i. phi_da[i]+1
+	 * is stored as the satellite value of phi_sa[i] in ws bits (phi_da is -1
+	 * at the run starting at BWT position 0), so evaluating phi touches the
+	 * predecessor structure only.
 	 */
-	int64_t *phi_sa;     /* sorted SA values at BWT run starts (breakpoints) */
-	int64_t *phi_da;     /* phi values at breakpoints */
+	rb3_ef_t phi_sa;      /* sorted SA values at BWT run starts, with phi values plus one */
 	/*
 	 * Toehold support: SA samples at run boundaries indexed by BWT position.
 	 * run_pos[i]:  BWT position of the last character in run i (0-indexed)
 	 * run_sa[i]:   SA[run_pos[i]], the text position at end of run i
 	 *
 	 * During backward search, when hi crosses a run boundary, we look up
-	 * the stored SA value from run_sa[].
+	 * the stored SA value from run_sa[]. run_pos is Elias-Fano coded and
+	 * run_sa is bit-packed.
 	 */
-	int64_t *run_pos;    /* BWT position of last char in each run */
-	int64_t *run_sa;     /* SA value at each run_pos */
+	rb3_ef_t run_pos;     /* BWT position of last char in each run */
+	uint64_t *run_sa;     /* SA value at each run_pos, packed */
 	/*
 	 * Subsampled SA: BWT positions where SA[pos] % s == 0.
 	 * For s=1, this contains all run boundary samples (= run_pos/run_sa copy).
 	 * For s>1, this contains all BWT positions with SA divisible by s,
 	 * collected during the backward walk from sentinels.
 	 *
-	 * sub_pos[] is sorted by BWT position for O(log(n/s)) binary search.
-	 */
-	int64_t n_sub;       /* number of subsampled SA entries */
-	int64_t *sub_pos;    /* BWT positions, sorted */
-	int64_t *sub_sa;     /* SA values at sub_pos positions */
-	/*
-	 * Bitvector for O(1) sub_pos membership test in locate_one.
-	 * sub_bv[i/64] has bit (i%64) set iff BWT position i is in sub_pos[].
-	 * Allocated during build/restore; size = ceil(n/64) * 8 bytes.
-	 * Much smaller and faster than binary searching sub_pos[].
+	 * The positions are kept as a bitvector: sub_bv[i/64] has bit (i%64) set
+	 * iff BWT position i is sampled, and the rank of i among the sampled
+	 * positions indexes sub_sa[]. sub_rank[j] is the number of bits set in
+	 * sub_bv[0..8j), so a rank takes at most eight popcounts. The bitvector
+	 * and the directory take n/64+n/512 words, less than coding the sorted
+	 * positions themselves once n_sub > n/64.
 	 */
-	uint64_t *sub_bv;    /* bitvector, ceil(n/64) uint64_t words */
-	int32_t sub_is_alias; /* if true, sub_pos/sub_sa alias run_pos/run_sa (s=1) */
+	int64_t n_sub;        /* number of subsampled SA entries */
+	uint64_t *sub_sa;     /* SA values at sampled positions in BWT order, packed */
+	uint64_t *sub_bv;     /* bitvector, ceil(n/64) uint64_t words */
+	int64_t *sub_rank;    /* rank directory over sub_bv, one entry per 8 words */
+	int32_t sub_is_alias; /* if true, sub_sa aliases run_sa (s=1) */
 	/*
 	 * Multi-string support: cumulative sequence lengths and text-order mapping.
 	 * For multi-string BWTs, SA values are absolute text positions.
-	 * cum_len[i] = start of the i-th sequence in text order.
-	 * cum_len[m] = total text length.
+	 * seq_st[i] = start of the i-th sequence in text order; the sequences
+	 * end at n. It is Elias-Fano coded, so that a predecessor query maps an
+	 * SA value to its sequence.
 	 * text_order_sid[i] = BWT sentinel position (= sequence ID) for the i-th
 	 *                     sequence in text order.
 	 */
 	int64_t m;           /* number of sentinels (sequences) */
-	int64_t *cum_len;    /* cumulative lengths, size m+1 */
+	rb3_ef_t seq_st;     /* sequence starts, m entries */
 	int64_t *text_order_sid; /* sentinel BWT positions in text order, size m */
+	void *mm;            /* non-NULL if the arrays point into an mmapped file */
+	size_t mm_len;
 } rb3_srindex_t;
 
 /* Build the SR-index phi function from an FM-index.
@@ -95,6 +141,22 @@ typedef struct {
  */
 rb3_srindex_t *rb3_srindex_build(const void *f, int32_t s, int n_threads);
 
+#define RB3_SRI_MAX_MEM (4LL<<30) /* default cap on samples buffered in memory during construction */
+
+/* Same as rb3_srindex_build(), buffering at most max_mem bytes of samples in
+ * memory during the walks; the rest is sorted and spilled to $TMPDIR.
+ */
+rb3_srindex_t *rb3_srindex_build2(const void *f, int32_t s, int n_threads, int64_t max_mem);
+
+/* Update sr0 for an index whose first sr0->m sequences are those of sr0, such
+ * as one extended with "build -i" or merged. Only the new sequences are walked;
+ * the samples of the old ones are moved to their positions in the new BWT.
+ * @param sr0        SR-index of the first sequences; not modified
+ * @param f          FM-index of all sequences
+ * @return           allocated SR-index with the parameter s of sr0, or NULL on failure
+ */
+rb3_srindex_t *rb3_srindex_update(const rb3_srindex_t *sr0, const void *f, int n_threads, int64_t max_mem);
+
 /* Evaluate the phi function: phi(sa_val) = SA[k-1] where SA[k] = sa_val.
  * @param sr       SR-index
  * @param sa_val   a suffix array value (text position)
@@ -102,6 +164,11 @@ rb3_srindex_t *rb3_srindex_build(const void *f, int32_t s, int n_threads);
  */
 int64_t rb3_srindex_phi(const rb3_srindex_t *sr, int64_t sa_val);
 
+/* Evaluate phi on n independent values: out[i] = phi(v[i]). The memory
+ * accesses of the n queries are overlapped; v and out may be the same array.
+ */
+void rb3_srindex_phi_batch(const rb3_srindex_t *sr, int64_t n, const int64_t *v, int64_t *out);
+
 /* Look up the toehold: given a BWT position that is at or near the end of
  * a run, return the stored SA value.
  * @param sr       SR-index
@@ -149,9 +216,22 @@ void rb3_srindex_destroy(rb3_srindex_t *sr);
 /* Serialize SR-index to a binary file (.sri format). */
 int rb3_srindex_dump(const rb3_srindex_t *sr, const char *fn);
 
-/* Deserialize SR-index from a binary file (.sri format). */
+/* Write SR-index in the .sri format to fp; returns the number of bytes written */
+int64_t rb3_srindex_write(const rb3_srindex_t *sr, FILE *fp);
+
+/* Deserialize SR-index from a binary file (.sri format). Returns NULL for a
+ * pre-"SRI\5" file built with adjacent sentinels merged into one run. */
 rb3_srindex_t *rb3_srindex_restore(const char *fn);
 
+/* Deserialize SR-index stored at byte offset off of a file (e.g. a section of an index container). */
+rb3_srindex_t *rb3_srindex_restore_at(const char *fn, int64_t off);
+
+/* Zero-copy for the "SRI\5" format; falls back to rb3_srindex_restore() otherwise */
+rb3_srindex_t *rb3_srindex_restore_mmap(const char *fn);
+
+/* Zero-copy for "SRI\5" stored in [off,off+size) of a file; off must be a multiple of the page size */
+rb3_srindex_t *rb3_srindex_restore_mmap_at(const char *fn, int64_t off, int64_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,6 +1,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "rb3priv.h"
 #include "fm-index.h"
 #include "kalloc.h"
@@ -12,50 +17,134 @@
  * ssa construction *
  ********************/
 
-typedef struct { size_t n, m; uint64_t *a; } uint64_v;
+/*
+ * SSA is generated in two passes such that long sequences don't leave threads
+ * idle. The first pass walks LF from each sentinel row and from each sampled
+ * row, and stops at the next sampled row or at a sentinel. These segments are
+ * 2^ss steps long on average and are walked in parallel; together they visit
+ * every BWT row once. Each task advances SSA_WALK_BATCH segments in
+ * round-robin, prefetching the rank blocks of a round before using any of
+ * them, such that the dependent rank calls of different walks overlap. The
+ * second pass links the segments of each sequence and turns the step counts
+ * into offsets; it only touches the samples.
+ */
+#define SSA_WALK_BATCH 32
 
-static void ssa_gen1(void *km, const rb3_fmi_t *f, rb3_ssa_t *sa, int64_t k, uint64_v *buf)
+typedef struct {
+	const rb3_fmi_t *f;
+	rb3_ssa_t *sa;
+	int64_t *next; // next[i]: the sampled row reached from start i as (k-acc[1])>>ss, or -1-k if sentinel k is reached
+	int64_t *d0; // d0[k0]: number of steps from sentinel row k0; those from sampled rows are kept in sa->ssa[]
+	int64_t n_done, n_tot, n_rep; // for progress report; n_rep: the last decile reported
+	pthread_mutex_t lock;
+} ssa_walk_t;
+
+static void ssa_walk_worker(void *data, long b, int tid) // walk starts [b*SSA_WALK_BATCH,(b+1)*SSA_WALK_BATCH)
 {
-	int32_t c, mask = (1<<sa->ss) - 1;
-	int64_t ok[RB3_ASIZE], k0 = k, l = 0;
-	size_t i;
-	buf->n = 0;
-	do {
-		++l;
-		c = rb3_fmi_rank1a(f, k, ok);
-		k = f->acc[c] + ok[c];
-		if (c) {
-			if (((k - f->acc[1]) & mask) == 0) {
-				int64_t x = (k - f->acc[1]) >> sa->ss;
-				assert(x < sa->n_ssa);
-				sa->ssa[x] = l;
-				Kgrow(km, uint64_t, buf->a, buf->n, buf->m);
-				buf->a[buf->n++] = x;
+	ssa_walk_t *w = (ssa_walk_t*)data;
+	const rb3_fmi_t *f = w->f;
+	rb3_ssa_t *sa = w->sa;
+	int32_t j, n_act, act[SSA_WALK_BATCH], mask = (1<<sa->ss) - 1;
+	int64_t i, st = b * SSA_WALK_BATCH, en = st + SSA_WALK_BATCH, k[SSA_WALK_BATCH], l[SSA_WALK_BATCH], d = 0, x, y;
+	if (en > sa->m + sa->n_ssa) en = sa->m + sa->n_ssa;
+	for (i = st, n_act = 0; i < en; ++i, ++n_act)
+		act[n_act] = n_act, l[n_act] = 0, k[n_act] = i < sa->m? i : f->acc[1] + ((i - sa->m) << sa->ss);
+	while (n_act > 0) {
+		int32_t t;
+		for (j = 0; j < n_act; ++j)
+			rb3_fmi_prefetch(f, k[act[j]], 0);
+		for (j = 0; j < n_act; ++j)
+			rb3_fmi_prefetch(f, k[act[j]], 1);
+		for (j = t = 0; j < n_act; ++j) {
+			int32_t a = act[j], c;
+			int64_t ok[RB3_ASIZE];
+			c = rb3_fmi_rank1a(f, k[a], ok);
+			k[a] = f->acc[c] + ok[c], ++l[a];
+			if (c && ((k[a] - f->acc[1]) & mask) != 0) {
+				act[t++] = a;
+				continue;
 			}
-		} else sa->r2i[k] = k0;
-	} while (c);
-	for (i = 0; i < buf->n; ++i)
-		sa->ssa[buf->a[i]] = (l - 1 - sa->ssa[buf->a[i]]) << sa->ms | k0;
+			i = st + a; // the walk from start i stops here
+			w->next[i] = c? (k[a] - f->acc[1]) >> sa->ss : -1 - k[a];
+			if (i < sa->m) w->d0[i] = l[a];
+			else sa->ssa[i - sa->m] = l[a];
+			d += l[a];
+		}
+		n_act = t;
+	}
+	x = __sync_fetch_and_add(&w->n_done, d);
+	y = (x + d) * 10 / w->n_tot;
+	if (y > x * 10 / w->n_tot && rb3_verbose >= 3) { // report each decile once and in order
+		pthread_mutex_lock(&w->lock);
+		if (y > w->n_rep) {
+			w->n_rep = y;
+			fprintf(stderr, "[M::%s::%.3f*%.2f] walked %ld0%% of the BWT\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)y);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
 }
 
-typedef struct {
-	void **km;
-	const rb3_fmi_t *f;
-	rb3_ssa_t *sa;
-	uint64_v *buf;
-} worker_t;
+static void ssa_link_worker(void *data, long k0, int tid)
+{
+	ssa_walk_t *w = (ssa_walk_t*)data;
+	rb3_ssa_t *sa = w->sa;
+	int64_t x, l = w->d0[k0], m = sa->m;
+	for (x = w->next[k0]; x >= 0; x = w->next[m + x]) // length of the sequence
+		l += sa->ssa[x];
+	sa->r2i[-1 - x] = k0;
+	for (x = w->next[k0], l -= w->d0[k0] + 1; x >= 0; ) { // l: offset of sample x
+		int64_t y = w->next[m + x], d = sa->ssa[x];
+		sa->ssa[x] = (uint64_t)l << sa->ms | k0;
+		l -= d, x = y;
+	}
+}
+
+/*
+ * Bit packing. r2i[] and ssa[] are generated and read from old files with
+ * one uint64_t per entry. They are then packed in place with the fewest bits
+ * that hold the largest entry, followed by a zero word so that
+ * rb3_bits_get() can always read two words without a branch.
+ */
+static inline int64_t ssa_n_words(int64_t n, int32_t w)
+{
+	return (int64_t)(((uint64_t)n * w + 63) >> 6) + 1;
+}
+
+static uint64_t *ssa_pack1(uint64_t *a, int64_t n, int32_t *w_)
+{
+	int64_t i, j, n_words;
+	int32_t w = 1, s = 0;
+	uint64_t max = 0, cur = 0;
+	for (i = 0; i < n; ++i)
+		max = max > a[i]? max : a[i];
+	while (w < 64 && max >> w) ++w;
+	for (i = j = 0; i < n; ++i) { // a[j] is written after a[0..j] have been read
+		uint64_t x = a[i];
+		cur |= x << s;
+		if (s + w >= 64) {
+			a[j++] = cur;
+			cur = s? x >> (64 - s) : 0;
+			s = s + w - 64;
+		} else s += w;
+	}
+	if (s > 0) a[j++] = cur;
+	n_words = ssa_n_words(n, w);
+	a = RB3_REALLOC(uint64_t, a, n_words);
+	for (; j < n_words; ++j) a[j] = 0;
+	*w_ = w;
+	return a;
+}
 
-static void worker(void *data, long i, int tid)
+static void ssa_pack(rb3_ssa_t *sa)
 {
-	worker_t *w = (worker_t*)data;
-	ssa_gen1(w->km[tid], w->f, w->sa, i, &w->buf[tid]);
+	sa->r2i = ssa_pack1(sa->r2i, sa->m, &sa->wr);
+	sa->ssa = ssa_pack1(sa->ssa, sa->n_ssa, &sa->ws);
 }
 
 rb3_ssa_t *rb3_ssa_gen(const rb3_fmi_t *f, int ssa_shift, int n_threads)
 {
 	rb3_ssa_t *sa;
-	worker_t *w;
-	int i;
+	ssa_walk_t w;
 
 	sa = RB3_CALLOC(rb3_ssa_t, 1);
 	sa->ss = ssa_shift;
@@ -65,25 +154,27 @@ rb3_ssa_t *rb3_ssa_gen(const rb3_fmi_t *f, int ssa_shift, int n_threads)
 	sa->r2i = RB3_CALLOC(uint64_t, sa->m);
 	sa->ssa = RB3_CALLOC(uint64_t, sa->n_ssa);
 
-	w = RB3_CALLOC(worker_t, 1);
-	w->km = RB3_CALLOC(void*, n_threads);
-	for (i = 0; i < n_threads; ++i)
-		w->km[i] = km_init();
-	w->buf = RB3_CALLOC(uint64_v, n_threads);
-	w->sa = sa, w->f = f;
-
-	kt_for(n_threads, worker, w, sa->m);
-
-	for (i = 0; i < n_threads; ++i)
-		km_destroy(w->km[i]);
-	free(w->km); free(w->buf); free(w);
+	memset(&w, 0, sizeof(w));
+	w.f = f, w.sa = sa, w.n_tot = f->acc[RB3_ASIZE] > 0? f->acc[RB3_ASIZE] : 1;
+	w.next = RB3_MALLOC(int64_t, sa->m + sa->n_ssa);
+	w.d0 = RB3_MALLOC(int64_t, sa->m);
+	pthread_mutex_init(&w.lock, 0);
+	kt_for(n_threads, ssa_walk_worker, &w, (sa->m + sa->n_ssa + SSA_WALK_BATCH - 1) / SSA_WALK_BATCH);
+	kt_for(n_threads, ssa_link_worker, &w, sa->m);
+	if (rb3_verbose >= 3)
+		fprintf(stderr, "[M::%s::%.3f*%.2f] linked %ld samples on %ld sequences\n", __func__, rb3_realtime(), rb3_percent_cpu(), (long)sa->n_ssa, (long)sa->m);
+	pthread_mutex_destroy(&w.lock);
+	free(w.next); free(w.d0);
+	ssa_pack(sa);
 	return sa;
 }
 
 void rb3_ssa_destroy(rb3_ssa_t *sa)
 {
 	if (sa == 0) return;
-	free(sa->r2i); free(sa->ssa); free(sa);
+	if (sa->mm) munmap(sa->mm, sa->mm_len);
+	else free(sa->r2i), free(sa->ssa);
+	free(sa);
 }
 
 /**************
@@ -95,6 +186,7 @@ int64_t rb3_ssa(const rb3_fmi_t *f, const rb3_ssa_t *sa, int64_t k, int64_t *si)
 	int32_t c, mask = (1<<sa->ss) - 1;
 	int64_t x = 0;
 	int64_t ok[RB3_ASIZE];
+	uint64_t v;
 	*si = -1;
 	if (k >= f->acc[6]) return -1;
 	while (k < f->acc[1] || ((k - f->acc[1]) & mask)) {
@@ -102,13 +194,13 @@ int64_t rb3_ssa(const rb3_fmi_t *f, const rb3_ssa_t *sa, int64_t k, int64_t *si)
 		c = rb3_fmi_rank1a(f, k, ok);
 		k = f->acc[c] + ok[c];
 		if (c == 0) {
-			*si = sa->r2i[k];
+			*si = rb3_ssa_r2i(sa, k);
 			return x - 1;
 		}
 	}
-	k = (k - f->acc[1]) >> sa->ss;
-	*si = sa->ssa[k] & ((1ULL<<sa->ms) - 1);
-	return x + (sa->ssa[k] >> sa->ms);
+	v = rb3_ssa_get(sa, (k - f->acc[1]) >> sa->ss);
+	*si = v & ((1ULL<<sa->ms) - 1);
+	return x + (v >> sa->ms);
 }
 
 typedef struct {
@@ -142,10 +234,12 @@ static int32_t ssa_add_intv(const rb3_ssa_t *ssa, ssa_aux_t *aux, int64_t lo, in
 	if (aux->n_sa == aux->max_sa) return -1;
 	for (; k < hi; k += 1LL << ssa->ss) {
 		int64_t l = (k - m) >> ssa->ss;
+		uint64_t v;
 		if (k < lo) continue;
 		assert(l < ssa->n_ssa && aux->n_sa < aux->max_sa);
-		aux->sa[aux->n_sa].sid = ssa->ssa[l] & ((1LL << ssa->ms) - 1);
-		aux->sa[aux->n_sa].pos = off + (ssa->ssa[l] >> ssa->ms);
+		v = rb3_ssa_get(ssa, l);
+		aux->sa[aux->n_sa].sid = v & ((1LL << ssa->ms) - 1);
+		aux->sa[aux->n_sa].pos = off + (v >> ssa->ms);
 		aux->n_sa++;
 		if (aux->n_sa == aux->max_sa) return -1;
 		if (lo < k) ssa_add_intv1(aux, lo, k, off);
@@ -155,91 +249,345 @@ static int32_t ssa_add_intv(const rb3_ssa_t *ssa, ssa_aux_t *aux, int64_t lo, in
 	return 0;
 }
 
+static int ssa_step(const rb3_fmi_t *f, const rb3_ssa_t *ssa, ssa_aux_t *aux, void *rc) // process the largest pending interval; return 0 when finished
+{
+	int64_t l, ok[RB3_ASIZE], ol[RB3_ASIZE];
+	int32_t c;
+	ssa_intv_t x;
+	if (aux->n_a == 0 || aux->n_sa >= aux->max_sa) return 0;
+	x = aux->a[0];
+	--aux->n_a;
+	if (aux->n_a > 0) { // maintain heap
+		aux->a[0] = aux->a[aux->n_a];
+		ks_heapdown_ssa_intv(0, aux->n_a, aux->a);
+	}
+	rb3_fmi_rank2a_cached(f, rc, x.lo, x.hi, ok, ol);
+	for (l = ok[0]; l < ol[0]; ++l) { // reaching sentinels
+		aux->sa[aux->n_sa].sid = rb3_ssa_r2i(ssa, l);
+		aux->sa[aux->n_sa].pos = x.off;
+		aux->n_sa++;
+		if (aux->n_sa == aux->max_sa) return 0;
+	}
+	for (c = 1; c < 6; ++c)
+		if (ok[c] < ol[c])
+			ssa_add_intv(ssa, aux, f->acc[c] + ok[c], f->acc[c] + ol[c], x.off + 1);
+	return aux->n_a > 0 && aux->n_sa < aux->max_sa;
+}
+
+static void ssa_aux_init(void *km, const rb3_fmi_t *f, const rb3_ssa_t *ssa, ssa_aux_t *aux, int64_t lo, int64_t hi, int64_t max_sa, rb3_pos_t *sa)
+{
+	memset(aux, 0, sizeof(*aux));
+	aux->max_sa = max_sa < hi - lo? max_sa : hi - lo;
+	aux->m_a = 256, aux->n_a = 0;
+	aux->a = Kmalloc(km, ssa_intv_t, aux->m_a);
+	aux->km = km, aux->sa = sa, aux->n0 = f->acc[1];
+	ssa_add_intv(ssa, aux, lo, hi, 0);
+}
+
+#define pos_lt(a, b) ((a).sid < (b).sid || ((a).sid == (b).sid && (a).pos < (b).pos))
+KSORT_INIT(ssa_pos, rb3_pos_t, pos_lt)
+
+static inline void ssa_sort_pos(int64_t n, rb3_pos_t *sa) // all positions of an interval are reported by (sid,pos), however they are found
+{
+	ks_heapmake_ssa_pos(n, sa);
+	ks_heapsort_ssa_pos(n, sa);
+}
+
 int64_t rb3_ssa_multi(void *km, const rb3_fmi_t *f, const rb3_ssa_t *ssa, int64_t lo, int64_t hi, int64_t max_sa, rb3_pos_t *sa)
 {
 	ssa_aux_t aux;
-	int64_t ok[RB3_ASIZE], ol[RB3_ASIZE];
 	if (max_sa == 0 || lo >= hi) return 0;
-	memset(&aux, 0, sizeof(aux));
-	aux.max_sa = max_sa < hi - lo? max_sa : hi - lo;
-	aux.m_a = 256, aux.n_a = 0;
-	aux.a = Kmalloc(km, ssa_intv_t, aux.m_a);
-	aux.km = km, aux.sa = sa, aux.n0 = f->acc[1];
-	ssa_add_intv(ssa, &aux, lo, hi, 0);
-	while (aux.n_a > 0 && aux.n_sa < aux.max_sa) {
-		int64_t l;
-		int32_t c;
-		ssa_intv_t x = aux.a[0];
-		--aux.n_a;
-		if (aux.n_a > 0) { // maintain heap
-			aux.a[0] = aux.a[aux.n_a];
-			ks_heapdown_ssa_intv(0, aux.n_a, aux.a);
+	ssa_aux_init(km, f, ssa, &aux, lo, hi, max_sa, sa);
+	while (ssa_step(f, ssa, &aux, 0)) {}
+	kfree(km, aux.a);
+	if (aux.n_sa == hi - lo) ssa_sort_pos(aux.n_sa, sa);
+	return aux.n_sa;
+}
+
+/*
+ * Locate many intervals together. SA intervals of patterns are either nested
+ * or disjoint. An interval with at most max_sa positions is located in full,
+ * so the intervals nested in it are cut into disjoint segments, each located
+ * once into the output of the outermost interval; the nested intervals then
+ * copy their slices. Larger intervals are truncated by rb3_ssa_multi() and
+ * are located on their own, with identical ones located once. Segments and
+ * large intervals advance in lock-step, SSA_BATCH_SIZE at a time and one LF
+ * step each per round, such that the rank blocks of a round can be prefetched
+ * before any of them is used. Ranks are memoized across intervals as MEMs of
+ * the same query often reach the same sub-intervals after a few LF steps.
+ *
+ * Every interval gets the same positions in the same order as rb3_ssa_multi():
+ * the walk order if truncated and the (sid,pos) order if complete, such that
+ * the result only depends on the interval and can be cached.
+ */
+#define SSA_BATCH_SIZE 128
+
+typedef struct {
+	int64_t lo, hi;
+	int32_t i;
+} ssa_bintv_t;
+
+#define bintv_lt(x, y) ((x).lo < (y).lo || ((x).lo == (y).lo && ((x).hi > (y).hi || ((x).hi == (y).hi && (x).i < (y).i))))
+KSORT_INIT(ssa_bintv, ssa_bintv_t, bintv_lt)
+KSORT_INIT(ssa_i64, int64_t, ks_lt_generic)
+
+typedef struct {
+	int64_t lo, hi, max_sa;
+	int64_t *n_sa; // incremented by the number of positions found
+	rb3_pos_t *sa;
+} ssa_job_t;
+
+static void ssa_run_jobs(void *km, const rb3_fmi_t *f, const rb3_ssa_t *ssa, int32_t n_job, const ssa_job_t *job)
+{
+	ssa_aux_t *aux;
+	int32_t j, k, n_act = 0, next = 0, *jid;
+	void *rc;
+	aux = Kcalloc(km, ssa_aux_t, SSA_BATCH_SIZE);
+	jid = Kmalloc(km, int32_t, SSA_BATCH_SIZE);
+	rc = rb3_r2cache_init(km, 0);
+	while (n_act > 0 || next < n_job) {
+		for (; n_act < SSA_BATCH_SIZE && next < n_job; ++next) { // refill the slots of finished jobs
+			const ssa_job_t *p = &job[next];
+			ssa_aux_init(km, f, ssa, &aux[n_act], p->lo, p->hi, p->max_sa, p->sa);
+			if (aux[n_act].n_a > 0 && aux[n_act].n_sa < aux[n_act].max_sa) {
+				jid[n_act++] = next;
+			} else {
+				*p->n_sa += aux[n_act].n_sa;
+				kfree(km, aux[n_act].a);
+			}
+		}
+		for (k = 0; k < n_act; ++k) {
+			const ssa_intv_t *x = &aux[k].a[0];
+			rb3_fmi_prefetch(f, x->lo, 0);
+			rb3_fmi_prefetch(f, x->hi, 0);
+		}
+		for (k = 0; k < n_act; ++k) {
+			const ssa_intv_t *x = &aux[k].a[0];
+			rb3_fmi_prefetch(f, x->lo, 1);
+			rb3_fmi_prefetch(f, x->hi, 1);
+		}
+		for (k = j = 0; k < n_act; ++k) {
+			if (ssa_step(f, ssa, &aux[k], rc)) {
+				aux[j] = aux[k], jid[j++] = jid[k];
+			} else {
+				*job[jid[k]].n_sa += aux[k].n_sa;
+				kfree(km, aux[k].a);
+			}
+		}
+		n_act = j;
+	}
+	rb3_r2cache_destroy(rc);
+	kfree(km, jid); kfree(km, aux);
+}
+
+void rb3_ssa_multi_batch(void *km, const rb3_fmi_t *f, const rb3_ssa_t *ssa, int32_t n, const int64_t *lo, const int64_t *hi, int64_t max_sa, int64_t *n_sa, rb3_pos_t **sa)
+{
+	ssa_bintv_t *b;
+	ssa_job_t *job;
+	int64_t *cut;
+	int32_t i, j, k, n_job = 0, *own;
+	if (n <= 0) return;
+	for (i = 0; i < n; ++i) n_sa[i] = 0;
+	if (max_sa <= 0) return;
+	b = Kmalloc(km, ssa_bintv_t, n);
+	for (i = 0; i < n; ++i)
+		b[i].lo = lo[i], b[i].hi = hi[i], b[i].i = i;
+	ks_heapmake_ssa_bintv(n, b);
+	ks_heapsort_ssa_bintv(n, b); // by lo, then by hi in the descending order, such that an interval comes before those nested in it
+	own = Kmalloc(km, int32_t, n); // own[k] is the interval in b[] whose output holds that of b[k]
+	job = Kmalloc(km, ssa_job_t, 2 * n);
+	cut = Kmalloc(km, int64_t, 2 * n);
+	for (i = 0; i < n; i = j) {
+		const ssa_bintv_t *p = &b[i];
+		int32_t n_cut = 0;
+		if (p->lo >= p->hi) {
+			own[i] = -1, j = i + 1;
+			continue;
+		}
+		if (p->hi - p->lo > max_sa) { // truncated; only identical intervals can share the output
+			for (j = i; j < n && b[j].lo == p->lo && b[j].hi == p->hi; ++j)
+				own[j] = i;
+			job[n_job].lo = p->lo, job[n_job].hi = p->hi, job[n_job].max_sa = max_sa;
+			job[n_job].n_sa = &n_sa[p->i], job[n_job++].sa = sa[p->i];
+			continue;
 		}
-		rb3_fmi_rank2a(f, x.lo, x.hi, ok, ol);
-		for (l = ok[0]; l < ol[0]; ++l) { // reaching sentinels
-			aux.sa[aux.n_sa].sid = ssa->r2i[l];
-			aux.sa[aux.n_sa].pos = x.off;
-			aux.n_sa++;
-			if (aux.n_sa == aux.max_sa) goto end_ssa_multi;
+		for (j = i; j < n && b[j].hi <= p->hi; ++j) { // b[j].lo >= p->lo as b[] is sorted
+			own[j] = i;
+			if (b[j].lo < b[j].hi) cut[n_cut++] = b[j].lo, cut[n_cut++] = b[j].hi;
+		}
+		ks_heapmake_ssa_i64(n_cut, cut);
+		ks_heapsort_ssa_i64(n_cut, cut);
+		for (k = 1; k < n_cut; ++k) {
+			if (cut[k] == cut[k-1]) continue;
+			job[n_job].lo = cut[k-1], job[n_job].hi = cut[k], job[n_job].max_sa = cut[k] - cut[k-1];
+			job[n_job].n_sa = &n_sa[p->i], job[n_job++].sa = sa[p->i] + (cut[k-1] - p->lo);
 		}
-		for (c = 1; c < 6; ++c)
-			if (ok[c] < ol[c])
-				ssa_add_intv(ssa, &aux, f->acc[c] + ok[c], f->acc[c] + ol[c], x.off + 1);
 	}
-end_ssa_multi:
-	kfree(km, aux.a);
-	return aux.n_sa;
+	kfree(km, cut);
+	ssa_run_jobs(km, f, ssa, n_job, job);
+	for (k = 0; k < n; ++k) { // copy to nested and identical intervals
+		const ssa_bintv_t *p = &b[k], *q;
+		int64_t m;
+		if (own[k] < 0 || own[k] == k || p->lo >= p->hi) continue;
+		q = &b[own[k]];
+		m = p->lo == q->lo && p->hi == q->hi? n_sa[q->i] : p->hi - p->lo;
+		n_sa[p->i] = m;
+		memcpy(sa[p->i], sa[q->i] + (p->lo - q->lo), m * sizeof(rb3_pos_t));
+	}
+	for (i = 0; i < n; ++i) // only after the copies above, which take slices in the BWT order
+		if (lo[i] < hi[i] && n_sa[i] == hi[i] - lo[i])
+			ssa_sort_pos(n_sa[i], sa[i]);
+	kfree(km, job); kfree(km, own); kfree(km, b);
 }
 
 /***********
  * ssa I/O *
  ***********/
 
-int rb3_ssa_dump(const rb3_ssa_t *sa, const char *fn)
+/*
+ * .ssa file format:
+ *
+ *   char     magic[4]   "SSA\3"
+ *   int32_t  ss
+ *   int32_t  ms
+ *   int64_t  m
+ *   int64_t  n_ssa
+ *   int32_t  wr         bits per r2i[] entry
+ *   int32_t  ws         bits per ssa[] entry
+ *   int32_t  padding    keeps the arrays below 8-byte aligned
+ *   uint64_t r2i[ssa_n_words(m,wr)]
+ *   uint64_t ssa[ssa_n_words(n_ssa,ws)]
+ *
+ * "SSA\1" has no wr/ws or padding and stores one uint64_t per entry. It is
+ * packed on loading.
+ */
+#define RB3_SSA_HDR_SIZE 40
+
+int64_t rb3_ssa_write(const rb3_ssa_t *sa, FILE *fp)
 {
 	uint32_t y;
-	FILE *fp;
-	fp = fn && strcmp(fn, "-")? fopen(fn, "wb") : fdopen(1, "wb");
-	if (fp == 0) return -1;
-	fwrite("SSA\1", 1, 4, fp);
+	int64_t nr = ssa_n_words(sa->m, sa->wr), ns = ssa_n_words(sa->n_ssa, sa->ws);
+	fwrite("SSA\3", 1, 4, fp);
 	y = sa->ss; fwrite(&y, 4, 1, fp);
 	y = sa->ms; fwrite(&y, 4, 1, fp);
 	fwrite(&sa->m, 8, 1, fp);
 	fwrite(&sa->n_ssa, 8, 1, fp);
-	fwrite(sa->r2i, 8, sa->m, fp);
-	fwrite(sa->ssa, 8, sa->n_ssa, fp);
-	fclose(fp);
-	return 0;
+	y = sa->wr; fwrite(&y, 4, 1, fp);
+	y = sa->ws; fwrite(&y, 4, 1, fp);
+	y = 0; fwrite(&y, 4, 1, fp);
+	fwrite(sa->r2i, 8, nr, fp);
+	fwrite(sa->ssa, 8, ns, fp);
+	return RB3_SSA_HDR_SIZE + (nr + ns) * 8;
 }
 
-rb3_ssa_t *rb3_ssa_restore(const char *fn)
+int rb3_ssa_dump(const rb3_ssa_t *sa, const char *fn)
 {
 	FILE *fp;
+	fp = fn && strcmp(fn, "-")? fopen(fn, "wb") : fdopen(1, "wb");
+	if (fp == 0) return -1;
+	rb3_ssa_write(sa, fp);
+	return fclose(fp) == 0? 0 : -1;
+}
+
+static rb3_ssa_t *ssa_read(FILE *fp)
+{
 	uint32_t y;
 	char magic[4];
+	int64_t nr, ns;
 	rb3_ssa_t *sa;
 
-	fp = fn && strcmp(fn, "-")? fopen(fn, "rb") : fdopen(0, "rb");
-	if (fp == 0) return 0;
-	fread(magic, 1, 4, fp);
-	if (strncmp(magic, "SSA\1", 4) != 0) return 0; // wrong magic
+	if (fread(magic, 1, 4, fp) != 4 || (strncmp(magic, "SSA\1", 4) != 0 && strncmp(magic, "SSA\3", 4) != 0)) return 0; // wrong magic
 	sa = RB3_CALLOC(rb3_ssa_t, 1);
 	fread(&y, 4, 1, fp); sa->ss = y;
 	fread(&y, 4, 1, fp); sa->ms = y;
 	fread(&sa->m, 8, 1, fp);
 	fread(&sa->n_ssa, 8, 1, fp);
-	sa->r2i = RB3_CALLOC(uint64_t, sa->m);
-	sa->ssa = RB3_CALLOC(uint64_t, sa->n_ssa);
-	if (sa->ssa == 0 || sa->r2i == 0) {
+	if (magic[3] == 3) {
+		fread(&y, 4, 1, fp); sa->wr = y;
+		fread(&y, 4, 1, fp); sa->ws = y;
+		if (sa->wr < 1 || sa->wr > 64 || sa->ws < 1 || sa->ws > 64) {
+			free(sa);
+			return 0;
+		}
+		fread(&y, 4, 1, fp); // padding
+	} else sa->wr = sa->ws = 64;
+	nr = magic[3] == 3? ssa_n_words(sa->m, sa->wr) : sa->m;
+	ns = magic[3] == 3? ssa_n_words(sa->n_ssa, sa->ws) : sa->n_ssa;
+	sa->r2i = RB3_CALLOC(uint64_t, nr > 0? nr : 1);
+	sa->ssa = RB3_CALLOC(uint64_t, ns > 0? ns : 1);
+	if (sa->ssa == 0 || sa->r2i == 0 || fread(sa->r2i, 8, nr, fp) != (size_t)nr || fread(sa->ssa, 8, ns, fp) != (size_t)ns) {
 		free(sa->r2i); free(sa->ssa); free(sa);
 		return 0;
 	}
-	fread(sa->r2i, 8, sa->m, fp);
-	fread(sa->ssa, 8, sa->n_ssa, fp);
+	if (magic[3] < 3) ssa_pack(sa);
+	return sa;
+}
+
+rb3_ssa_t *rb3_ssa_restore(const char *fn)
+{
+	FILE *fp;
+	rb3_ssa_t *sa;
+	fp = fn && strcmp(fn, "-")? fopen(fn, "rb") : fdopen(0, "rb");
+	if (fp == 0) return 0;
+	sa = ssa_read(fp);
 	fclose(fp);
 	return sa;
 }
 
+rb3_ssa_t *rb3_ssa_restore_mmap_at(const char *fn, int64_t off, int64_t size)
+{
+	rb3_ssa_t *sa;
+	uint8_t *base;
+	int32_t y;
+	int fd;
+	if (size < RB3_SSA_HDR_SIZE || (fd = open(fn, O_RDONLY)) < 0) return 0;
+	base = (uint8_t*)mmap(0, size, PROT_READ, MAP_SHARED, fd, off);
+	close(fd);
+	if (base == MAP_FAILED) return 0;
+	if (memcmp(base, "SSA\3", 4) != 0) { // SSA\1; read into memory and pack
+		FILE *fp;
+		munmap(base, size);
+		if ((fp = fopen(fn, "rb")) == 0) return 0;
+		sa = fseek(fp, off, SEEK_SET) == 0? ssa_read(fp) : 0;
+		fclose(fp);
+		return sa;
+	}
+	sa = RB3_CALLOC(rb3_ssa_t, 1);
+	memcpy(&y, base + 4, 4); sa->ss = y;
+	memcpy(&y, base + 8, 4); sa->ms = y;
+	memcpy(&sa->m, base + 12, 8);
+	memcpy(&sa->n_ssa, base + 20, 8);
+	memcpy(&y, base + 28, 4); sa->wr = y;
+	memcpy(&y, base + 32, 4); sa->ws = y;
+	if (sa->wr < 1 || sa->wr > 64 || sa->ws < 1 || sa->ws > 64
+		|| (uint64_t)size != RB3_SSA_HDR_SIZE + (uint64_t)(ssa_n_words(sa->m, sa->wr) + ssa_n_words(sa->n_ssa, sa->ws)) * 8) {
+		munmap(base, size);
+		free(sa);
+		return 0;
+	}
+	sa->mm = base, sa->mm_len = size;
+	sa->r2i = (uint64_t*)(base + RB3_SSA_HDR_SIZE);
+	sa->ssa = sa->r2i + ssa_n_words(sa->m, sa->wr);
+	return sa;
+}
+
+rb3_ssa_t *rb3_ssa_restore_mmap(const char *fn)
+{
+	struct stat st;
+	FILE *fp;
+	char magic[4];
+	if (fn == 0 || strcmp(fn, "-") == 0) return rb3_ssa_restore(fn);
+	if ((fp = fopen(fn, "rb")) == 0) return 0;
+	if (fread(magic, 1, 4, fp) != 4 || fstat(fileno(fp), &st) != 0) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	if (memcmp(magic, "SSA\3", 4) != 0) // SSA\1 is not packed
+		return rb3_ssa_restore(fn);
+	return rb3_ssa_restore_mmap_at(fn, 0, st.st_size);
+}
+
 /*******************
  * main() function *
  *******************/
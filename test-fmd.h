@@ -0,0 +1,49 @@
+#ifndef TEST_FMD_H
+#define TEST_FMD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+
+/*
+ * Build a symmetric FMD from random sequences and their reverse complements
+ * via libsais. The caller frees fmi.
+ */
+static inline void build_random_fmd(rb3_fmi_t *fmi, int n_seq, int seq_len, int n_mut, uint32_t seed)
+{
+	int64_t len = (int64_t)n_seq * 2 * (seq_len + 1), l = 0;
+	char *seq, *base;
+	int i, j;
+	rld_t *e;
+	srand(seed);
+	seq = (char*)malloc(len + 1);
+	base = (char*)malloc(seq_len);
+	for (j = 0; j < seq_len; ++j)
+		base[j] = 1 + rand() % 4;
+	for (i = 0; i < n_seq; ++i) { // similar sequences to have long matches and large intervals
+		char *s = &seq[l];
+		memcpy(s, base, seq_len);
+		for (j = 0; j < n_mut; ++j)
+			s[rand() % seq_len] = 1 + rand() % 4;
+		s[seq_len] = 0;
+		for (j = 0; j < seq_len; ++j)
+			seq[l + seq_len + 1 + j] = 5 - s[seq_len - 1 - j];
+		seq[l + 2 * seq_len + 1] = 0;
+		l += 2 * (seq_len + 1);
+	}
+	rb3_build_sais(n_seq * 2, len, seq, 1);
+	e = rb3_enc_plain2rld(len, (uint8_t*)seq, 3);
+	rb3_fmi_init(fmi, e, 0);
+	free(base);
+	free(seq);
+}
+
+static inline int pos_cmp(const void *a, const void *b) // by (sid,pos), for comparing sets of positions
+{
+	const rb3_pos_t *x = (const rb3_pos_t*)a, *y = (const rb3_pos_t*)b;
+	if (x->sid != y->sid) return x->sid < y->sid? -1 : 1;
+	return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "move.h"
+#include "io.h"
+#include "srindex.h"
+#include "test-fmd.h"
+
+/*
+ * Test the multi-threaded BGZF writer: the output must decompress to the
+ * input with gzip, including incompressible data and multiple flushes.
+ */
+static int test_bgzf(void)
+{
+	const char *tmpfn = "/tmp/test-io.bgzf.gz";
+	int64_t i, len = 1000000, n_read;
+	uint8_t *data, *back;
+	rb3_bgzf_t *z;
+	FILE *fp;
+	gzFile gz;
+	int ret = 0;
+
+	data = (uint8_t*)malloc(len);
+	back = (uint8_t*)malloc(len + 1);
+	for (i = 0; i < len; ++i) // half text-like, half random
+		data[i] = i < len / 2? "ACGT\t\n0123"[rand() % 10] : rand() & 0xff;
+	fp = fopen(tmpfn, "wb");
+	if (fp == 0) { fprintf(stderr, "FAIL: bgzf: cannot open %s\n", tmpfn); free(data); free(back); return 1; }
+	z = rb3_bgzf_open(fp, 0, 3, -1);
+	for (i = 0; i < len; i += 7777)
+		rb3_bgzf_write(z, &data[i], i + 7777 < len? 7777 : len - i);
+	if (rb3_bgzf_close(z) < 0) ret = 1;
+	fclose(fp);
+	gz = gzopen(tmpfn, "rb");
+	n_read = gzread(gz, back, len + 1);
+	gzclose(gz);
+	if (ret || n_read != len || memcmp(data, back, len) != 0) {
+		fprintf(stderr, "FAIL: bgzf roundtrip (read %ld of %ld bytes)\n", (long)n_read, (long)len);
+		ret = 1;
+	} else fprintf(stderr, "test_bgzf: PASS\n");
+	unlink(tmpfn);
+	free(data); free(back);
+	return ret;
+}
+
+/*
+ * Test the index container: components loaded from a packed index are the
+ * same as those in memory, and a flipped byte is caught by the checksums.
+ */
+static int test_pack(void)
+{
+	rb3_fmi_t fmi = {0}, f2;
+	const char *fn = "/tmp/test-io.fmd", *fn_ssa = "/tmp/test-io.fmd.ssa", *fn_pack = "/tmp/test-io.rb3";
+	rb3_pack_t *pk;
+	int64_t k, ok1[RB3_ASIZE], ok2[RB3_ASIZE];
+	int ret = 0;
+	FILE *fp;
+
+	build_random_fmd(&fmi, 4, 200, 8, 43);
+	fmi.ssa = rb3_ssa_gen(&fmi, 2, 1);
+	rld_dump(fmi.e, fn);
+	rb3_ssa_dump(fmi.ssa, fn_ssa);
+	if (rb3_pack_write(fn, fn_pack) != 0 || rb3_pack_check(fn_pack) != 0 || rb3_fmi_load_all(&f2, fn_pack, RB3_LOAD_ALL) != 0) {
+		fprintf(stderr, "FAIL: pack: failed to create or load %s\n", fn_pack);
+		ret = 1;
+		goto end_pack;
+	}
+	if (memcmp(f2.acc, fmi.acc, sizeof(fmi.acc)) != 0 || f2.ssa == 0 || f2.ssa->mm == 0 || f2.ssa->n_ssa != fmi.ssa->n_ssa
+		|| f2.ssa->ws != fmi.ssa->ws || memcmp(f2.ssa->ssa, fmi.ssa->ssa, (fmi.ssa->n_ssa * fmi.ssa->ws / 64 + 1) * 8) != 0
+		|| f2.ssa->wr != fmi.ssa->wr || memcmp(f2.ssa->r2i, fmi.ssa->r2i, (fmi.ssa->m * fmi.ssa->wr / 64 + 1) * 8) != 0) {
+		fprintf(stderr, "FAIL: pack: loaded index differs\n");
+		ret = 1;
+	}
+	for (k = 0; k < fmi.acc[RB3_ASIZE] && ret == 0; k += 7) {
+		int c1 = rb3_fmi_rank1a(&fmi, k, ok1), c2 = rb3_fmi_rank1a(&f2, k, ok2);
+		if (c1 != c2 || memcmp(ok1, ok2, sizeof(ok1)) != 0) {
+			fprintf(stderr, "FAIL: pack: rank differs at %ld\n", (long)k);
+			ret = 1;
+		}
+	}
+	rb3_fmi_free(&f2);
+	if (ret == 0 && (pk = rb3_pack_read(fn_pack)) != 0) { // flip one byte in the SSA section
+		const rb3_pack_sec_t *sec = rb3_pack_get(pk, "SSA ");
+		if (sec && (fp = fopen(fn_pack, "r+b")) != 0) {
+			int c;
+			fseek(fp, sec->off + sec->size / 2, SEEK_SET);
+			c = fgetc(fp);
+			fseek(fp, sec->off + sec->size / 2, SEEK_SET);
+			fputc(c ^ 1, fp);
+			fclose(fp);
+		}
+		if (sec == 0 || rb3_pack_check(fn_pack) != 1) {
+			fprintf(stderr, "FAIL: pack: corruption not detected\n");
+			ret = 1;
+		}
+		rb3_pack_destroy(pk);
+	}
+	if (ret == 0) fprintf(stderr, "test_pack: PASS\n");
+end_pack:
+	unlink(fn); unlink(fn_ssa); unlink(fn_pack);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+/*
+ * Test the binary sequence list against the text one it is converted from,
+ * and that a list with a name offset out of the pool, an unterminated pool or
+ * a truncated gzip'd text list is rejected.
+ */
+static int test_sid_binary(void)
+{
+	const char *fn_txt = "/tmp/test-io.len", *fn_bin = "/tmp/test-io.sid";
+	rb3_sid_t *s0, *s1;
+	int64_t i;
+	int k, ret = 0;
+	FILE *fp;
+
+	fp = fopen(fn_txt, "w");
+	for (i = 0; i < 1000; ++i)
+		fprintf(fp, "seq%ld%s\t%ld\textra\n", (long)i, i % 3 == 0? "_long_name" : "", (long)(i * 37 + 1));
+	fclose(fp);
+	s0 = rb3_sid_read(fn_txt);
+	fp = fopen(fn_bin, "wb");
+	rb3_sid_write(s0, fp);
+	fclose(fp);
+	s1 = rb3_sid_read(fn_bin);
+	if (s0 == 0 || s1 == 0 || s1->mm == 0 || s0->n_seq != 1000 || s1->n_seq != s0->n_seq) {
+		fprintf(stderr, "FAIL: sid_binary: failed to read the sequence lists\n");
+		ret = 1;
+	}
+	for (i = 0; ret == 0 && i < s0->n_seq; ++i) {
+		if (s0->len[i] != s1->len[i] || strcmp(rb3_sid_name(s0, i), rb3_sid_name(s1, i)) != 0) {
+			fprintf(stderr, "FAIL: sid_binary: sequence %ld differs\n", (long)i);
+			ret = 1;
+		}
+	}
+	for (k = 0; ret == 0 && k < 2; ++k) { // corrupt a copy of the binary list
+		rb3_sid_t *s2;
+		int64_t l_pool = s0->l_pool;
+		fp = fopen(fn_bin, "wb");
+		rb3_sid_write(s0, fp);
+		if (k == 0) { // off[5] = l_pool
+			fseek(fp, 24 + 5 * 8, SEEK_SET);
+			fwrite(&l_pool, 8, 1, fp);
+		} else { // the last name is not NUL-terminated
+			fseek(fp, -1, SEEK_END);
+			fputc('x', fp);
+		}
+		fclose(fp);
+		if ((s2 = rb3_sid_read(fn_bin)) != 0) {
+			fprintf(stderr, "FAIL: sid_binary: corrupted list %d accepted\n", k);
+			rb3_sid_destroy(s2);
+			ret = 1;
+		}
+	}
+	if (ret == 0) { // a truncated gzip'd text list is a read error, not a shorter list
+		rb3_sid_t *s2 = 0;
+		gzFile gz = gzopen(fn_bin, "wb");
+		for (i = 0; i < 1000; ++i)
+			gzprintf(gz, "seq%ld\t%ld\n", (long)i, (long)(i * 37 + 1));
+		gzclose(gz);
+		if (truncate(fn_bin, 1000) != 0 || (s2 = rb3_sid_read(fn_bin)) != 0) {
+			fprintf(stderr, "FAIL: sid_binary: truncated gzip'd list accepted\n");
+			if (s2) rb3_sid_destroy(s2);
+			ret = 1;
+		}
+	}
+	if (ret == 0) fprintf(stderr, "test_sid_binary: PASS\n");
+	rb3_sid_destroy(s0); rb3_sid_destroy(s1);
+	unlink(fn_txt); unlink(fn_bin);
+	return ret;
+}
+
+/*
+ * Test component selection in rb3_fmi_load_all(): the SR-index is preferred
+ * over the SSA, the SSA is used when the SR-index is unreadable, and the move
+ * index is always attached.
+ */
+static int test_load_select(void)
+{
+	rb3_fmi_t fmi = {0}, f2;
+	const char *fn = "/tmp/test-io.fmd", *fn_ssa = "/tmp/test-io.fmd.ssa", *fn_sri = "/tmp/test-io.fmd.sri", *fn_mvi = "/tmp/test-io.fmd.mvi";
+	rb3_srindex_t *sr;
+	rb3_move_t *mv;
+	int ret = 0;
+	FILE *fp;
+
+	build_random_fmd(&fmi, 4, 200, 8, 47);
+	fmi.ssa = rb3_ssa_gen(&fmi, 2, 1);
+	sr = rb3_srindex_build(&fmi, 4, 1);
+	mv = rb3_move_build(&fmi);
+	rld_dump(fmi.e, fn);
+	rb3_ssa_dump(fmi.ssa, fn_ssa);
+	rb3_srindex_dump(sr, fn_sri);
+	rb3_move_save(mv, fn_mvi);
+	if (rb3_fmi_load_all(&f2, fn, RB3_LOAD_ALL) != 0 || f2.srindex == 0 || f2.ssa != 0 || f2.mv == 0 || f2.bm == 0) {
+		fprintf(stderr, "FAIL: load_select: SR-index not preferred over SSA\n");
+		ret = 1;
+	}
+	rb3_fmi_free(&f2);
+	fp = fopen(fn_sri, "w");
+	fputs("garbage\n", fp);
+	fclose(fp);
+	if (ret == 0 && (rb3_fmi_load_all(&f2, fn, RB3_LOAD_ALL) != 0 || f2.srindex != 0 || f2.ssa == 0 || f2.ssa->n_ssa != fmi.ssa->n_ssa)) {
+		fprintf(stderr, "FAIL: load_select: no fallback to SSA\n");
+		ret = 1;
+	}
+	if (ret == 0) rb3_fmi_free(&f2);
+	if (ret == 0 && (rb3_fmi_load_all(&f2, fn, 0) != 0 || f2.ssa != 0 || f2.srindex != 0 || f2.mv == 0)) {
+		fprintf(stderr, "FAIL: load_select: locate structures loaded without RB3_LOAD_SSA\n");
+		ret = 1;
+	}
+	if (ret == 0) rb3_fmi_free(&f2);
+	if (ret == 0) fprintf(stderr, "test_load_select: PASS\n");
+	unlink(fn); unlink(fn_ssa); unlink(fn_sri); unlink(fn_mvi);
+	rb3_srindex_destroy(sr);
+	rb3_move_destroy(mv);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+	ret |= test_bgzf();
+	ret |= test_pack();
+	ret |= test_sid_binary();
+	ret |= test_load_select();
+	if (ret == 0)
+		fprintf(stderr, "\nAll tests PASSED\n");
+	else
+		fprintf(stderr, "\nSome tests FAILED\n");
+	return ret;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "kalloc.h"
+
+/*
+ * Test km_reset(): all blocks are released at once, the cores are kept for
+ * reuse and the high-water mark survives the reset.
+ */
+static int test_km_reset(void)
+{
+	void *km = km_init();
+	km_stat_t st0, st1, st2;
+	int32_t i, r, ret = 0;
+	void *p[1000];
+
+	for (r = 0; r < 3 && ret == 0; ++r) {
+		for (i = 0; i < 1000; ++i)
+			p[i] = kmalloc(km, 1 + rand() % 5000);
+		for (i = 0; i < 1000; i += 3)
+			kfree(km, p[i]);
+		km_stat(km, &st0);
+		km_reset(km);
+		km_stat(km, &st1);
+		if (st1.capacity != st0.capacity || st1.available != st1.capacity - st1.n_cores * 16 || st1.peak != st0.peak) {
+			fprintf(stderr, "FAIL: km_reset round %d: cap %ld->%ld, avail %ld, peak %ld->%ld\n", r,
+					(long)st0.capacity, (long)st1.capacity, (long)st1.available, (long)st0.peak, (long)st1.peak);
+			ret = 1;
+		}
+	}
+	for (i = 0; i < 1000; ++i) // the same load fits in the retained cores
+		p[i] = kmalloc(km, 2500);
+	km_stat(km, &st2);
+	if (ret == 0 && st2.capacity != st1.capacity) {
+		fprintf(stderr, "FAIL: km_reset: cores not reused (%ld -> %ld)\n", (long)st1.capacity, (long)st2.capacity);
+		ret = 1;
+	}
+	km_destroy(km);
+	if (ret == 0) fprintf(stderr, "test_km_reset: PASS\n");
+	return ret;
+}
+
+/*
+ * Stress kmalloc/krealloc/kfree with mixed small and large sizes, so that
+ * blocks go through the size-class bins and back to the circular list.
+ */
+static int test_kalloc_bins(void)
+{
+	void *km = km_init();
+	km_stat_t st;
+	int32_t i, k, ret = 0;
+	uint8_t *p[2000];
+	size_t len[2000];
+
+	memset(p, 0, sizeof(p));
+	for (k = 0; k < 200000 && ret == 0; ++k) {
+		i = rand() % 2000;
+		if (p[i]) { // check, then free or grow
+			size_t j;
+			for (j = 0; j < len[i]; ++j)
+				if (p[i][j] != (uint8_t)(i + j)) break;
+			if (j < len[i]) {
+				fprintf(stderr, "FAIL: kalloc bins: block %d corrupted\n", i);
+				ret = 1;
+			}
+			if (rand() % 2) {
+				kfree(km, p[i]), p[i] = 0;
+			} else {
+				size_t l = len[i] + rand() % 300;
+				p[i] = (uint8_t*)krealloc(km, p[i], l);
+				for (j = len[i]; j < l; ++j) p[i][j] = i + j;
+				len[i] = l;
+			}
+		} else {
+			size_t j;
+			len[i] = rand() % 8 == 0? 1000 + rand() % 20000 : 1 + rand() % 900;
+			p[i] = (uint8_t*)kmalloc(km, len[i]);
+			for (j = 0; j < len[i]; ++j) p[i][j] = i + j;
+		}
+	}
+	for (i = 0; i < 2000; ++i) kfree(km, p[i]);
+	km_stat(km, &st);
+	if (ret == 0 && st.available != st.capacity - st.n_cores * 16) {
+		fprintf(stderr, "FAIL: kalloc bins: %ld of %ld bytes available after freeing all\n", (long)st.available, (long)st.capacity);
+		ret = 1;
+	}
+	km_destroy(km);
+	if (ret == 0) fprintf(stderr, "test_kalloc_bins: PASS\n");
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+	ret |= test_km_reset();
+	ret |= test_kalloc_bins();
+	if (ret == 0)
+		fprintf(stderr, "\nAll tests PASSED\n");
+	else
+		fprintf(stderr, "\nSome tests FAILED\n");
+	return ret;
+}
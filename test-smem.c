@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "test-fmd.h"
+
+/*
+ * Test the k-mer interval table: every entry matches backward search, and
+ * TG SMEMs are unchanged when the table is used to jump-start the search.
+ */
+static int test_kmi(void)
+{
+	rb3_fmi_t fmi = {0};
+	rb3_kmi_t *ki;
+	int32_t k = 5, i, ret = 0, oi, li;
+	int64_t x, min_occs[] = {1, 4}, min_lens[] = {1, 4, 5, 9, 30};
+	rb3_sai_v m0 = {0,0,0}, m1 = {0,0,0};
+	uint8_t q[200];
+
+	build_random_fmd(&fmi, 5, 200, 6, 23);
+	ki = rb3_kmi_build(&fmi, k, 2);
+	for (x = 0; x < ki->n_kmer; ++x) {
+		rb3_sai_t ik, ok[RB3_ASIZE], jk = {{0,0},0,0};
+		uint8_t s[16];
+		for (i = 0; i < k; ++i)
+			s[i] = (x >> ((k - 1 - i) * 2) & 3) + 1;
+		rb3_fmd_set_intv(&fmi, s[k-1], &ik);
+		for (i = k - 2; i >= 0; --i) {
+			rb3_fmd_extend(&fmi, &ik, ok, 1);
+			ik = ok[s[i]];
+		}
+		rb3_kmi_get(ki, s, &jk);
+		if (jk.size != ik.size || (ik.size > 0 && (jk.x[0] != ik.x[0] || jk.x[1] != ik.x[1]))) {
+			fprintf(stderr, "FAIL: kmi k-mer %ld: (%ld,%ld,%ld) vs (%ld,%ld,%ld)\n", (long)x,
+				(long)jk.x[0], (long)jk.x[1], (long)jk.size, (long)ik.x[0], (long)ik.x[1], (long)ik.size);
+			ret = 1; goto done;
+		}
+	}
+	for (i = 0; i < 20; ++i) {
+		kstring_t str = {0,0,0};
+		int64_t j, len;
+		rb3_fmi_retrieve(&fmi, rand() % fmi.acc[1], &str);
+		len = str.l;
+		for (j = 0; j < len; ++j)
+			q[j] = j % 23 == 22? 1 + rand() % 4 : strchr("$ACGTN", str.s[j]) - "$ACGTN";
+		free(str.s);
+		for (oi = 0; oi < 2; ++oi) {
+			for (li = 0; li < 5; ++li) {
+				fmi.kmi = 0;
+				rb3_fmd_smem_TG(0, &fmi, len, q, &m0, min_occs[oi], min_lens[li]);
+				fmi.kmi = ki;
+				rb3_fmd_smem_TG(0, &fmi, len, q, &m1, min_occs[oi], min_lens[li]);
+				if (m0.n != m1.n || memcmp(m0.a, m1.a, m0.n * sizeof(rb3_sai_t)) != 0) {
+					fprintf(stderr, "FAIL: kmi smem_TG query=%d occ=%ld len=%ld\n", i, (long)min_occs[oi], (long)min_lens[li]);
+					ret = 1; goto done;
+				}
+			}
+		}
+	}
+	fprintf(stderr, "test_kmi: PASS (%ld %d-mers, 20 queries)\n", (long)ki->n_kmer, k);
+done:
+	fmi.kmi = 0;
+	rb3_kmi_destroy(ki);
+	free(m0.a); free(m1.a);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+/*
+ * Test TG on windows of start positions: concatenating the MEMs of
+ * consecutive windows gives the MEMs of the whole query.
+ */
+static int test_smem_TG_range(void)
+{
+	rb3_fmi_t fmi = {0};
+	int32_t i, ret = 0, oi, li, wi;
+	int64_t min_occs[] = {1, 3}, min_lens[] = {1, 5, 20}, wins[] = {1, 7, 40};
+	rb3_sai_v m0 = {0,0,0}, m1 = {0,0,0}, mw = {0,0,0};
+	uint8_t q[400];
+
+	build_random_fmd(&fmi, 6, 300, 8, 41);
+	for (i = 0; i < 20 && ret == 0; ++i) {
+		kstring_t str = {0,0,0};
+		int64_t j, len;
+		rb3_fmi_retrieve(&fmi, rand() % fmi.acc[1], &str);
+		len = str.l;
+		for (j = 0; j < len; ++j)
+			q[j] = j % 17 == 16? 1 + rand() % 4 : strchr("$ACGTN", str.s[j]) - "$ACGTN";
+		free(str.s);
+		for (oi = 0; oi < 2 && ret == 0; ++oi) {
+			for (li = 0; li < 3 && ret == 0; ++li) {
+				rb3_fmd_smem_TG(0, &fmi, len, q, &m0, min_occs[oi], min_lens[li]);
+				for (wi = 0; wi < 3 && ret == 0; ++wi) {
+					int64_t st;
+					m1.n = 0;
+					for (st = 0; st < len; st += wins[wi]) {
+						rb3_fmd_smem_TG_range(0, &fmi, len, q, st, st + wins[wi] < len? st + wins[wi] : len, &mw, min_occs[oi], min_lens[li]);
+						if (m1.n + mw.n > m1.m) {
+							m1.m = m1.n + mw.n;
+							m1.a = (rb3_sai_t*)realloc(m1.a, m1.m * sizeof(rb3_sai_t));
+						}
+						memcpy(&m1.a[m1.n], mw.a, mw.n * sizeof(rb3_sai_t));
+						m1.n += mw.n;
+					}
+					if (m0.n != m1.n || memcmp(m0.a, m1.a, m0.n * sizeof(rb3_sai_t)) != 0) {
+						fprintf(stderr, "FAIL: smem_TG_range query=%d occ=%ld len=%ld win=%ld\n", i, (long)min_occs[oi], (long)min_lens[li], (long)wins[wi]);
+						ret = 1;
+					}
+				}
+			}
+		}
+	}
+	if (ret == 0) fprintf(stderr, "test_smem_TG_range: PASS\n");
+	free(m0.a); free(m1.a); free(mw.a);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+	ret |= test_smem_TG_range();
+	ret |= test_kmi();
+	if (ret == 0)
+		fprintf(stderr, "\nAll tests PASSED\n");
+	else
+		fprintf(stderr, "\nSome tests FAILED\n");
+	return ret;
+}
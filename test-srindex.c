@@ -5,6 +5,7 @@
 #include "rb3priv.h"
 #include "fm-index.h"
 #include "srindex.h"
+#include "test-fmd.h"
 
 extern int rb3_verbose;
 extern int rb3_dbg_flag;
@@ -45,6 +46,50 @@ static int64_t count_runs(const uint8_t *bwt, int64_t n)
 	return r;
 }
 
+/* Compare the sampled arrays of two SR-indices; return the number of mismatches */
+static int sr_cmp(const rb3_srindex_t *a, const rb3_srindex_t *b)
+{
+	int64_t i;
+	int err = 0;
+	for (i = 0; i < a->n_runs && err < 5; ++i) {
+		if (rb3_ef_get(&a->phi_sa, i) != rb3_ef_get(&b->phi_sa, i)) {
+			fprintf(stderr, "  phi_sa[%lld] mismatch\n", (long long)i);
+			err++;
+		}
+		if (rb3_ef_val(&a->phi_sa, i) != rb3_ef_val(&b->phi_sa, i)) {
+			fprintf(stderr, "  phi_da[%lld] mismatch\n", (long long)i);
+			err++;
+		}
+	}
+	for (i = 0; i < a->n_samples && err < 5; ++i) {
+		if (rb3_ef_get(&a->run_pos, i) != rb3_ef_get(&b->run_pos, i)) {
+			fprintf(stderr, "  run_pos[%lld] mismatch\n", (long long)i);
+			err++;
+		}
+		if (rb3_bits_get(a->run_sa, a->ws, i) != rb3_bits_get(b->run_sa, b->ws, i)) {
+			fprintf(stderr, "  run_sa[%lld] mismatch\n", (long long)i);
+			err++;
+		}
+	}
+	if (memcmp(a->sub_bv, b->sub_bv, (a->n + 63) / 64 * 8) != 0) {
+		fprintf(stderr, "  sub_bv mismatch\n");
+		err++;
+	}
+	for (i = 0; i < a->n_sub && err < 5; ++i) {
+		if (rb3_bits_get(a->sub_sa, a->ws, i) != rb3_bits_get(b->sub_sa, b->ws, i)) {
+			fprintf(stderr, "  sub_sa[%lld] mismatch\n", (long long)i);
+			err++;
+		}
+	}
+	for (i = 0; i < a->m && err < 5; ++i) {
+		if (b->seq_st.n != a->m || rb3_ef_get(&a->seq_st, i) != rb3_ef_get(&b->seq_st, i)) {
+			fprintf(stderr, "  seq_st[%lld] mismatch\n", (long long)i);
+			err++;
+		}
+	}
+	return err;
+}
+
 /*
  * Test the SR-index with a given string and subsampling parameter s.
  * Verifies:
@@ -52,7 +97,7 @@ static int64_t count_runs(const uint8_t *bwt, int64_t n)
  * 2. Toehold correctness at run boundaries
  * 3. locate (original API with provided toehold)
  * 4. locate_one (LF-walk to subsampled sample)
- * 5. locate_all (automatic toehold resolution + phi)
+ * 5. locate_all (automatic toehold resolution + phi) and toehold tracking
  * 6. Space usage
  */
 static int test_string(const char *name, const uint8_t *text, int64_t n, int32_t s)
@@ -121,7 +166,7 @@ static int test_string(const char *name, const uint8_t *text, int64_t n, int32_t
 	{
 		int th_errors = 0;
 		for (i = 0; i < sr->n_samples; ++i) {
-			int64_t pos = sr->run_pos[i];
+			int64_t pos = rb3_ef_get(&sr->run_pos, i);
 			int64_t th = rb3_srindex_toehold(sr, pos);
 			if (th != sa[pos]) {
 				if (th_errors < 5)
@@ -141,12 +186,16 @@ static int test_string(const char *name, const uint8_t *text, int64_t n, int32_t
 	/* 3. Verify locate (original API) with known toehold */
 	{
 		int64_t *out = (int64_t*)malloc(n * sizeof(int64_t));
-		int64_t toehold = sa[n - 1];
+		int64_t toehold = sa[n - 1], lo, hi;
 		int64_t cnt = rb3_srindex_locate(sr, 0, n, toehold, out);
 		if (cnt == n) {
 			int loc_errors = 0;
 			for (i = 0; i < n; ++i)
 				if (out[i] != sa[i]) loc_errors++;
+			for (lo = 0; lo < n; lo += 3) /* sub-intervals, split into phi chains at different run ends */
+				for (hi = lo + 1; hi <= n; hi += 5)
+					if (rb3_srindex_locate(sr, lo, hi, sa[hi - 1], out) != hi - lo || memcmp(out, &sa[lo], (hi - lo) * 8) != 0)
+						loc_errors++;
 			if (loc_errors) {
 				fprintf(stderr, "FAILED: locate had %d mismatches\n", loc_errors);
 				errors++;
@@ -165,7 +214,7 @@ static int test_string(const char *name, const uint8_t *text, int64_t n, int32_t
 	{
 		int lo_errors = 0, lo_tested = 0;
 		for (i = 0; i < sr->n_samples; ++i) {
-			int64_t pos = sr->run_pos[i];
+			int64_t pos = rb3_ef_get(&sr->run_pos, i);
 			int64_t result = rb3_srindex_locate_one(sr, &fmi, pos);
 			if (result != sa[pos]) {
 				if (lo_errors < 5)
@@ -294,12 +343,12 @@ static int test_string(const char *name, const uint8_t *text, int64_t n, int32_t
 			errors++;
 		}
 		if (s > 1) {
-			/* Verify all stored samples have SA % s == 0 */
+			/* Verify all stored samples are a multiple of s from the end of the text */
 			int bad = 0;
 			for (i = 0; i < sr->n_sub; ++i)
-				if (sr->sub_sa[i] % s != 0) bad++;
+				if ((n - 1 - (int64_t)rb3_bits_get(sr->sub_sa, sr->ws, i)) % s != 0) bad++;
 			if (bad) {
-				fprintf(stderr, "FAILED: %d subsampled entries with SA %% s != 0\n", bad);
+				fprintf(stderr, "FAILED: %d subsampled entries with (n-1-SA) %% s != 0\n", bad);
 				errors++;
 			}
 		}
@@ -328,44 +377,7 @@ static int test_string(const char *name, const uint8_t *text, int64_t n, int32_t
 				if (sr2->s != sr->s) { fprintf(stderr, "  roundtrip: s mismatch\n"); rt_errors++; }
 				if (sr2->m != sr->m) { fprintf(stderr, "  roundtrip: m mismatch\n"); rt_errors++; }
 
-				for (i = 0; i < sr->n_runs && rt_errors < 5; ++i) {
-					if (sr2->phi_sa[i] != sr->phi_sa[i]) {
-						fprintf(stderr, "  roundtrip: phi_sa[%lld] %lld != %lld\n",
-						        (long long)i, (long long)sr2->phi_sa[i], (long long)sr->phi_sa[i]);
-						rt_errors++;
-					}
-					if (sr2->phi_da[i] != sr->phi_da[i]) {
-						fprintf(stderr, "  roundtrip: phi_da[%lld] %lld != %lld\n",
-						        (long long)i, (long long)sr2->phi_da[i], (long long)sr->phi_da[i]);
-						rt_errors++;
-					}
-				}
-				for (i = 0; i < sr->n_samples && rt_errors < 5; ++i) {
-					if (sr2->run_pos[i] != sr->run_pos[i]) {
-						fprintf(stderr, "  roundtrip: run_pos[%lld] %lld != %lld\n",
-						        (long long)i, (long long)sr2->run_pos[i], (long long)sr->run_pos[i]);
-						rt_errors++;
-					}
-					if (sr2->run_sa[i] != sr->run_sa[i]) {
-						fprintf(stderr, "  roundtrip: run_sa[%lld] %lld != %lld\n",
-						        (long long)i, (long long)sr2->run_sa[i], (long long)sr->run_sa[i]);
-						rt_errors++;
-					}
-				}
-				if (!sr->sub_is_alias) {
-					for (i = 0; i < sr->n_sub && rt_errors < 5; ++i) {
-						if (sr2->sub_pos[i] != sr->sub_pos[i]) {
-							fprintf(stderr, "  roundtrip: sub_pos[%lld] %lld != %lld\n",
-							        (long long)i, (long long)sr2->sub_pos[i], (long long)sr->sub_pos[i]);
-							rt_errors++;
-						}
-						if (sr2->sub_sa[i] != sr->sub_sa[i]) {
-							fprintf(stderr, "  roundtrip: sub_sa[%lld] %lld != %lld\n",
-							        (long long)i, (long long)sr2->sub_sa[i], (long long)sr->sub_sa[i]);
-							rt_errors++;
-						}
-					}
-				}
+				if (rt_errors == 0) rt_errors += sr_cmp(sr2, sr);
 				/* Verify phi function on restored index */
 				for (i = 1; i < n && rt_errors < 5; ++i) {
 					int64_t phi_val = rb3_srindex_phi(sr2, sa[i]);
@@ -398,10 +410,37 @@ static int test_string(const char *name, const uint8_t *text, int64_t n, int32_t
 				}
 				rb3_srindex_destroy(sr2);
 			}
+			/* The file is used in place when mapped */
+			sr2 = rb3_srindex_restore_mmap(tmpfn);
+			if (sr2 == 0 || sr2->mm == 0 || sr_cmp(sr2, sr) != 0) {
+				fprintf(stderr, "FAILED: mapped SR-index differs\n");
+				errors++;
+			} else {
+				printf("Mapped restore: OK\n");
+			}
+			rb3_srindex_destroy(sr2);
 		}
 		remove(tmpfn);
 	}
 
+	/* 8. Verify that construction spilling to disk gives the same index */
+	{
+		rb3_srindex_t *sr3 = rb3_srindex_build2(&fmi, s, 2, 1);
+		int sp_errors = 0;
+		if (sr3 == 0 || sr3->n_runs != sr->n_runs || sr3->n_samples != sr->n_samples || sr3->n_sub != sr->n_sub) {
+			sp_errors++;
+		} else {
+			sp_errors += sr_cmp(sr3, sr);
+		}
+		if (sp_errors) {
+			fprintf(stderr, "FAILED: SR-index built with a 1-byte memory cap differs\n");
+			errors++;
+		} else {
+			printf("Bounded-memory construction: OK\n");
+		}
+		rb3_srindex_destroy(sr3);
+	}
+
 	rb3_srindex_destroy(sr);
 	rb3_fmi_free(&fmi);
 	free(sa); free(bwt);
@@ -591,6 +630,140 @@ static int test_large_pattern_locate(int32_t s)
 	}
 }
 
+/* Check rb3_ef_get(), rb3_ef_val() and rb3_ef_pred() against the plain
+ * arrays, on sparse and dense random arrays with occasional long gaps. */
+static int test_ef(void)
+{
+	int64_t sizes[] = {1, 2, 300, 5000}, gaps[] = {1, 3, 1000, 1LL<<33};
+	int t, g, errors = 0;
+	uint64_t x = 11;
+
+	printf("=== Elias-Fano coding ===\n");
+	for (t = 0; t < 4; ++t) {
+		for (g = 0; g < 4; ++g) {
+			int64_t n = sizes[t], *a, *v2, i, v = -1, q, j;
+			rb3_ef_t ef;
+			a = (int64_t*)malloc(n * sizeof(int64_t));
+			v2 = (int64_t*)malloc(n * sizeof(int64_t));
+			for (i = 0; i < n; ++i) {
+				x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+				v += 1 + (int64_t)((x >> 33) % gaps[g]);
+				if (i % 97 == 50) v += gaps[g] * 64; /* a long gap */
+				a[i] = v;
+			}
+			for (i = 0; i < n; ++i) v2[i] = (a[i] ^ i) & 0xfffff;
+			rb3_ef_build(&ef, a, n, t & 1? v2 : 0, 20);
+			for (i = 0; i < n && errors < 5; ++i) {
+				if ((t & 1) && rb3_ef_val(&ef, i) != v2[i]) {
+					fprintf(stderr, "  ef_val(%lld) mismatch\n", (long long)i);
+					errors++;
+				}
+				if (rb3_ef_get(&ef, i) != a[i]) {
+					fprintf(stderr, "  ef_get(%lld) = %lld, expected %lld\n", (long long)i, (long long)rb3_ef_get(&ef, i), (long long)a[i]);
+					errors++;
+				}
+			}
+			for (i = 0; i < 2 * n + 10 && errors < 5; ++i) {
+				int64_t y, r;
+				x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+				y = i < n? a[i] - (int64_t)(i & 1) : (int64_t)((x >> 11) % (uint64_t)(a[n-1] + 2)) - 1;
+				for (j = n - 1; j >= 0 && a[j] > y; --j) {}
+				r = rb3_ef_pred(&ef, y, &q);
+				if (r != j || (j >= 0 && q != a[j])) {
+					fprintf(stderr, "  ef_pred(%lld) = %lld, expected %lld\n", (long long)y, (long long)r, (long long)j);
+					errors++;
+				}
+			}
+			rb3_ef_destroy(&ef);
+			free(a); free(v2);
+		}
+	}
+	if (errors == 0) printf("PASSED\n\n");
+	else printf("FAILED (%d errors)\n\n", errors);
+	return errors? 1 : 0;
+}
+
+/*
+ * Test the SR-index on many similar sequences, where sentinels are adjacent in
+ * the BWT and LF walks often reach the start of a sequence: every 4-mer
+ * locates to the same positions as with the SSA.
+ */
+static int test_srindex_multi(void)
+{
+	rb3_fmi_t fmi = {0};
+	int32_t si, ss[] = {1, 4, 16}, ret = 0;
+	int64_t x;
+	rb3_pos_t *p0, *p1;
+
+	build_random_fmd(&fmi, 16, 120, 3, 59);
+	fmi.ssa = rb3_ssa_gen(&fmi, 2, 1);
+	p0 = RB3_MALLOC(rb3_pos_t, fmi.acc[RB3_ASIZE]);
+	p1 = RB3_MALLOC(rb3_pos_t, fmi.acc[RB3_ASIZE]);
+	for (si = 0; si < 3 && ret == 0; ++si) {
+		rb3_srindex_t *sr = rb3_srindex_build(&fmi, ss[si], 1);
+		for (x = 0; x < 256; ++x) {
+			int64_t lo, hi, n0, n1, i;
+			lo = fmi.acc[(x & 3) + 1], hi = fmi.acc[(x & 3) + 2];
+			for (i = 1; i < 4; ++i)
+				rb3_fmi_extend1(&fmi, &lo, &hi, (x >> (i * 2) & 3) + 1);
+			n0 = rb3_ssa_multi(0, &fmi, fmi.ssa, lo, hi, hi - lo, p0);
+			n1 = rb3_srindex_multi(0, &fmi, sr, lo, hi, hi - lo, p1);
+			qsort(p0, n0, sizeof(rb3_pos_t), pos_cmp);
+			qsort(p1, n1, sizeof(rb3_pos_t), pos_cmp);
+			if (n0 != n1 || memcmp(p0, p1, n0 * sizeof(rb3_pos_t)) != 0) {
+				fprintf(stderr, "FAIL: srindex_multi s=%d 4-mer=%ld\n", ss[si], (long)x);
+				ret = 1;
+				break;
+			}
+		}
+		rb3_srindex_destroy(sr);
+	}
+	if (ret == 0) fprintf(stderr, "test_srindex_multi: PASS\n");
+	free(p0); free(p1);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+/*
+ * Test the SR-index update after appending sequences: updating the index of
+ * the first 8 of 16 sequences gives the same file as building it from scratch.
+ */
+static int test_srindex_update(void)
+{
+	rb3_fmi_t fa = {0}, fab = {0};
+	int32_t si, ss[] = {1, 4, 16}, ret = 0;
+
+	build_random_fmd(&fa, 8, 120, 3, 59);
+	build_random_fmd(&fab, 16, 120, 3, 59); // the same first 8 sequences
+	for (si = 0; si < 3 && ret == 0; ++si) {
+		rb3_srindex_t *sr0, *sr1, *sr2;
+		FILE *fp1 = tmpfile(), *fp2 = tmpfile();
+		int64_t l1, l2, i;
+		sr0 = rb3_srindex_build(&fa, ss[si], 1);
+		sr1 = rb3_srindex_build(&fab, ss[si], 1);
+		sr2 = rb3_srindex_update(sr0, &fab, 2, 1); // spill all samples
+		l1 = rb3_srindex_write(sr1, fp1);
+		l2 = sr2? rb3_srindex_write(sr2, fp2) : -1;
+		rewind(fp1), rewind(fp2);
+		for (i = 0; l1 == l2 && i < l1; ++i)
+			if (fgetc(fp1) != fgetc(fp2)) break;
+		if (l1 != l2 || i < l1) {
+			fprintf(stderr, "FAIL: srindex_update s=%d differs from a fresh build\n", ss[si]);
+			ret = 1;
+		}
+		if (rb3_srindex_update(sr1, &fa, 1, RB3_SRI_MAX_MEM) != 0) { // fewer sequences than sr1
+			fprintf(stderr, "FAIL: srindex_update s=%d accepts a smaller index\n", ss[si]);
+			ret = 1;
+		}
+		fclose(fp1); fclose(fp2);
+		rb3_srindex_destroy(sr0); rb3_srindex_destroy(sr1); rb3_srindex_destroy(sr2);
+	}
+	if (ret == 0) fprintf(stderr, "test_srindex_update: PASS\n");
+	rb3_fmi_free(&fa);
+	rb3_fmi_free(&fab);
+	return ret;
+}
+
 int main(void)
 {
 	int ret = 0;
@@ -600,6 +773,10 @@ int main(void)
 
 	rb3_verbose = 3;
 
+	ret |= test_ef();
+	ret |= test_srindex_multi();
+	ret |= test_srindex_update();
+
 	for (si = 0; si < n_s; ++si) {
 		int32_t s = s_values[si];
 		printf("========== Testing with s=%d ==========\n\n", s);
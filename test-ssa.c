@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rb3priv.h"
+#include "fm-index.h"
+#include "test-fmd.h"
+
+/*
+ * Test the locate cache: positions are the same with and without the cache,
+ * including when the cache is small enough to evict entries.
+ */
+static int test_pcache(void)
+{
+	rb3_fmi_t fmi = {0};
+	int32_t k = 3, ci, pass, mi, ret = 0;
+	int64_t x, max_poses[] = {3, 1000}, caps[] = {1<<20, 256}, n_hit, n_miss;
+	rb3_pos_t *p0, *p1;
+
+	build_random_fmd(&fmi, 5, 200, 6, 31);
+	fmi.ssa = rb3_ssa_gen(&fmi, 2, 1);
+	p0 = RB3_MALLOC(rb3_pos_t, fmi.acc[RB3_ASIZE]);
+	p1 = RB3_MALLOC(rb3_pos_t, fmi.acc[RB3_ASIZE]);
+	for (ci = 0; ci < 2; ++ci) {
+		fmi.pc = rb3_pcache_init(caps[ci]);
+		for (pass = 0; pass < 2; ++pass) {
+			for (x = 0; x < 1<<(k*2); ++x) {
+				int64_t lo, hi, n0, n1, i;
+				lo = fmi.acc[(x & 3) + 1], hi = fmi.acc[(x & 3) + 2];
+				for (i = 1; i < k; ++i)
+					rb3_fmi_extend1(&fmi, &lo, &hi, (x >> (i * 2) & 3) + 1);
+				for (mi = 0; mi < 2; ++mi) {
+					n0 = rb3_ssa_multi(0, &fmi, fmi.ssa, lo, hi, max_poses[mi], p0);
+					n1 = rb3_fmi_locate(0, &fmi, lo, hi, max_poses[mi], p1);
+					if (n0 != n1 || memcmp(p0, p1, n0 * sizeof(rb3_pos_t)) != 0) {
+						fprintf(stderr, "FAIL: pcache cap=%ld pass=%d k-mer=%ld max_pos=%ld\n", (long)caps[ci], pass, (long)x, (long)max_poses[mi]);
+						ret = 1; goto done;
+					}
+				}
+			}
+		}
+		rb3_pcache_stat(fmi.pc, &n_hit, &n_miss);
+		if (n_hit == 0) {
+			fprintf(stderr, "FAIL: pcache cap=%ld has no hits\n", (long)caps[ci]);
+			ret = 1; goto done;
+		}
+		rb3_pcache_destroy(fmi.pc);
+		fmi.pc = 0;
+	}
+	fprintf(stderr, "test_pcache: PASS\n");
+done:
+	free(p0); free(p1);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+/*
+ * Test batched SSA locate: every interval, including nested, duplicate and
+ * empty ones, gets the same positions in the same order as rb3_ssa_multi().
+ */
+static int test_ssa_batch(void)
+{
+	rb3_fmi_t fmi = {0};
+	int32_t n = 0, i, mi, ret = 0;
+	int64_t x, lo[400], hi[400], n_pos[400], max_poses[] = {1, 7, 500};
+	rb3_pos_t *p0, **p1;
+
+	build_random_fmd(&fmi, 6, 250, 10, 37);
+	fmi.ssa = rb3_ssa_gen(&fmi, 3, 1);
+	for (x = 0; x < 64; ++x) { // all 3-mers
+		lo[n] = fmi.acc[(x & 3) + 1], hi[n] = fmi.acc[(x & 3) + 2];
+		rb3_fmi_extend1(&fmi, &lo[n], &hi[n], (x >> 2 & 3) + 1);
+		rb3_fmi_extend1(&fmi, &lo[n], &hi[n], (x >> 4 & 3) + 1);
+		++n;
+	}
+	for (x = 0; x < 64; ++x) { // intervals nested in the 3-mers
+		int64_t l = hi[x] - lo[x];
+		if (l < 2) continue;
+		lo[n] = lo[x] + 1, hi[n] = hi[x], ++n;
+		lo[n] = lo[x], hi[n] = lo[x] + l / 2, ++n;
+		lo[n] = lo[x] + l / 3, hi[n] = lo[x] + l / 3 + 1, ++n;
+	}
+	for (i = 0; i < 64; ++i) { // random intervals and duplicates
+		int64_t a = rand() % fmi.acc[RB3_ASIZE], b = rand() % fmi.acc[RB3_ASIZE];
+		lo[n] = a < b? a : b, hi[n] = a < b? b : a;
+		++n;
+		lo[n] = lo[i * 2 % n], hi[n] = hi[i * 2 % n];
+		++n;
+	}
+	p0 = RB3_MALLOC(rb3_pos_t, fmi.acc[RB3_ASIZE]);
+	p1 = RB3_CALLOC(rb3_pos_t*, n);
+	for (mi = 0; mi < 3 && ret == 0; ++mi) {
+		int64_t max_pos = max_poses[mi];
+		for (i = 0; i < n; ++i)
+			p1[i] = RB3_MALLOC(rb3_pos_t, hi[i] - lo[i] < max_pos? hi[i] - lo[i] + 1 : max_pos);
+		rb3_ssa_multi_batch(0, &fmi, fmi.ssa, n, lo, hi, max_pos, n_pos, p1);
+		for (i = 0; i < n; ++i) {
+			int64_t n0 = rb3_ssa_multi(0, &fmi, fmi.ssa, lo[i], hi[i], max_pos, p0);
+			if (n0 != n_pos[i] || memcmp(p0, p1[i], n0 * sizeof(rb3_pos_t)) != 0) {
+				fprintf(stderr, "FAIL: ssa_batch interval %d [%ld,%ld) max_pos=%ld\n", i, (long)lo[i], (long)hi[i], (long)max_pos);
+				ret = 1;
+				break;
+			}
+		}
+		for (i = 0; i < n; ++i) free(p1[i]);
+	}
+	if (ret == 0) fprintf(stderr, "test_ssa_batch: PASS (%d intervals)\n", n);
+	free(p1); free(p0);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+/*
+ * Test the aligned SSA format: a dumped SSA mapped with
+ * rb3_ssa_restore_mmap() is identical to the one in memory.
+ */
+static int test_ssa_mmap(void)
+{
+	rb3_fmi_t fmi = {0};
+	rb3_ssa_t *sa;
+	const char *fn = "/tmp/test-ssa.ssa";
+	int ret = 0;
+
+	build_random_fmd(&fmi, 5, 300, 10, 41);
+	fmi.ssa = rb3_ssa_gen(&fmi, 3, 1);
+	if (rb3_ssa_dump(fmi.ssa, fn) != 0 || (sa = rb3_ssa_restore_mmap(fn)) == 0) {
+		fprintf(stderr, "FAIL: ssa_mmap: failed to dump or map %s\n", fn);
+		rb3_fmi_free(&fmi);
+		return 1;
+	}
+	if (sa->mm == 0 || sa->ss != fmi.ssa->ss || sa->ms != fmi.ssa->ms || sa->m != fmi.ssa->m || sa->n_ssa != fmi.ssa->n_ssa
+		|| sa->wr != fmi.ssa->wr || sa->ws != fmi.ssa->ws || sa->ws >= 64
+		|| memcmp(sa->r2i, fmi.ssa->r2i, (sa->m * sa->wr / 64 + 1) * 8) != 0 || memcmp(sa->ssa, fmi.ssa->ssa, (sa->n_ssa * sa->ws / 64 + 1) * 8) != 0) {
+		fprintf(stderr, "FAIL: ssa_mmap: mapped SSA differs\n");
+		ret = 1;
+	}
+	rb3_ssa_destroy(sa);
+	if (ret == 0 && (sa = rb3_ssa_restore(fn)) != 0) { // the heap loader reads the same file
+		if (sa->mm != 0 || memcmp(sa->ssa, fmi.ssa->ssa, (sa->n_ssa * sa->ws / 64 + 1) * 8) != 0) {
+			fprintf(stderr, "FAIL: ssa_mmap: restored SSA differs\n");
+			ret = 1;
+		}
+		rb3_ssa_destroy(sa);
+	}
+	unlink(fn);
+	if (ret == 0) fprintf(stderr, "test_ssa_mmap: PASS (%ld samples)\n", (long)fmi.ssa->n_ssa);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+/*
+ * Test bit-packed SSA: an unpacked "SSA\1" file of random entries is packed
+ * on loading, and every entry reads back with rb3_ssa_get()/rb3_ssa_r2i().
+ */
+static int test_ssa_packed(void)
+{
+	const char *fn = "/tmp/test-ssa.ssa";
+	int32_t w, y;
+	int64_t i, m = 37, n = 1000;
+	uint64_t *a;
+	rb3_ssa_t *sa;
+	int ret = 0;
+	FILE *fp;
+
+	a = RB3_MALLOC(uint64_t, n);
+	for (w = 1; w <= 64 && ret == 0; ++w) {
+		uint64_t mask = ~0ULL >> (64 - w);
+		srand(w);
+		for (i = 0; i < n; ++i)
+			a[i] = ((uint64_t)rand() << 42 ^ (uint64_t)rand() << 21 ^ (uint64_t)rand()) & mask;
+		a[n / 2] = mask; // ws must be w
+		fp = fopen(fn, "wb");
+		fwrite("SSA\1", 1, 4, fp);
+		y = 4; fwrite(&y, 4, 1, fp);
+		y = 6; fwrite(&y, 4, 1, fp);
+		fwrite(&m, 8, 1, fp);
+		fwrite(&n, 8, 1, fp);
+		for (i = 0; i < m; ++i) {
+			uint64_t x = m - 1 - i;
+			fwrite(&x, 8, 1, fp);
+		}
+		fwrite(a, 8, n, fp);
+		fclose(fp);
+		sa = rb3_ssa_restore_mmap(fn); // falls back to packing in memory
+		if (sa == 0 || sa->ws != w || sa->wr != 6) {
+			fprintf(stderr, "FAIL: ssa_packed: w=%d: wrong width\n", w);
+			ret = 1;
+		}
+		for (i = 0; ret == 0 && i < n; ++i)
+			if (rb3_ssa_get(sa, i) != a[i]) {
+				fprintf(stderr, "FAIL: ssa_packed: w=%d: entry %ld differs\n", w, (long)i);
+				ret = 1;
+			}
+		for (i = 0; ret == 0 && i < m; ++i)
+			if (rb3_ssa_r2i(sa, i) != m - 1 - i) {
+				fprintf(stderr, "FAIL: ssa_packed: w=%d: r2i[%ld] differs\n", w, (long)i);
+				ret = 1;
+			}
+		rb3_ssa_destroy(sa);
+	}
+	free(a);
+	unlink(fn);
+	if (ret == 0) fprintf(stderr, "test_ssa_packed: PASS\n");
+	return ret;
+}
+
+/*
+ * Test SSA generation on sequences of very different lengths: the position of
+ * every BWT row, derived with one full LF walk per sequence, is reported by
+ * rb3_ssa() for the SSA generated with one or several threads.
+ */
+static int test_ssa_gen_unequal(void)
+{
+	int32_t lens[] = {3000, 5, 1, 40, 700, 2}, n_seq = 6, i, j, t, ret = 0;
+	int64_t len = 0, l = 0, k, *pos, *sid;
+	char *seq;
+	rb3_fmi_t fmi = {0};
+
+	for (i = 0; i < n_seq; ++i) len += 2 * (lens[i] + 1);
+	seq = (char*)malloc(len + 1);
+	srand(53);
+	for (i = 0; i < n_seq; ++i) {
+		for (j = 0; j < lens[i]; ++j)
+			seq[l + j] = 1 + rand() % 4;
+		seq[l + lens[i]] = 0;
+		for (j = 0; j < lens[i]; ++j)
+			seq[l + lens[i] + 1 + j] = 5 - seq[l + lens[i] - 1 - j];
+		seq[l + 2 * lens[i] + 1] = 0;
+		l += 2 * (lens[i] + 1);
+	}
+	rb3_build_sais(n_seq * 2, len, seq, 1);
+	rb3_fmi_init(&fmi, rb3_enc_plain2rld(len, (uint8_t*)seq, 3), 0);
+	free(seq);
+
+	pos = RB3_MALLOC(int64_t, fmi.acc[RB3_ASIZE]);
+	sid = RB3_MALLOC(int64_t, fmi.acc[RB3_ASIZE]);
+	for (k = 0; k < fmi.acc[1]; ++k) { // ground truth: walk each sequence from its sentinel
+		int64_t x = k, ok[RB3_ASIZE], n = 0, *row = RB3_MALLOC(int64_t, fmi.acc[RB3_ASIZE]);
+		int c;
+		while ((c = rb3_fmi_rank1a(&fmi, x, ok)) != 0)
+			x = row[n++] = fmi.acc[c] + ok[c];
+		for (j = 0; j < n; ++j)
+			pos[row[j]] = n - 1 - j, sid[row[j]] = k;
+		free(row);
+	}
+	for (t = 1; t <= 4 && ret == 0; t += 3) {
+		rb3_ssa_t *sa = rb3_ssa_gen(&fmi, 3, t);
+		for (k = fmi.acc[1]; k < fmi.acc[RB3_ASIZE] && ret == 0; ++k) {
+			int64_t si, p = rb3_ssa(&fmi, sa, k, &si);
+			if (p != pos[k] || si != sid[k]) {
+				fprintf(stderr, "FAIL: ssa_gen_unequal: %d threads: row %ld at (%ld,%ld), expected (%ld,%ld)\n",
+						t, (long)k, (long)si, (long)p, (long)sid[k], (long)pos[k]);
+				ret = 1;
+			}
+		}
+		rb3_ssa_destroy(sa);
+	}
+	if (ret == 0) fprintf(stderr, "test_ssa_gen_unequal: PASS\n");
+	free(pos); free(sid);
+	rb3_fmi_free(&fmi);
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+	ret |= test_pcache();
+	ret |= test_ssa_batch();
+	ret |= test_ssa_mmap();
+	ret |= test_ssa_packed();
+	ret |= test_ssa_gen_unequal();
+	if (ret == 0)
+		fprintf(stderr, "\nAll tests PASSED\n");
+	else
+		fprintf(stderr, "\nSome tests FAILED\n");
+	return ret;
+}